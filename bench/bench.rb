@@ -0,0 +1,273 @@
+# Benchmarks Ruby/SMB against a throwaway smbd (see smbd_fixture.rb), or
+# against BENCH_URL if set, or through the local backend with emulated
+# latency if BENCH_BACKEND=local, and writes the results as JSON.
+# Workloads that create their files directly in the share (gets,
+# small_files, dir_listing, stat_storm) need BENCH_LOCAL, the share's
+# local path, with BENCH_URL and are skipped without it.
+#
+#   rake bench                               run everything
+#   BENCH_ONLY=seq_read,stat_storm rake bench
+#   BENCH_DIRS=10000,100000,1000000 rake bench
+#   BENCH_BACKEND=local BENCH_LATENCY=0.0005 BENCH_BANDWIDTH=100e6 rake bench
+#   ruby bench/bench.rb --compare old.json new.json
+#
+# Results go to BENCH_OUT (default bench/results/<time>.json); each
+# entry has ops, seconds, ops_per_sec, mb_per_sec, latency percentiles
+# in seconds and the Ruby objects allocated per op.
+
+require 'json'
+require 'time'
+require 'fileutils'
+require File.join(File.dirname(__FILE__), "smbd_fixture")
+
+module Bench
+  CHUNK = 65536
+
+  class Run
+    attr_reader :latencies, :bytes
+
+    def initialize
+      @latencies = []
+      @bytes = 0
+    end
+
+    def op(bytes = 0)
+      start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      result = yield
+      @latencies << Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+      @bytes += bytes
+      result
+    end
+  end
+
+  def self.sizes(env, default)
+    (ENV[env] || default).split(",").map do |s|
+      n = s.to_f
+      n *= 1024 if s =~ /k$/i
+      n *= 1024 * 1024 if s =~ /m$/i
+      n *= 1024 * 1024 * 1024 if s =~ /g$/i
+      n.to_i
+    end
+  end
+
+  def self.percentile(sorted, p)
+    return 0.0 if sorted.empty?
+    sorted[[(sorted.size * p).ceil - 1, 0].max]
+  end
+
+  class Suite
+    def initialize(url, local)
+      @url = url
+      @local = local
+      @repeat = (ENV["BENCH_REPEAT"] || 3).to_i
+      @only = ENV["BENCH_ONLY"] && ENV["BENCH_ONLY"].split(",")
+      @results = []
+    end
+
+    def run
+      seq_write
+      seq_read
+      gets_lines
+      small_files
+      dir_listing
+      stat_storm
+      @results
+    end
+
+    private
+
+    def wanted?(name)
+      @only.nil? || @only.include?(name)
+    end
+
+    # wanted and able to run: set up through the share's local path
+    def wanted_local?(name)
+      return false unless wanted?(name)
+      $stderr.puts "skipping #{name}: needs BENCH_LOCAL with BENCH_URL" unless @local
+      !@local.nil?
+    end
+
+    def measure(name, params = {})
+      return unless wanted?(name)
+      run = Run.new
+      GC.start
+      allocated = GC.stat(:total_allocated_objects)
+      start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      @repeat.times { yield run }
+      seconds = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+      allocated = GC.stat(:total_allocated_objects) - allocated
+      sorted = run.latencies.sort
+      ops = sorted.size
+      result = {
+        "name" => name,
+        "params" => params,
+        "ops" => ops,
+        "seconds" => seconds,
+        "ops_per_sec" => ops / seconds,
+        "mb_per_sec" => run.bytes / seconds / (1024 * 1024),
+        "p50" => Bench.percentile(sorted, 0.5),
+        "p90" => Bench.percentile(sorted, 0.9),
+        "p99" => Bench.percentile(sorted, 0.99),
+        "max" => sorted.last || 0.0,
+        "allocations_per_op" => ops > 0 ? allocated.to_f / ops : 0.0
+      }
+      @results << result
+      $stderr.printf("%-14s %-24s %10.1f ops/s %9.2f MB/s  p99 %8.3f ms\n",
+                     name, params.map { |k, v| "#{k}=#{v}" }.join(" "),
+                     result["ops_per_sec"], result["mb_per_sec"], result["p99"] * 1000)
+      result
+    end
+
+    def local_path(name)
+      raise "#{name} needs the local fixture" unless @local
+      File.join(@local, name)
+    end
+
+    def seq_write
+      Bench.sizes("BENCH_SIZES", "4k,1m,64m").each do |size|
+        chunk = "x" * [size, CHUNK].min
+        measure("seq_write", "size" => size) do |run|
+          SMB::File.open(@url + "seq.#{size}", "w") do |f|
+            written = 0
+            while written < size
+              run.op(chunk.size) { f.write chunk }
+              written += chunk.size
+            end
+          end
+        end
+      end
+    end
+
+    def seq_read
+      return unless wanted?("seq_read")
+      Bench.sizes("BENCH_SIZES", "4k,1m,64m").each do |size|
+        SMB::File.open(@url + "seq.#{size}", "w") { |f| f.write "x" * size } unless wanted?("seq_write")
+        measure("seq_read", "size" => size) do |run|
+          SMB::File.open(@url + "seq.#{size}") do |f|
+            while data = run.op(CHUNK) { f.read CHUNK }
+            end
+          end
+        end
+      end
+    end
+
+    def gets_lines
+      return unless wanted_local?("gets")
+      lines = (ENV["BENCH_LINES"] || 200000).to_i
+      File.open(local_path("lines.txt"), "w") do |f|
+        lines.times { |i| f.puts "line #{i} " + "y" * (i % 80) }
+      end
+      measure("gets", "lines" => lines) do |run|
+        SMB::File.open(@url + "lines.txt") do |f|
+          while line = run.op { f.gets }
+          end
+        end
+      end
+    end
+
+    def small_files
+      return unless wanted_local?("small_files")
+      count = (ENV["BENCH_FILES"] || 1000).to_i
+      FileUtils.mkdir_p local_path("small")
+      count.times { |i| File.open(local_path("small/f#{i}"), "w") { |f| f.write "z" * 1024 } }
+      measure("small_files", "files" => count, "size" => 1024) do |run|
+        count.times do |i|
+          run.op(1024) { SMB::File.open(@url + "small/f#{i}") { |f| f.read } }
+        end
+      end
+    end
+
+    def dir_listing
+      return unless wanted_local?("dir_listing")
+      Bench.sizes("BENCH_DIRS", "10000,100000").each do |entries|
+        dir = local_path("dir#{entries}")
+        unless File.directory?(dir)
+          FileUtils.mkdir_p dir
+          entries.times { |i| File.open(File.join(dir, "e#{i}"), "w") {} }
+        end
+        measure("dir_listing", "entries" => entries) do |run|
+          run.op { SMB::Dir.entries(@url + "dir#{entries}/") }
+        end
+        FileUtils.rm_rf dir
+      end
+    end
+
+    def stat_storm
+      return unless wanted_local?("stat_storm")
+      count = (ENV["BENCH_FILES"] || 1000).to_i
+      unless File.directory?(local_path("small"))
+        FileUtils.mkdir_p local_path("small")
+        count.times { |i| File.open(local_path("small/f#{i}"), "w") {} }
+      end
+      measure("stat_storm", "files" => count) do |run|
+        count.times { |i| run.op { SMB.stat(@url + "small/f#{i}") } }
+      end
+    end
+  end
+
+  def self.compare(old_path, new_path)
+    key = lambda { |r| [r["name"], r["params"].to_a.sort] }
+    old = JSON.parse(File.read(old_path))["results"].map { |r| [key.call(r), r] }.to_h
+    JSON.parse(File.read(new_path))["results"].each do |r|
+      o = old[key.call(r)]
+      next unless o
+      printf("%-14s %-24s ops/s %7.2fx  p99 %7.2fx  allocs/op %7.2fx\n",
+             r["name"], r["params"].map { |k, v| "#{k}=#{v}" }.join(" "),
+             r["ops_per_sec"] / o["ops_per_sec"],
+             o["p99"] > 0 ? r["p99"] / o["p99"] : 0,
+             o["allocations_per_op"] > 0 ? r["allocations_per_op"] / o["allocations_per_op"] : 0)
+    end
+  end
+
+  def self.main(argv)
+    if argv[0] == "--compare"
+      compare(argv[1], argv[2])
+      return
+    end
+    require 'smb'
+
+    fixture = nil
+    root = nil
+    if ENV["BENCH_BACKEND"] == "local"
+      root = Dir.mktmpdir("rubysmb-bench")
+      local = File.join(root, "bench", "share")
+      FileUtils.mkdir_p local
+      SMB.use_backend :local, :root => root,
+        :latency => (ENV["BENCH_LATENCY"] || 0).to_f,
+        :bandwidth => (ENV["BENCH_BANDWIDTH"] || 0).to_f
+      url = "smb://bench/share/"
+    elsif ENV["BENCH_URL"]
+      url = ENV["BENCH_URL"]
+      url += "/" unless url.end_with?("/")
+      local = ENV["BENCH_LOCAL"]
+    else
+      fixture = SmbdFixture.new.start
+      SMB.configure :port => fixture.port
+      SMB.on_authentication { |server, share| ["BENCH", "guest", ""] }
+      url = fixture.url
+      local = fixture.share_path
+    end
+
+    begin
+      results = Suite.new(url, local).run
+    ensure
+      fixture.stop if fixture
+      FileUtils.rm_rf root if root
+    end
+
+    out = ENV["BENCH_OUT"] ||
+      File.join(File.dirname(__FILE__), "results", Time.now.strftime("%Y%m%d-%H%M%S") + ".json")
+    FileUtils.mkdir_p File.dirname(out)
+    File.open(out, "w") do |f|
+      f.write JSON.pretty_generate("ruby" => RUBY_DESCRIPTION,
+                                   "time" => Time.now.iso8601,
+                                   "revision" => `git rev-parse --short HEAD 2>/dev/null`.chomp,
+                                   "url" => url,
+                                   "backend" => SMB.backend.to_s,
+                                   "results" => results)
+    end
+    $stderr.puts "results written to #{out}"
+  end
+end
+
+Bench.main(ARGV) if $0 == __FILE__
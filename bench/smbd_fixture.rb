@@ -0,0 +1,111 @@
+# A throwaway smbd serving a temporary directory as a guest share on
+# loopback, for the benchmarks. Needs smbd in $PATH (or $SMBD); runs
+# unprivileged on a high port.
+
+require 'tmpdir'
+require 'fileutils'
+require 'socket'
+require 'etc'
+
+class SmbdFixture
+  attr_reader :root, :share_path, :port
+
+  def initialize(port = nil)
+    @port = port || free_port
+    @root = Dir.mktmpdir("rubysmb-bench")
+    @share_path = File.join(@root, "share")
+    @pid = nil
+  end
+
+  def url
+    "smb://127.0.0.1/bench/"
+  end
+
+  def start
+    %w(share private lock state cache pid log).each do |d|
+      FileUtils.mkdir_p File.join(@root, d)
+    end
+    conf = File.join(@root, "smb.conf")
+    File.open(conf, "w") { |f| f.write config }
+    smbd = ENV["SMBD"] || "smbd"
+    @pid = Process.spawn(smbd, "--foreground", "--no-process-group",
+                         "--debug-stdout", "-d", "0", "-s", conf,
+                         :out => File.join(@root, "log", "smbd.out"),
+                         :err => [:child, :out])
+    wait_ready
+    self
+  rescue Errno::ENOENT
+    cleanup
+    raise "smbd not found; install samba or set SMBD"
+  end
+
+  def stop
+    if @pid
+      Process.kill("TERM", @pid) rescue nil
+      Process.wait(@pid) rescue nil
+      @pid = nil
+    end
+    cleanup
+  end
+
+  private
+
+  def config
+    user = Etc.getpwuid(Process.uid).name
+    <<CONF
+[global]
+  server role = standalone server
+  workgroup = BENCH
+  smb ports = #{@port}
+  interfaces = lo
+  bind interfaces only = yes
+  disable netbios = yes
+  load printers = no
+  printing = bsd
+  printcap name = /dev/null
+  disable spoolss = yes
+  map to guest = Bad User
+  guest account = #{user}
+  private dir = #{@root}/private
+  lock directory = #{@root}/lock
+  state directory = #{@root}/state
+  cache directory = #{@root}/cache
+  pid directory = #{@root}/pid
+  log file = #{@root}/log/log.%m
+  server min protocol = SMB2_02
+
+[bench]
+  path = #{@share_path}
+  guest ok = yes
+  guest only = yes
+  read only = no
+  force user = #{user}
+CONF
+  end
+
+  def free_port
+    server = TCPServer.new("127.0.0.1", 0)
+    server.addr[1]
+  ensure
+    server.close if server
+  end
+
+  def wait_ready
+    deadline = Time.now + 15
+    begin
+      TCPSocket.new("127.0.0.1", @port).close
+    rescue Errno::ECONNREFUSED
+      if Process.wait(@pid, Process::WNOHANG)
+        @pid = nil
+        raise "smbd exited, see #{@root}/log/smbd.out"
+      end
+      raise "smbd did not come up on port #{@port}" if Time.now > deadline
+      sleep 0.1
+      retry
+    end
+  end
+
+  def cleanup
+    FileUtils.rm_rf @root unless ENV["BENCH_KEEP"]
+  end
+end
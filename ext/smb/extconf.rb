@@ -6,8 +6,17 @@ dir_config "smb"
 with_cppflags(ENV['CPPFLAGS']) do
 	h = have_header("libsmbclient.h")
 	l = have_library("smbclient", "smbc_init", "libsmbclient.h")
+	t = have_header("ruby/thread.h") && have_library("pthread", "pthread_create", "pthread.h")
 
-	if( h && l )
+	if( h && l && t )
+  	have_func("smbc_thread_posix", "libsmbclient.h")
+  	have_func("smbc_readdirplus2", "libsmbclient.h")
+  	have_func("smbc_notify", "libsmbclient.h")
+  	have_func("smbc_setOptionProtocols", "libsmbclient.h")
+  	have_func("smbc_setConfiguration", "libsmbclient.h")
+  	have_header("sys/sdt.h")
+  	have_library("z", "inflate", "zlib.h") and have_header("zlib.h")
+  	have_library("zstd", "ZSTD_decompressStream", "zstd.h") and have_header("zstd.h")
   	create_makefile "smb"
 	else
   	print "Cannot create Makefile\n"
@@ -31,6 +31,22 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include "smbstat.h"
 #include "smbdir.h"
 #include "smbutil.h"
+#include "smbctx.h"
+#include "smbwalk.h"
+#include "smbglob.h"
+#include "smbmirror.h"
+#include "smbbatch.h"
+#include "smbdu.h"
+#include "smbindex.h"
+#include "smbwatch.h"
+#include "smbconn.h"
+#include "smbconfig.h"
+#include "smbmetrics.h"
+#include "smbtrace.h"
+#include "smbbackend.h"
+#include "smburl.h"
+#include "smbxattr.h"
+#include "smbchunk.h"
 
 static VALUE auth_callback;
 
@@ -63,12 +79,14 @@ static VALUE smb_open(int argc, VALUE *argv, VALUE self)
 
 VALUE smb_rename(VALUE self, VALUE oldurl, VALUE newurl)
 {
-  Check_SafeStr(oldurl);
-  Check_SafeStr(newurl);
+  StringValue(oldurl);
+  StringValue(newurl);
 
   if (smbc_rename(RSTRING(oldurl)->as.heap.ptr, RSTRING(newurl)->as.heap.ptr) < 0) {
     rb_sys_fail(RSTRING(oldurl)->as.heap.ptr);
   }
+  smb_invalidate_tree(RSTRING(oldurl)->as.heap.ptr);
+  smb_invalidate_tree(RSTRING(newurl)->as.heap.ptr);
 
   return INT2FIX(0);
 }
@@ -77,73 +95,272 @@ VALUE smb_stat(VALUE self, VALUE url)
 {
   struct stat st;
 
-  Check_SafeStr(url);
+  StringValue(url);
 
-  if (smbc_stat(RSTRING(url)->as.heap.ptr, &st) < 0) {
+  if (stat_cached(RSTRING(url)->as.heap.ptr, &st) < 0) {
     rb_sys_fail(RSTRING(url)->as.heap.ptr);
   }
 
   return stat_new(&st);
 }
 
-static void auth_fn(const char *server, const char *share,
-	     char *workgroup, int wgmaxlen,
-	     char *username, int unmaxlen,
-	     char *password, int pwmaxlen)
+/*
+  Drops everything the listing and metadata caches know about url and its
+  parent directory. The _tree variant also drops everything below url.
+*/
+
+void smb_invalidate(const char *url)
+{
+  dircache_invalidate(url);
+  statcache_invalidate(url);
+}
+
+void smb_invalidate_tree(const char *url)
+{
+  dircache_invalidate_tree(url);
+  statcache_invalidate_tree(url);
+}
+
+struct auth_args {
+  const char *server;
+  const char *share;
+  char *workgroup;
+  int wgmaxlen;
+  char *username;
+  int unmaxlen;
+  char *password;
+  int pwmaxlen;
+};
+
+static VALUE auth_call(VALUE arg)
 {
+  struct auth_args *a = (struct auth_args*)arg;
   VALUE ary;
   VALUE wg;
   VALUE un;
   VALUE pw;
 
-  if (auth_callback == (VALUE)NULL) {
-    return;
-  }
-
   ary = rb_funcall(auth_callback, rb_intern("call"), 5,
-	     rb_str_new2(server),
-	     rb_str_new2(share),
-	     rb_str_new2(workgroup),
-	     rb_str_new2(username),
-	     rb_str_new2(password));
+	     rb_str_new2(a->server),
+	     rb_str_new2(a->share),
+	     rb_str_new2(a->workgroup),
+	     rb_str_new2(a->username),
+	     rb_str_new2(a->password));
   if (TYPE(ary) != T_ARRAY) {
-    return;
+    return Qfalse;
   }
-  if (RARRAY(ary)->as.heap.len != 3) {
+  if (RARRAY_LEN(ary) != 3) {
     rb_raise(eSmbError, "array should contain workgroup, username and password to use as authentication");
   }
   
-  wg = RARRAY(ary)->as.heap.ptr[1];
-  un = RARRAY(ary)->as.heap.ptr[0];
-  pw = RARRAY(ary)->as.heap.ptr[2];
+  wg = RARRAY_PTR(ary)[1];
+  un = RARRAY_PTR(ary)[0];
+  pw = RARRAY_PTR(ary)[2];
 
   if (!NIL_P(wg)) {
-    Check_SafeStr(wg);
-    if (RSTRING(wg)->as.heap.len > wgmaxlen - 1) {
+    StringValue(wg);
+    if (RSTRING_LEN(wg) > a->wgmaxlen - 1) {
       rb_raise(eSmbError, "workgroup too long");
     }
-    strcpy(workgroup, RSTRING(wg)->as.heap.ptr);
+    strcpy(a->workgroup, StringValuePtr(wg));
   }
   if (!NIL_P(un)) {
-    Check_SafeStr(un);
-    if (RSTRING(un)->as.heap.len > unmaxlen - 1) {
+    StringValue(un);
+    if (RSTRING_LEN(un) > a->unmaxlen - 1) {
       rb_raise(eSmbError, "username too long");
     }
-    strcpy(username, RSTRING(un)->as.heap.ptr);
+    strcpy(a->username, StringValuePtr(un));
   }
   if (!NIL_P(pw)) {
-    Check_SafeStr(pw);
-    if (RSTRING(pw)->as.heap.len > pwmaxlen - 1) {
+    StringValue(pw);
+    if (RSTRING_LEN(pw) > a->pwmaxlen - 1) {
       rb_raise(eSmbError, "password too long");
     }
-    strcpy(password, RSTRING(pw)->as.heap.ptr);
+    strcpy(a->password, StringValuePtr(pw));
+  }
+
+  return Qtrue;
+}
+
+/*
+  Explicit credentials from SMB.credentials are answered natively. Only
+  when none fits is the on_authentication callback asked, and an
+  exception from it is turned into a warning rather than unwound through
+  libsmbclient's frames; the connection then fails as unauthenticated.
+*/
+
+static void auth_fn(const char *server, const char *share,
+	     char *workgroup, int wgmaxlen,
+	     char *username, int unmaxlen,
+	     char *password, int pwmaxlen)
+{
+  struct auth_args args;
+  VALUE ok;
+  int state = 0;
+  uint64_t start;
+
+  if (ctx_lookup_auth(server, share, true, workgroup, wgmaxlen,
+		      username, unmaxlen, password, pwmaxlen)) {
+    return;
+  }
+  if (auth_callback == (VALUE)NULL) {
+    return;
+  }
+
+  args.server = server;
+  args.share = share;
+  args.workgroup = workgroup;
+  args.wgmaxlen = wgmaxlen;
+  args.username = username;
+  args.unmaxlen = unmaxlen;
+  args.password = password;
+  args.pwmaxlen = pwmaxlen;
+  start = metrics_start();
+  ok = rb_protect(auth_call, (VALUE)&args, &state);
+  metrics_end(metrics_server_named(server), METRIC_AUTH, server, start,
+	      (state == 0 && RTEST(ok) ? 0 : -1));
+  if (state != 0) {
+    VALUE msg = rb_funcall(rb_errinfo(), rb_intern("message"), 0);
+
+    rb_set_errinfo(Qnil);
+    rb_warn("authentication callback for %s/%s failed: %s", server, share,
+	    StringValueCStr(msg));
+    return;
+  }
+  if (RTEST(ok)) {
+    ctx_remember_auth(server, share, workgroup, username, password);
+  }
+}
+
+static char *cred_str(VALUE opts, const char *name)
+{
+  VALUE v = util_opt(opts, name);
+
+  if (NIL_P(v)) {
+    return NULL;
+  }
+  StringValue(v);
+
+  return StringValueCStr(v);
+}
+
+/*
+  SMB.credentials.add(:server => ..., :share => ..., :workgroup => ...,
+  :user => ..., :password => ...)
+
+  Leaving out :server or :share makes the entry apply to any. The most
+  specific entry for a connection is used, and SMB.on_authentication is
+  only called when there is none.
+*/
+
+static VALUE smbcred_add(VALUE self, VALUE opts)
+{
+  Check_Type(opts, T_HASH);
+  ctx_add_auth(cred_str(opts, "server"), cred_str(opts, "share"),
+	       cred_str(opts, "workgroup"), cred_str(opts, "user"),
+	       cred_str(opts, "password"));
+
+  return self;
+}
+
+/* SMB.credentials.remove(server, share = nil) -> number removed */
+static VALUE smbcred_remove(int argc, VALUE *argv, VALUE self)
+{
+  VALUE server;
+  VALUE share;
+
+  rb_scan_args(argc, argv, "11", &server, &share);
+
+  return INT2FIX(ctx_remove_auth(NIL_P(server) ? NULL : StringValueCStr(server),
+				 NIL_P(share) ? NULL : StringValueCStr(share)));
+}
+
+/*
+  SMB.credentials.clear -> self
+
+  Removes what add put there; credentials remembered from
+  on_authentication stay, as with remove.
+*/
+
+static VALUE smbcred_clear(VALUE self)
+{
+  ctx_clear_auth();
+
+  return self;
+}
+
+static VALUE cred_str_or_nil(const char *s)
+{
+  return (*s == '\0' ? Qnil : rb_str_new2(s));
+}
+
+static void cred_list_add(const char *server, const char *share,
+			  const char *workgroup, const char *username, void *arg)
+{
+  VALUE hash = rb_hash_new();
+
+  rb_hash_aset(hash, ID2SYM(rb_intern("server")), cred_str_or_nil(server));
+  rb_hash_aset(hash, ID2SYM(rb_intern("share")), cred_str_or_nil(share));
+  rb_hash_aset(hash, ID2SYM(rb_intern("workgroup")), cred_str_or_nil(workgroup));
+  rb_hash_aset(hash, ID2SYM(rb_intern("user")), cred_str_or_nil(username));
+  rb_ary_push(*(VALUE*)arg, hash);
+}
+
+/* SMB.credentials.list -> entries without their passwords */
+static VALUE smbcred_list(VALUE self)
+{
+  VALUE list = rb_ary_new();
+
+  ctx_each_auth(cred_list_add, &list);
+
+  return list;
+}
+
+/*
+  SMB.credentials.lookup(server, share) -> { :workgroup, :user } or nil
+
+  What a connection to server and share would authenticate with, from
+  add or remembered from on_authentication, without the password.
+*/
+
+static VALUE smbcred_lookup(VALUE self, VALUE server, VALUE share)
+{
+  char workgroup[256] = "";
+  char username[256] = "";
+  char password[256] = "";
+  VALUE hash;
+
+  if (!ctx_lookup_auth(StringValueCStr(server), StringValueCStr(share), false,
+		       workgroup, sizeof(workgroup), username, sizeof(username),
+		       password, sizeof(password))) {
+    return Qnil;
   }
+  memset(password, 0, sizeof(password));
+  hash = rb_hash_new();
+  rb_hash_aset(hash, ID2SYM(rb_intern("workgroup")), cred_str_or_nil(workgroup));
+  rb_hash_aset(hash, ID2SYM(rb_intern("user")), cred_str_or_nil(username));
+
+  return hash;
+}
+
+static VALUE smb_credentials(VALUE self)
+{
+  return mSmbCredentials;
 }
 
+/*
+  SMB.on_authentication { |server, share, workgroup, user, password| ... } -> previous
+  SMB.on_authentication(proc_or_nil) -> previous
+
+  Returns the callback it replaces, or nil, so it can be put back; nil
+  removes the callback.
+*/
+
 static VALUE smb_on_authentication(int argc, VALUE* argv, VALUE self)
 {
   VALUE proc;
   VALUE block;
+  VALUE previous = (auth_callback == (VALUE)NULL ? Qnil : auth_callback);
 
   if (argc == 0 && !rb_block_given_p()) {
     rb_raise(eSmbError, "no block or proc given");
@@ -154,24 +371,26 @@ static VALUE smb_on_authentication(int argc, VALUE* argv, VALUE self)
 
   rb_scan_args(argc, argv, "01&", &proc, &block);
   if (argc == 1) {
-    auth_callback = proc;
+    auth_callback = (NIL_P(proc) ? (VALUE)NULL : proc);
   }
   else {
     auth_callback = block;
   }
 
-  return Qnil;
+  return previous;
 }
 
 void Init_smb()
 {
   int err;
 
+  ctx_init();
   err = smbc_init(auth_fn, 1);
   if (err < 0) {
     rb_raise(rb_eRuntimeError, "Error loading libsmbclient: %s\n", strerror(errno));
   }
   auth_callback = (VALUE)NULL;
+  rb_global_variable(&auth_callback);
 
   mSMB = rb_define_module("SMB");
 
@@ -190,11 +409,34 @@ void Init_smb()
   rb_define_module_function(mSMB, "stat", smb_stat, 1);
   rb_define_module_function(mSMB, "on_authentication", smb_on_authentication, -1);
   rb_define_alias(mSMB, "on_auth", "on_authentication");
+  rb_define_module_function(mSMB, "credentials", smb_credentials, 0);
+
+  mSmbCredentials = rb_define_module_under(mSMB, "Credentials");
+  rb_define_module_function(mSmbCredentials, "add", smbcred_add, 1);
+  rb_define_module_function(mSmbCredentials, "remove", smbcred_remove, -1);
+  rb_define_module_function(mSmbCredentials, "clear", smbcred_clear, 0);
+  rb_define_module_function(mSmbCredentials, "list", smbcred_list, 0);
+  rb_define_module_function(mSmbCredentials, "lookup", smbcred_lookup, 2);
 
   eSmbError = rb_define_class_under(mSMB, "SmbError", rb_eRuntimeError);
 
   init_smbutil();
+  init_smburl();
   init_smbfile();
   init_smbstat();
   init_smbdir();
+  init_smbwalk();
+  init_smbglob();
+  init_smbmirror();
+  init_smbbatch();
+  init_smbdu();
+  init_smbindex();
+  init_smbwatch();
+  init_smbconn();
+  init_smbconfig();
+  init_smbmetrics();
+  init_smbtrace();
+  init_smbbackend();
+  init_smbxattr();
+  init_smbchunk();
 }
@@ -22,10 +22,13 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 
 VALUE mSMB;
 VALUE mSmbUtil;
+VALUE mSmbCredentials;
 VALUE cSmbFile;
 VALUE cSmbStat;
 VALUE cSmbDir;
 VALUE cSmbDirEntry;
+VALUE cSmbIndex;
+VALUE cSmbURL;
 VALUE eSmbError;
 
 struct foreach_arg {
@@ -36,5 +39,7 @@ struct foreach_arg {
 
 VALUE smb_rename(VALUE, VALUE, VALUE);
 VALUE smb_stat(VALUE, VALUE);
+void smb_invalidate(const char*);
+void smb_invalidate_tree(const char*);
 
 #endif
@@ -0,0 +1,697 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include <libsmbclient.h>
+#include <ruby.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include "rubysmb.h"
+#include "smbbackend.h"
+#include "smbctx.h"
+#include "smbmetrics.h"
+#include "smbutil.h"
+
+struct backend {
+  const char *name;
+  smbc_open_fn open;
+  smbc_creat_fn creat;
+  smbc_read_fn read;
+  smbc_write_fn write;
+  smbc_lseek_fn lseek;
+  smbc_ftruncate_fn ftruncate;
+  smbc_close_fn close;
+  smbc_fstat_fn fstat;
+  smbc_stat_fn stat;
+  smbc_unlink_fn unlink;
+  smbc_rename_fn rename;
+  smbc_opendir_fn opendir;
+  smbc_readdir_fn readdir;
+#ifdef HAVE_SMBC_READDIRPLUS2
+  smbc_readdirplus2_fn readdirplus2;
+#endif
+  smbc_telldir_fn telldir;
+  smbc_lseekdir_fn lseekdir;
+  smbc_closedir_fn closedir;
+  smbc_mkdir_fn mkdir;
+  smbc_rmdir_fn rmdir;
+  smbc_utimes_fn utimes;
+  smbc_getxattr_fn getxattr;
+#ifdef HAVE_SMBC_NOTIFY
+  smbc_notify_fn notify;
+#endif
+};
+
+static struct backend smbclient_backend;
+static struct backend local_backend;
+static const struct backend *current = NULL;
+/* SMB::File and SMB::Dir handles open on the global context */
+static long open_handles = 0;
+
+/*
+  Local backend settings. They are only changed by SMB.use_backend,
+  which isn't meant to be called while pooled operations are running.
+*/
+
+static char *local_root = NULL;
+static double local_latency[METRIC_OPS];
+static double local_default_latency = 0;
+static double local_bandwidth = 0;
+
+struct local_file {
+  int fd;
+  DIR *dir;
+  int depth;
+  struct libsmb_file_info info;
+  char name[NAME_MAX + 1];
+  union {
+    struct smbc_dirent ent;
+    char buf[sizeof(struct smbc_dirent) + NAME_MAX + 1];
+  } dirent;
+};
+
+static void local_delay(int op, size_t bytes)
+{
+  struct timespec ts;
+  double secs;
+
+  secs = (op >= 0 ? local_latency[op] : local_default_latency);
+  if (local_bandwidth > 0) {
+    secs += bytes / local_bandwidth;
+  }
+  if (secs <= 0) {
+    return;
+  }
+  ts.tv_sec = (time_t)secs;
+  ts.tv_nsec = (long)((secs - ts.tv_sec) * 1e9);
+  while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+/*
+  Maps smb://[user@]server/share/path onto root/server/share/path in buf
+  and returns the number of components below root, or -1 with errno set.
+  ".." is refused so a url can't climb out of the root.
+*/
+
+static int local_path(const char *url, char *buf, size_t size)
+{
+  const char *p = url;
+  const char *slash;
+  const char *at;
+  size_t len;
+  int depth = 0;
+
+  if (strncmp(p, "smb://", 6) == 0) {
+    p += 6;
+  }
+  slash = p + strcspn(p, "/");
+  for (at = slash; at > p && at[-1] != '@'; at--);
+  p = at;
+
+  len = strlen(local_root);
+  if (len + strlen(p) + 2 > size) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memcpy(buf, local_root, len);
+  while (*p != '\0') {
+    while (*p == '/') {
+      p++;
+    }
+    if (*p == '\0') {
+      break;
+    }
+    slash = p + strcspn(p, "/");
+    if (slash - p == 2 && p[0] == '.' && p[1] == '.') {
+      errno = EACCES;
+      return -1;
+    }
+    buf[len++] = '/';
+    memcpy(buf + len, p, slash - p);
+    len += slash - p;
+    depth++;
+    p = slash;
+  }
+  buf[len] = '\0';
+
+  return depth;
+}
+
+static SMBCFILE *local_open(SMBCCTX *ctx, const char *url, int flags, mode_t mode)
+{
+  char path[PATH_MAX];
+  struct local_file *f;
+  int fd;
+
+  local_delay(METRIC_OPEN, 0);
+  if (local_path(url, path, sizeof(path)) < 0) {
+    return NULL;
+  }
+  if ((fd = open(path, flags, (mode != 0 ? mode : 0644))) < 0) {
+    return NULL;
+  }
+  f = calloc(1, sizeof(struct local_file));
+  f->fd = fd;
+
+  return (SMBCFILE*)f;
+}
+
+static SMBCFILE *local_creat(SMBCCTX *ctx, const char *url, mode_t mode)
+{
+  return local_open(ctx, url, O_WRONLY | O_CREAT | O_TRUNC, mode);
+}
+
+static ssize_t local_read(SMBCCTX *ctx, SMBCFILE *file, void *buf, size_t count)
+{
+  ssize_t n = read(((struct local_file*)file)->fd, buf, count);
+
+  local_delay(METRIC_READ, (n > 0 ? n : 0));
+
+  return n;
+}
+
+static ssize_t local_write(SMBCCTX *ctx, SMBCFILE *file, const void *buf, size_t count)
+{
+  local_delay(METRIC_WRITE, count);
+
+  return write(((struct local_file*)file)->fd, buf, count);
+}
+
+static off_t local_lseek(SMBCCTX *ctx, SMBCFILE *file, off_t offset, int whence)
+{
+  local_delay(METRIC_LSEEK, 0);
+
+  return lseek(((struct local_file*)file)->fd, offset, whence);
+}
+
+static int local_ftruncate(SMBCCTX *ctx, SMBCFILE *file, off_t size)
+{
+  local_delay(-1, 0);
+
+  return ftruncate(((struct local_file*)file)->fd, size);
+}
+
+static int local_close(SMBCCTX *ctx, SMBCFILE *file)
+{
+  struct local_file *f = (struct local_file*)file;
+  int ret;
+
+  local_delay(-1, 0);
+  ret = close(f->fd);
+  free(f);
+
+  return ret;
+}
+
+static int local_fstat(SMBCCTX *ctx, SMBCFILE *file, struct stat *st)
+{
+  local_delay(METRIC_STAT, 0);
+
+  return fstat(((struct local_file*)file)->fd, st);
+}
+
+static int local_stat(SMBCCTX *ctx, const char *url, struct stat *st)
+{
+  char path[PATH_MAX];
+
+  local_delay(METRIC_STAT, 0);
+  if (local_path(url, path, sizeof(path)) < 0) {
+    return -1;
+  }
+
+  return stat(path, st);
+}
+
+static int local_unlink(SMBCCTX *ctx, const char *url)
+{
+  char path[PATH_MAX];
+
+  local_delay(-1, 0);
+  if (local_path(url, path, sizeof(path)) < 0) {
+    return -1;
+  }
+
+  return unlink(path);
+}
+
+static int local_rename(SMBCCTX *octx, const char *from, SMBCCTX *nctx, const char *to)
+{
+  char frompath[PATH_MAX];
+  char topath[PATH_MAX];
+
+  local_delay(-1, 0);
+  if (local_path(from, frompath, sizeof(frompath)) < 0 ||
+      local_path(to, topath, sizeof(topath)) < 0) {
+    return -1;
+  }
+
+  return rename(frompath, topath);
+}
+
+static SMBCFILE *local_opendir(SMBCCTX *ctx, const char *url)
+{
+  char path[PATH_MAX];
+  struct local_file *f;
+  DIR *dir;
+  int depth;
+
+  local_delay(METRIC_OPENDIR, 0);
+  if ((depth = local_path(url, path, sizeof(path))) < 0) {
+    return NULL;
+  }
+  if ((dir = opendir(path)) == NULL) {
+    return NULL;
+  }
+  f = calloc(1, sizeof(struct local_file));
+  f->fd = -1;
+  f->dir = dir;
+  f->depth = depth;
+
+  return (SMBCFILE*)f;
+}
+
+/*
+  The root lists servers and a server lists shares, like smb:// and
+  smb://server do; those levels have no "." and "..".
+*/
+
+static struct dirent *local_next(struct local_file *f)
+{
+  struct dirent *de;
+
+  errno = 0;
+  while ((de = readdir(f->dir)) != NULL) {
+    if (f->depth < 2 && (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)) {
+      continue;
+    }
+    break;
+  }
+
+  return de;
+}
+
+static unsigned int local_type(struct local_file *f, struct dirent *de)
+{
+  struct stat st;
+
+  if (f->depth == 0) {
+    return SMBC_SERVER;
+  }
+  if (f->depth == 1) {
+    return SMBC_FILE_SHARE;
+  }
+  if (de->d_type == DT_UNKNOWN) {
+    if (fstatat(dirfd(f->dir), de->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode)) {
+      return SMBC_DIR;
+    }
+    return SMBC_FILE;
+  }
+
+  return (de->d_type == DT_DIR ? SMBC_DIR : SMBC_FILE);
+}
+
+static struct smbc_dirent *local_readdir(SMBCCTX *ctx, SMBCFILE *file)
+{
+  struct local_file *f = (struct local_file*)file;
+  struct smbc_dirent *ent = &f->dirent.ent;
+  struct dirent *de;
+  size_t len;
+
+  local_delay(METRIC_READDIR, 0);
+  if ((de = local_next(f)) == NULL) {
+    return NULL;
+  }
+  len = strlen(de->d_name);
+  ent->smbc_type = local_type(f, de);
+  ent->comment = "";
+  ent->commentlen = 0;
+  ent->namelen = len;
+  ent->dirlen = offsetof(struct smbc_dirent, name) + len + 1;
+  memcpy(ent->name, de->d_name, len + 1);
+
+  return ent;
+}
+
+#ifdef HAVE_SMBC_READDIRPLUS2
+static const struct libsmb_file_info *local_readdirplus2(SMBCCTX *ctx, SMBCFILE *file,
+							struct stat *st)
+{
+  struct local_file *f = (struct local_file*)file;
+  struct dirent *de;
+
+  local_delay(METRIC_READDIR, 0);
+  if ((de = local_next(f)) == NULL) {
+    return NULL;
+  }
+  if (fstatat(dirfd(f->dir), de->d_name, st, 0) < 0) {
+    memset(st, 0, sizeof(struct stat));
+  }
+  memcpy(f->name, de->d_name, strlen(de->d_name) + 1);
+  memset(&f->info, 0, sizeof(f->info));
+  f->info.name = f->name;
+  f->info.short_name = f->name;
+  f->info.size = st->st_size;
+  f->info.uid = st->st_uid;
+  f->info.gid = st->st_gid;
+  f->info.mtime_ts = st->st_mtim;
+  f->info.atime_ts = st->st_atim;
+  f->info.ctime_ts = st->st_ctim;
+  f->info.btime_ts = st->st_ctim;
+
+  return &f->info;
+}
+#endif
+
+static off_t local_telldir(SMBCCTX *ctx, SMBCFILE *file)
+{
+  return telldir(((struct local_file*)file)->dir);
+}
+
+static int local_lseekdir(SMBCCTX *ctx, SMBCFILE *file, off_t offset)
+{
+  struct local_file *f = (struct local_file*)file;
+
+  if (offset == 0) {
+    rewinddir(f->dir);
+  }
+  else {
+    seekdir(f->dir, (long)offset);
+  }
+
+  return 0;
+}
+
+static int local_closedir(SMBCCTX *ctx, SMBCFILE *file)
+{
+  struct local_file *f = (struct local_file*)file;
+  int ret = closedir(f->dir);
+
+  free(f);
+
+  return ret;
+}
+
+static int local_mkdir(SMBCCTX *ctx, const char *url, mode_t mode)
+{
+  char path[PATH_MAX];
+
+  local_delay(-1, 0);
+  if (local_path(url, path, sizeof(path)) < 0) {
+    return -1;
+  }
+
+  return mkdir(path, mode);
+}
+
+static int local_rmdir(SMBCCTX *ctx, const char *url)
+{
+  char path[PATH_MAX];
+
+  local_delay(-1, 0);
+  if (local_path(url, path, sizeof(path)) < 0) {
+    return -1;
+  }
+
+  return rmdir(path);
+}
+
+static int local_utimes(SMBCCTX *ctx, const char *url, struct timeval *tv)
+{
+  char path[PATH_MAX];
+
+  local_delay(-1, 0);
+  if (local_path(url, path, sizeof(path)) < 0) {
+    return -1;
+  }
+
+  return utimes(path, tv);
+}
+
+static int local_getxattr(SMBCCTX *ctx, const char *url, const char *name,
+			  const void *value, size_t size)
+{
+  errno = ENOTSUP;
+
+  return -1;
+}
+
+#ifdef HAVE_SMBC_NOTIFY
+static int local_notify(SMBCCTX *ctx, SMBCFILE *dir, smbc_bool recursive,
+			uint32_t filter, unsigned timeout, smbc_notify_callback_fn cb,
+			void *data)
+{
+  errno = ENOTSUP;
+
+  return -1;
+}
+#endif
+
+static void backend_capture(SMBCCTX *ctx, struct backend *b)
+{
+  b->name = "libsmbclient";
+  b->open = smbc_getFunctionOpen(ctx);
+  b->creat = smbc_getFunctionCreat(ctx);
+  b->read = smbc_getFunctionRead(ctx);
+  b->write = smbc_getFunctionWrite(ctx);
+  b->lseek = smbc_getFunctionLseek(ctx);
+  b->ftruncate = smbc_getFunctionFtruncate(ctx);
+  b->close = smbc_getFunctionClose(ctx);
+  b->fstat = smbc_getFunctionFstat(ctx);
+  b->stat = smbc_getFunctionStat(ctx);
+  b->unlink = smbc_getFunctionUnlink(ctx);
+  b->rename = smbc_getFunctionRename(ctx);
+  b->opendir = smbc_getFunctionOpendir(ctx);
+  b->readdir = smbc_getFunctionReaddir(ctx);
+#ifdef HAVE_SMBC_READDIRPLUS2
+  b->readdirplus2 = smbc_getFunctionReaddirPlus2(ctx);
+#endif
+  b->telldir = smbc_getFunctionTelldir(ctx);
+  b->lseekdir = smbc_getFunctionLseekdir(ctx);
+  b->closedir = smbc_getFunctionClosedir(ctx);
+  b->mkdir = smbc_getFunctionMkdir(ctx);
+  b->rmdir = smbc_getFunctionRmdir(ctx);
+  b->utimes = smbc_getFunctionUtimes(ctx);
+  b->getxattr = smbc_getFunctionGetxattr(ctx);
+#ifdef HAVE_SMBC_NOTIFY
+  b->notify = smbc_getFunctionNotify(ctx);
+#endif
+}
+
+static void backend_install(SMBCCTX *ctx, const struct backend *b)
+{
+  smbc_setFunctionOpen(ctx, b->open);
+  smbc_setFunctionCreat(ctx, b->creat);
+  smbc_setFunctionRead(ctx, b->read);
+  smbc_setFunctionWrite(ctx, b->write);
+  smbc_setFunctionLseek(ctx, b->lseek);
+  smbc_setFunctionFtruncate(ctx, b->ftruncate);
+  smbc_setFunctionClose(ctx, b->close);
+  smbc_setFunctionFstat(ctx, b->fstat);
+  smbc_setFunctionStat(ctx, b->stat);
+  smbc_setFunctionUnlink(ctx, b->unlink);
+  smbc_setFunctionRename(ctx, b->rename);
+  smbc_setFunctionOpendir(ctx, b->opendir);
+  smbc_setFunctionReaddir(ctx, b->readdir);
+#ifdef HAVE_SMBC_READDIRPLUS2
+  smbc_setFunctionReaddirPlus2(ctx, b->readdirplus2);
+#endif
+  smbc_setFunctionTelldir(ctx, b->telldir);
+  smbc_setFunctionLseekdir(ctx, b->lseekdir);
+  smbc_setFunctionClosedir(ctx, b->closedir);
+  smbc_setFunctionMkdir(ctx, b->mkdir);
+  smbc_setFunctionRmdir(ctx, b->rmdir);
+  smbc_setFunctionUtimes(ctx, b->utimes);
+  smbc_setFunctionGetxattr(ctx, b->getxattr);
+#ifdef HAVE_SMBC_NOTIFY
+  smbc_setFunctionNotify(ctx, b->notify);
+#endif
+}
+
+/* called by ctx_new; contexts start out with libsmbclient's table */
+void backend_apply(SMBCCTX *ctx)
+{
+  if (current != NULL && current != &smbclient_backend) {
+    backend_install(ctx, current);
+  }
+}
+
+static double latency_value(VALUE v, const char *name)
+{
+  double secs = NUM2DBL(v);
+
+  if (secs < 0) {
+    rb_raise(rb_eArgError, "%s latency must not be negative", name);
+  }
+
+  return secs;
+}
+
+static void set_latency(VALUE v)
+{
+  VALUE op;
+  int i;
+
+  local_default_latency = 0;
+  if (TYPE(v) == T_HASH) {
+    if (!NIL_P(op = util_opt(v, "default"))) {
+      local_default_latency = latency_value(op, "default");
+    }
+    for (i = 0; i < METRIC_OPS; i++) {
+      op = util_opt(v, metrics_op_name(i));
+      local_latency[i] = (NIL_P(op) ? local_default_latency :
+			  latency_value(op, metrics_op_name(i)));
+    }
+  }
+  else if (!NIL_P(v)) {
+    local_default_latency = latency_value(v, "default");
+    for (i = 0; i < METRIC_OPS; i++) {
+      local_latency[i] = local_default_latency;
+    }
+  }
+  else {
+    for (i = 0; i < METRIC_OPS; i++) {
+      local_latency[i] = 0;
+    }
+  }
+}
+
+/*
+  Handles belong to the backend that opened them, so use_backend refuses
+  to switch while any are open. Only called with the GVL held.
+*/
+
+void backend_handle_opened(void)
+{
+  open_handles++;
+}
+
+void backend_handle_closed(void)
+{
+  open_handles--;
+}
+
+/*
+  SMB.use_backend(:libsmbclient)
+  SMB.use_backend(:local, :root => dir, :latency => secs | { op => secs },
+                  :bandwidth => bytes_per_sec) -> backend name
+
+  Switches every libsmbclient context, including ones made for pooled
+  operations later on, to the given backend, and empties the caches.
+  Latency keys are the operation names SMB.stats uses plus :default.
+  Raises SMB::SmbError while files or directories are open on the other
+  backend.
+*/
+
+static VALUE smb_s_use_backend(int argc, VALUE *argv, VALUE self)
+{
+  VALUE name;
+  VALUE opts;
+  VALUE v;
+  const char *s;
+  char *root;
+
+  rb_scan_args(argc, argv, "11", &name, &opts);
+  s = (SYMBOL_P(name) ? rb_id2name(SYM2ID(name)) : StringValueCStr(name));
+
+  if (open_handles > 0 && strcmp(s, current->name) != 0) {
+    rb_raise(eSmbError, "can't switch backends with %ld files or directories open",
+	     open_handles);
+  }
+  if (strcmp(s, "libsmbclient") == 0) {
+    current = &smbclient_backend;
+  }
+  else if (strcmp(s, "local") == 0) {
+    v = util_opt(opts, "root");
+    if (NIL_P(v)) {
+      rb_raise(rb_eArgError, "the local backend needs a :root directory");
+    }
+    if ((root = realpath(StringValueCStr(v), NULL)) == NULL) {
+      rb_sys_fail(StringValueCStr(v));
+    }
+    set_latency(util_opt(opts, "latency"));
+    v = util_opt(opts, "bandwidth");
+    local_bandwidth = (NIL_P(v) ? 0 : NUM2DBL(v));
+    if (local_bandwidth < 0) {
+      free(root);
+      rb_raise(rb_eArgError, "bandwidth must not be negative");
+    }
+    free(local_root);
+    local_root = root;
+    current = &local_backend;
+  }
+  else {
+    rb_raise(rb_eArgError, "unknown backend %s", s);
+  }
+  backend_install(smbc_set_context(NULL), current);
+  smb_invalidate_tree("smb://");
+
+  return ID2SYM(rb_intern(current->name));
+}
+
+static VALUE smb_s_backend(VALUE self)
+{
+  return ID2SYM(rb_intern(current->name));
+}
+
+void init_smbbackend(void)
+{
+  backend_capture(smbc_set_context(NULL), &smbclient_backend);
+  current = &smbclient_backend;
+
+  local_backend.name = "local";
+  local_backend.open = local_open;
+  local_backend.creat = local_creat;
+  local_backend.read = local_read;
+  local_backend.write = local_write;
+  local_backend.lseek = local_lseek;
+  local_backend.ftruncate = local_ftruncate;
+  local_backend.close = local_close;
+  local_backend.fstat = local_fstat;
+  local_backend.stat = local_stat;
+  local_backend.unlink = local_unlink;
+  local_backend.rename = local_rename;
+  local_backend.opendir = local_opendir;
+  local_backend.readdir = local_readdir;
+#ifdef HAVE_SMBC_READDIRPLUS2
+  local_backend.readdirplus2 = local_readdirplus2;
+#endif
+  local_backend.telldir = local_telldir;
+  local_backend.lseekdir = local_lseekdir;
+  local_backend.closedir = local_closedir;
+  local_backend.mkdir = local_mkdir;
+  local_backend.rmdir = local_rmdir;
+  local_backend.utimes = local_utimes;
+  local_backend.getxattr = local_getxattr;
+#ifdef HAVE_SMBC_NOTIFY
+  local_backend.notify = local_notify;
+#endif
+
+  rb_define_module_function(mSMB, "use_backend", smb_s_use_backend, -1);
+  rb_define_module_function(mSMB, "backend", smb_s_backend, 0);
+}
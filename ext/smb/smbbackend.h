@@ -0,0 +1,37 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef RUBYSMB_SMBBACKEND_H
+#define RUBYSMB_SMBBACKEND_H
+
+/*
+  The backend is the table of posix-like functions a libsmbclient context
+  dispatches through, so both the global smbc_* calls and the worker
+  contexts pick it up. The default is libsmbclient's own table; the local
+  backend serves smb://server/share/path from root/server/share/path and
+  can add per-operation latency and a bandwidth cap.
+*/
+
+void backend_apply(SMBCCTX*);
+void backend_handle_opened(void);
+void backend_handle_closed(void);
+void init_smbbackend(void);
+
+#endif
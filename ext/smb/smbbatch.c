@@ -0,0 +1,688 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include <libsmbclient.h>
+#include <ruby.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "rubysmb.h"
+#include "smbbatch.h"
+#include "smbctx.h"
+#include "smbdir.h"
+#include "smbpool.h"
+#include "smbstat.h"
+#include "smbutil.h"
+
+/*
+  Namespace operations over many paths at once, run on the worker pool.
+  The *_many calls return a hash of url => true or the exception for that
+  url, in the order given, rather than stopping at the first failure.
+*/
+
+enum {
+  BATCH_UNLINK,
+  BATCH_RMDIR,
+  BATCH_MKDIR,
+  BATCH_RENAME,
+  BATCH_LIST,
+  BATCH_STAT
+};
+
+struct batch_task {
+  struct pool_item item;
+  int op;
+  long index;
+  int depth;
+  mode_t mode;
+  char *to;
+  char path[1];
+};
+
+struct batch_result {
+  struct pool_item item;
+  long index;
+  int err;
+  char path[1];
+};
+
+struct rmrf_dir {
+  char *path;
+  int depth;
+};
+
+struct batch_state {
+  struct smbpool *pool;
+  struct batch_result *current;
+  int nthreads;
+  int op;
+  mode_t mode;
+  long count;
+  int *errs;
+  struct stat *stats;
+  VALUE urls;
+  VALUE targets;
+  /* rm_rf */
+  pthread_mutex_t lock;
+  struct rmrf_dir *dirs;
+  long ndirs;
+  long dircap;
+  long files;
+  long removed_dirs;
+  VALUE errors;
+};
+
+static struct batch_task *batch_task_new(int op, long index, const char *path, const char *to)
+{
+  struct batch_task *task;
+  size_t len = strlen(path);
+
+  task = malloc(sizeof(struct batch_task) + len + (to != NULL ? strlen(to) + 1 : 0));
+  task->op = op;
+  task->index = index;
+  task->depth = 0;
+  task->mode = 0755;
+  strcpy(task->path, path);
+  if (to != NULL) {
+    task->to = task->path + len + 1;
+    strcpy(task->to, to);
+  }
+  else {
+    task->to = NULL;
+  }
+
+  return task;
+}
+
+static void batch_emit(struct smbpool *pool, long index, const char *path, int err)
+{
+  struct batch_result *r = malloc(sizeof(struct batch_result) + strlen(path));
+
+  r->index = index;
+  r->err = err;
+  strcpy(r->path, path);
+  pool_emit(pool, &r->item);
+}
+
+static void rmrf_add_dir(struct batch_state *state, const char *path, int depth)
+{
+  pthread_mutex_lock(&state->lock);
+  if (state->ndirs == state->dircap) {
+    state->dircap = (state->dircap == 0 ? 64 : state->dircap * 2);
+    state->dirs = realloc(state->dirs, state->dircap * sizeof(struct rmrf_dir));
+  }
+  state->dirs[state->ndirs].path = strdup(path);
+  state->dirs[state->ndirs].depth = depth;
+  state->ndirs++;
+  pthread_mutex_unlock(&state->lock);
+}
+
+/*
+  rm_rf's first pass: list a directory, unlink its files right away and
+  queue its subdirectories. Directories themselves are removed afterwards,
+  a level at a time, deepest first.
+*/
+
+static void rmrf_list(struct smbpool *pool, SMBCCTX *ctx, struct batch_task *task)
+{
+  struct batch_state *state = pool->data;
+  struct smbc_dirent *ent;
+  struct batch_task *child;
+  SMBCFILE *dh;
+  char *url;
+  long files = 0;
+
+  if ((dh = smbc_getFunctionOpendir(ctx)(ctx, task->path)) == NULL) {
+    batch_emit(pool, -1, task->path, errno);
+    return;
+  }
+  while ((ent = smbc_getFunctionReaddir(ctx)(ctx, dh)) != NULL && !pool_stopping(pool)) {
+    if (strcmp(ent->name, ".") == 0 || strcmp(ent->name, "..") == 0) {
+      continue;
+    }
+    url = ctx_url_join(task->path, ent->name);
+    if (ent->smbc_type == SMBC_DIR) {
+      rmrf_add_dir(state, url, task->depth + 1);
+      child = batch_task_new(BATCH_LIST, -1, url, NULL);
+      child->depth = task->depth + 1;
+      pool_push(pool, &child->item);
+    }
+    else if (smbc_getFunctionUnlink(ctx)(ctx, url) < 0) {
+      batch_emit(pool, -1, url, errno);
+    }
+    else {
+      files++;
+    }
+    free(url);
+  }
+  smbc_getFunctionClosedir(ctx)(ctx, dh);
+
+  pthread_mutex_lock(&state->lock);
+  state->files += files;
+  pthread_mutex_unlock(&state->lock);
+}
+
+static void batch_run_task(struct smbpool *pool, SMBCCTX *ctx, struct pool_item *item)
+{
+  struct batch_task *task = (struct batch_task*)item;
+  struct batch_state *state = pool->data;
+  int ret = 0;
+
+  switch (task->op) {
+  case BATCH_UNLINK:
+    ret = smbc_getFunctionUnlink(ctx)(ctx, task->path);
+    break;
+  case BATCH_RMDIR:
+    ret = smbc_getFunctionRmdir(ctx)(ctx, task->path);
+    break;
+  case BATCH_MKDIR:
+    ret = smbc_getFunctionMkdir(ctx)(ctx, task->path, task->mode);
+    break;
+  case BATCH_RENAME:
+    ret = smbc_getFunctionRename(ctx)(ctx, task->path, ctx, task->to);
+    break;
+  case BATCH_LIST:
+    rmrf_list(pool, ctx, task);
+    free(task);
+    return;
+  case BATCH_STAT:
+    /* each task owns its slot, so workers can fill them in directly */
+    ret = smbc_getFunctionStat(ctx)(ctx, task->path, &state->stats[task->index]);
+    break;
+  }
+  batch_emit(pool, task->index, task->path, ret < 0 ? errno : 0);
+  free(task);
+}
+
+static void batch_invalidate(int op, VALUE url, VALUE to)
+{
+  switch (op) {
+  case BATCH_STAT:
+    break;
+  case BATCH_UNLINK:
+  case BATCH_MKDIR:
+    smb_invalidate(StringValuePtr(url));
+    break;
+  case BATCH_RMDIR:
+    smb_invalidate_tree(StringValuePtr(url));
+    break;
+  case BATCH_RENAME:
+    smb_invalidate_tree(StringValuePtr(url));
+    smb_invalidate_tree(StringValuePtr(to));
+    break;
+  }
+}
+
+static VALUE batch_run(VALUE arg)
+{
+  struct batch_state *state = (struct batch_state*)arg;
+  struct batch_result *r;
+  struct batch_task *task;
+  VALUE to;
+  long i;
+
+  state->pool = pool_new(state->nthreads, batch_run_task, state);
+  for (i = state->count - 1; i >= 0; i--) {
+    to = (NIL_P(state->targets) ? Qnil : RARRAY_PTR(state->targets)[i]);
+    task = batch_task_new(state->op, i, StringValuePtr(RARRAY_PTR(state->urls)[i]),
+			  NIL_P(to) ? NULL : StringValuePtr(to));
+    task->mode = state->mode;
+    pool_push(state->pool, &task->item);
+  }
+
+  while ((r = (struct batch_result*)pool_next(state->pool)) != NULL) {
+    state->errs[r->index] = r->err;
+    if (r->err == 0 && state->op == BATCH_STAT) {
+      statcache_put(r->path, &state->stats[r->index]);
+    }
+    else if (r->err == 0) {
+      i = r->index;
+      batch_invalidate(state->op, RARRAY_PTR(state->urls)[i],
+		       NIL_P(state->targets) ? Qnil : RARRAY_PTR(state->targets)[i]);
+    }
+    free(r);
+  }
+
+  return Qnil;
+}
+
+static VALUE batch_cleanup(VALUE arg)
+{
+  struct batch_state *state = (struct batch_state*)arg;
+
+  free(state->current);
+  state->current = NULL;
+  pool_free(state->pool);
+  state->pool = NULL;
+
+  return Qnil;
+}
+
+static VALUE batch_results(struct batch_state *state)
+{
+  VALUE hash = rb_hash_new();
+  VALUE url;
+  long i;
+
+  for (i = 0; i < state->count; i++) {
+    url = RARRAY_PTR(state->urls)[i];
+    rb_hash_aset(hash, url,
+		 state->errs[i] == 0 ? Qtrue : rb_syserr_new(state->errs[i], StringValuePtr(url)));
+  }
+
+  return hash;
+}
+
+static VALUE batch(int op, VALUE urls, VALUE targets, mode_t mode, VALUE opts)
+{
+  struct batch_state state;
+  VALUE results;
+  long i;
+
+  Check_Type(urls, T_ARRAY);
+  for (i = 0; i < RARRAY_LEN(urls); i++) {
+    rb_ary_store(urls, i, rb_str_to_str(RARRAY_PTR(urls)[i]));
+    if (!NIL_P(targets)) {
+      rb_ary_store(targets, i, rb_str_to_str(RARRAY_PTR(targets)[i]));
+    }
+  }
+
+  memset(&state, 0, sizeof(state));
+  state.nthreads = pool_threads_opt(opts);
+  state.op = op;
+  state.mode = mode;
+  state.urls = urls;
+  state.targets = targets;
+  state.count = RARRAY_LEN(urls);
+  if (state.count == 0) {
+    return rb_hash_new();
+  }
+  state.errs = ALLOC_N(int, state.count);
+
+  rb_ensure(batch_run, (VALUE)&state, batch_cleanup, (VALUE)&state);
+  results = batch_results(&state);
+  xfree(state.errs);
+
+  return results;
+}
+
+/*
+  SMB.stat_many(urls, :threads => n) -> { url => SMB::File::Stat or exception }
+  SMB.stat_many(urls, :columns => true) -> { :size => [...], :mtime => [...],
+                                             :mode => [...], :errors => { url => exception } }
+
+  Stats every url on the worker pool. With :columns the results come as
+  arrays in the order of urls, nil where the stat failed, and no Stat
+  objects are made. Successful stats go into the metadata cache.
+*/
+
+static VALUE smb_s_stat_many(int argc, VALUE *argv, VALUE self)
+{
+  struct batch_state state;
+  VALUE urls;
+  VALUE opts;
+  VALUE results;
+  VALUE url;
+  VALUE size, mtime, mode, errors;
+  struct stat *st;
+  long i;
+
+  rb_scan_args(argc, argv, "11", &urls, &opts);
+  Check_Type(urls, T_ARRAY);
+  urls = rb_ary_dup(urls);
+  for (i = 0; i < RARRAY_LEN(urls); i++) {
+    rb_ary_store(urls, i, rb_str_to_str(RARRAY_PTR(urls)[i]));
+  }
+
+  memset(&state, 0, sizeof(state));
+  state.nthreads = pool_threads_opt(opts);
+  state.op = BATCH_STAT;
+  state.urls = urls;
+  state.targets = Qnil;
+  state.count = RARRAY_LEN(urls);
+  if (state.count > 0) {
+    state.errs = ALLOC_N(int, state.count);
+    state.stats = ALLOC_N(struct stat, state.count);
+    rb_ensure(batch_run, (VALUE)&state, batch_cleanup, (VALUE)&state);
+  }
+
+  if (RTEST(util_opt(opts, "columns"))) {
+    size = rb_ary_new2(state.count);
+    mtime = rb_ary_new2(state.count);
+    mode = rb_ary_new2(state.count);
+    errors = rb_hash_new();
+    for (i = 0; i < state.count; i++) {
+      st = &state.stats[i];
+      if (state.errs[i] != 0) {
+	url = RARRAY_PTR(urls)[i];
+	rb_hash_aset(errors, url, rb_syserr_new(state.errs[i], StringValuePtr(url)));
+	rb_ary_push(size, Qnil);
+	rb_ary_push(mtime, Qnil);
+	rb_ary_push(mode, Qnil);
+      }
+      else {
+	rb_ary_push(size, OFFT2NUM(st->st_size));
+	rb_ary_push(mtime, LONG2NUM(st->st_mtime));
+	rb_ary_push(mode, INT2FIX(st->st_mode));
+      }
+    }
+    results = rb_hash_new();
+    rb_hash_aset(results, ID2SYM(rb_intern("size")), size);
+    rb_hash_aset(results, ID2SYM(rb_intern("mtime")), mtime);
+    rb_hash_aset(results, ID2SYM(rb_intern("mode")), mode);
+    rb_hash_aset(results, ID2SYM(rb_intern("errors")), errors);
+  }
+  else {
+    results = rb_hash_new();
+    for (i = 0; i < state.count; i++) {
+      url = RARRAY_PTR(urls)[i];
+      rb_hash_aset(results, url,
+		   state.errs[i] == 0 ? stat_new(&state.stats[i]) :
+		   rb_syserr_new(state.errs[i], StringValuePtr(url)));
+    }
+  }
+  xfree(state.errs);
+  xfree(state.stats);
+
+  return results;
+}
+
+/*
+  SMB::File.delete_many(urls, opts = {}) -> { url => true or exception }
+*/
+
+static VALUE smbfile_s_delete_many(int argc, VALUE *argv, VALUE self)
+{
+  VALUE urls;
+  VALUE opts;
+
+  rb_scan_args(argc, argv, "11", &urls, &opts);
+
+  return batch(BATCH_UNLINK, rb_ary_dup(urls), Qnil, 0, opts);
+}
+
+static VALUE smbdir_s_delete_many(int argc, VALUE *argv, VALUE self)
+{
+  VALUE urls;
+  VALUE opts;
+
+  rb_scan_args(argc, argv, "11", &urls, &opts);
+
+  return batch(BATCH_RMDIR, rb_ary_dup(urls), Qnil, 0, opts);
+}
+
+/*
+  SMB::Dir.mkdir_many(urls, opts = {}). Creates the directories in
+  parallel, so parents must exist already; see SMB::Dir.mkdir_p.
+*/
+
+static VALUE smbdir_s_mkdir_many(int argc, VALUE *argv, VALUE self)
+{
+  VALUE urls;
+  VALUE opts;
+  VALUE mode;
+
+  rb_scan_args(argc, argv, "11", &urls, &opts);
+  mode = util_opt(opts, "mode");
+
+  return batch(BATCH_MKDIR, rb_ary_dup(urls), Qnil, NIL_P(mode) ? 0755 : NUM2INT(mode), opts);
+}
+
+/*
+  SMB.rename_many(pairs, opts = {}), pairs being a hash of old => new url
+  or an array of [old, new]. Results are keyed by the old url.
+*/
+
+static VALUE smb_s_rename_many(int argc, VALUE *argv, VALUE self)
+{
+  VALUE pairs;
+  VALUE opts;
+  VALUE urls;
+  VALUE targets;
+  VALUE pair;
+  long i;
+
+  rb_scan_args(argc, argv, "11", &pairs, &opts);
+
+  if (TYPE(pairs) == T_HASH) {
+    pairs = rb_funcall(pairs, rb_intern("to_a"), 0);
+  }
+  Check_Type(pairs, T_ARRAY);
+  urls = rb_ary_new2(RARRAY_LEN(pairs));
+  targets = rb_ary_new2(RARRAY_LEN(pairs));
+  for (i = 0; i < RARRAY_LEN(pairs); i++) {
+    pair = RARRAY_PTR(pairs)[i];
+    Check_Type(pair, T_ARRAY);
+    if (RARRAY_LEN(pair) != 2) {
+      rb_raise(rb_eArgError, "rename pairs must be [old, new]");
+    }
+    rb_ary_push(urls, RARRAY_PTR(pair)[0]);
+    rb_ary_push(targets, RARRAY_PTR(pair)[1]);
+  }
+
+  return batch(BATCH_RENAME, urls, targets, 0, opts);
+}
+
+static int dir_depth_cmp(const void *a, const void *b)
+{
+  return ((const struct rmrf_dir*)b)->depth - ((const struct rmrf_dir*)a)->depth;
+}
+
+static VALUE rmrf_run(VALUE arg)
+{
+  struct batch_state *state = (struct batch_state*)arg;
+  struct batch_result *r;
+  struct batch_task *task;
+  long i;
+  long j;
+
+  state->pool = pool_new(state->nthreads, batch_run_task, state);
+  task = batch_task_new(BATCH_LIST, -1, StringValuePtr(state->urls), NULL);
+  pool_push(state->pool, &task->item);
+
+  while ((r = (struct batch_result*)pool_next(state->pool)) != NULL) {
+    state->current = r;
+    rb_ary_push(state->errors, rb_ary_new3(2, rb_str_new2(r->path),
+					   rb_syserr_new(r->err, r->path)));
+    state->current = NULL;
+    free(r);
+  }
+
+  /* every directory on one level can go at once, once the level below is gone */
+  qsort(state->dirs, state->ndirs, sizeof(struct rmrf_dir), dir_depth_cmp);
+  for (i = 0; i < state->ndirs; i = j) {
+    for (j = i; j < state->ndirs && state->dirs[j].depth == state->dirs[i].depth; j++) {
+      task = batch_task_new(BATCH_RMDIR, j, state->dirs[j].path, NULL);
+      pool_push(state->pool, &task->item);
+    }
+    while ((r = (struct batch_result*)pool_next(state->pool)) != NULL) {
+      state->current = r;
+      if (r->err != 0) {
+	rb_ary_push(state->errors, rb_ary_new3(2, rb_str_new2(r->path),
+					       rb_syserr_new(r->err, r->path)));
+      }
+      else {
+	state->removed_dirs++;
+      }
+      state->current = NULL;
+      free(r);
+    }
+  }
+
+  return Qnil;
+}
+
+static VALUE rmrf_cleanup(VALUE arg)
+{
+  struct batch_state *state = (struct batch_state*)arg;
+  long i;
+
+  batch_cleanup(arg);
+  for (i = 0; i < state->ndirs; i++) {
+    free(state->dirs[i].path);
+  }
+  free(state->dirs);
+  state->dirs = NULL;
+  pthread_mutex_destroy(&state->lock);
+  smb_invalidate_tree(StringValuePtr(state->urls));
+
+  return Qnil;
+}
+
+/*
+  SMB.rm_rf(url, opts = {}) -> { :files => n, :directories => n, :errors => [[url, exception], ...] }
+
+  Removes url and everything below it. A url that doesn't exist is not
+  an error.
+*/
+
+static VALUE smb_s_rm_rf(int argc, VALUE *argv, VALUE self)
+{
+  VALUE url;
+  VALUE opts;
+  VALUE summary;
+  struct batch_state state;
+  struct stat st;
+  char *urlp;
+
+  rb_scan_args(argc, argv, "11", &url, &opts);
+
+  StringValue(url);
+  urlp = StringValuePtr(url);
+
+  memset(&state, 0, sizeof(state));
+  state.nthreads = pool_threads_opt(opts);
+  state.urls = url;
+  state.errors = rb_ary_new();
+
+  summary = rb_hash_new();
+  if (smbc_stat(urlp, &st) < 0) {
+    if (errno != ENOENT) {
+      rb_sys_fail(urlp);
+    }
+  }
+  else if (!S_ISDIR(st.st_mode)) {
+    if (smbc_unlink(urlp) < 0) {
+      rb_sys_fail(urlp);
+    }
+    smb_invalidate(urlp);
+    state.files = 1;
+  }
+  else {
+    pthread_mutex_init(&state.lock, NULL);
+    rb_ensure(rmrf_run, (VALUE)&state, rmrf_cleanup, (VALUE)&state);
+    if (smbc_rmdir(urlp) < 0) {
+      rb_ary_push(state.errors, rb_ary_new3(2, url, rb_syserr_new(errno, urlp)));
+    }
+    else {
+      state.removed_dirs++;
+    }
+    smb_invalidate_tree(urlp);
+  }
+
+  rb_hash_aset(summary, ID2SYM(rb_intern("files")), LONG2NUM(state.files));
+  rb_hash_aset(summary, ID2SYM(rb_intern("directories")), LONG2NUM(state.removed_dirs));
+  rb_hash_aset(summary, ID2SYM(rb_intern("errors")), state.errors);
+
+  return summary;
+}
+
+/*
+  SMB::Dir.mkdir_p(url, mode = 0755). Tries the whole path first and only
+  walks up towards the share when a parent is missing.
+*/
+
+static int mkdir_p(char *url, mode_t mode)
+{
+  char *p;
+  int ret;
+
+  if (smbc_mkdir(url, mode) == 0) {
+    smb_invalidate(url);
+    return 0;
+  }
+  if (errno == EEXIST) {
+    struct stat st;
+
+    if (smbc_stat(url, &st) == 0 && S_ISDIR(st.st_mode)) {
+      return 0;
+    }
+    errno = EEXIST;
+    return -1;
+  }
+  if (errno != ENOENT || (p = strrchr(url, '/')) == NULL || p[-1] == '/') {
+    return -1;
+  }
+
+  *p = '\0';
+  ret = mkdir_p(url, mode);
+  *p = '/';
+  if (ret < 0) {
+    return -1;
+  }
+  if (smbc_mkdir(url, mode) < 0 && errno != EEXIST) {
+    return -1;
+  }
+  smb_invalidate(url);
+
+  return 0;
+}
+
+static VALUE smbdir_s_mkdir_p(int argc, VALUE *argv, VALUE self)
+{
+  VALUE url;
+  VALUE rmode;
+  char *buf;
+  int err;
+  size_t len;
+
+  rb_scan_args(argc, argv, "11", &url, &rmode);
+
+  StringValue(url);
+
+  buf = ALLOC_N(char, RSTRING_LEN(url) + 1);
+  strcpy(buf, StringValuePtr(url));
+  for (len = strlen(buf); len > 0 && buf[len - 1] == '/'; len--) {
+    buf[len - 1] = '\0';
+  }
+  if (mkdir_p(buf, NIL_P(rmode) ? 0755 : (mode_t)NUM2INT(rmode)) < 0) {
+    err = errno;
+    xfree(buf);
+    errno = err;
+    rb_sys_fail(StringValuePtr(url));
+  }
+  xfree(buf);
+
+  return INT2FIX(0);
+}
+
+void init_smbbatch(void)
+{
+  rb_define_singleton_method(cSmbFile, "delete_many", smbfile_s_delete_many, -1);
+  rb_define_singleton_method(cSmbDir, "delete_many", smbdir_s_delete_many, -1);
+  rb_define_singleton_method(cSmbDir, "mkdir_many", smbdir_s_mkdir_many, -1);
+  rb_define_singleton_method(cSmbDir, "mkdir_p", smbdir_s_mkdir_p, -1);
+  rb_define_module_function(mSMB, "rename_many", smb_s_rename_many, -1);
+  rb_define_module_function(mSMB, "rm_rf", smb_s_rm_rf, -1);
+  rb_define_module_function(mSMB, "stat_many", smb_s_stat_many, -1);
+}
@@ -0,0 +1,93 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+
+#include <pthread.h>
+#include <stdlib.h>
+#include "smbbufpool.h"
+
+#define BUFPOOL_MIN_SHIFT 12
+#define BUFPOOL_MAX_SHIFT 24
+#define BUFPOOL_CLASSES (BUFPOOL_MAX_SHIFT - BUFPOOL_MIN_SHIFT + 1)
+/* idle bytes kept over all classes; what doesn't fit is freed */
+#define BUFPOOL_KEEP_BYTES (16 * 1024 * 1024)
+
+/* free buffers are linked through their first bytes */
+struct free_buf {
+  struct free_buf *next;
+};
+
+static pthread_mutex_t bufpool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct free_buf *bufpool_free[BUFPOOL_CLASSES];
+static size_t bufpool_idle;
+
+static int bufpool_class(size_t size)
+{
+  int shift = BUFPOOL_MIN_SHIFT;
+
+  while (shift <= BUFPOOL_MAX_SHIFT && ((size_t)1 << shift) < size) {
+    shift++;
+  }
+
+  return shift - BUFPOOL_MIN_SHIFT;
+}
+
+char *bufpool_get(size_t size, size_t *cap)
+{
+  int class = bufpool_class(size);
+  struct free_buf *b = NULL;
+
+  if (class >= BUFPOOL_CLASSES) {
+    *cap = size;
+    return malloc(size);
+  }
+  *cap = (size_t)1 << (class + BUFPOOL_MIN_SHIFT);
+  pthread_mutex_lock(&bufpool_lock);
+  if ((b = bufpool_free[class]) != NULL) {
+    bufpool_free[class] = b->next;
+    bufpool_idle -= *cap;
+  }
+  pthread_mutex_unlock(&bufpool_lock);
+
+  return (b != NULL ? (char*)b : malloc(*cap));
+}
+
+void bufpool_put(char *buf, size_t cap)
+{
+  int class = bufpool_class(cap);
+  struct free_buf *b = (struct free_buf*)buf;
+
+  if (buf == NULL) {
+    return;
+  }
+  if (class >= BUFPOOL_CLASSES || cap != (size_t)1 << (class + BUFPOOL_MIN_SHIFT)) {
+    free(buf);
+    return;
+  }
+  pthread_mutex_lock(&bufpool_lock);
+  if (bufpool_idle + cap <= BUFPOOL_KEEP_BYTES) {
+    b->next = bufpool_free[class];
+    bufpool_free[class] = b;
+    bufpool_idle += cap;
+    b = NULL;
+  }
+  pthread_mutex_unlock(&bufpool_lock);
+  free(b);
+}
@@ -0,0 +1,38 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+
+#ifndef RUBYSMB_SMBBUFPOOL_H
+#define RUBYSMB_SMBBUFPOOL_H
+
+#include <stddef.h>
+
+/*
+  Recycled I/O buffers in power-of-two size classes from 4 KiB to
+  16 MiB, shared by every thread. bufpool_get hands out a buffer of at
+  least size bytes and its real capacity, which goes back with it to
+  bufpool_put. Larger requests are plain malloc/free. At most 16 MiB
+  sits idle in the pool altogether.
+*/
+
+char *bufpool_get(size_t, size_t*);
+void bufpool_put(char*, size_t);
+
+#endif
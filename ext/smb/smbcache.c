@@ -0,0 +1,284 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include <ruby.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "smbcache.h"
+
+#define CACHE_MIN_BUCKETS 64
+
+double cache_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long cache_hash(const char *key)
+{
+  unsigned long h = 2166136261UL;
+
+  while (*key) {
+    h ^= (unsigned char)*key++;
+    h *= 16777619UL;
+  }
+
+  return h;
+}
+
+/*
+  Keys are urls with trailing slashes dropped, so "smb://srv/share/dir/"
+  and "smb://srv/share/dir" share an entry. Both return malloc'd strings.
+*/
+
+char *cache_key(const char *url)
+{
+  size_t len = strlen(url);
+  char *key;
+
+  while (len > 0 && url[len - 1] == '/') {
+    len--;
+  }
+  key = malloc(len + 1);
+  memcpy(key, url, len);
+  key[len] = '\0';
+
+  return key;
+}
+
+char *cache_parent_key(const char *url)
+{
+  char *key = cache_key(url);
+  char *p = strrchr(key, '/');
+
+  if (p == NULL || p == key || p[-1] == '/') {
+    /* "smb://server" has no parent worth caching */
+    free(key);
+    return NULL;
+  }
+  *p = '\0';
+
+  return key;
+}
+
+static void lru_unlink(struct cache_entry *e)
+{
+  e->prev->next = e->next;
+  e->next->prev = e->prev;
+}
+
+static void lru_push_front(struct smbcache *cache, struct cache_entry *e)
+{
+  e->next = cache->lru.next;
+  e->prev = &cache->lru;
+  cache->lru.next->prev = e;
+  cache->lru.next = e;
+}
+
+static struct cache_entry **cache_slot(struct smbcache *cache, const char *key, unsigned long hash)
+{
+  struct cache_entry **slot = &cache->buckets[hash & (cache->nbuckets - 1)];
+
+  while (*slot != NULL && ((*slot)->hash != hash || strcmp((*slot)->key, key) != 0)) {
+    slot = &(*slot)->hnext;
+  }
+
+  return slot;
+}
+
+static void cache_drop(struct smbcache *cache, struct cache_entry **slot)
+{
+  struct cache_entry *e = *slot;
+
+  *slot = e->hnext;
+  lru_unlink(e);
+  cache->count--;
+  cache->free_value(e->value);
+  free(e);
+}
+
+static void cache_drop_entry(struct smbcache *cache, struct cache_entry *e)
+{
+  cache_drop(cache, cache_slot(cache, e->key, e->hash));
+}
+
+static void cache_grow(struct smbcache *cache)
+{
+  struct cache_entry **buckets;
+  struct cache_entry *e;
+  size_t nbuckets = cache->nbuckets * 2;
+  size_t i;
+
+  buckets = calloc(nbuckets, sizeof(struct cache_entry*));
+  for (e = cache->lru.next; e != &cache->lru; e = e->next) {
+    i = e->hash & (nbuckets - 1);
+    e->hnext = buckets[i];
+    buckets[i] = e;
+  }
+  free(cache->buckets);
+  cache->buckets = buckets;
+  cache->nbuckets = nbuckets;
+}
+
+struct smbcache *cache_new(size_t max, void (*free_value)(void*))
+{
+  struct smbcache *cache = calloc(1, sizeof(struct smbcache));
+
+  pthread_mutex_init(&cache->lock, NULL);
+  cache->nbuckets = CACHE_MIN_BUCKETS;
+  cache->buckets = calloc(cache->nbuckets, sizeof(struct cache_entry*));
+  cache->max = max;
+  cache->lru.next = cache->lru.prev = &cache->lru;
+  cache->free_value = free_value;
+
+  return cache;
+}
+
+bool cache_get(struct smbcache *cache, const char *url, cache_hit_fn hit, void *arg)
+{
+  struct cache_entry **slot;
+  char *key = cache_key(url);
+  bool found = false;
+
+  pthread_mutex_lock(&cache->lock);
+  slot = cache_slot(cache, key, cache_hash(key));
+  if (*slot != NULL) {
+    if ((*slot)->expires < cache_now()) {
+      cache_drop(cache, slot);
+    }
+    else {
+      lru_unlink(*slot);
+      lru_push_front(cache, *slot);
+      hit((*slot)->value, arg);
+      found = true;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+  free(key);
+
+  return found;
+}
+
+void cache_put(struct smbcache *cache, const char *url, void *value, double ttl)
+{
+  struct cache_entry **slot;
+  struct cache_entry *e;
+  char *key = cache_key(url);
+  unsigned long hash = cache_hash(key);
+
+  pthread_mutex_lock(&cache->lock);
+  slot = cache_slot(cache, key, hash);
+  if (*slot != NULL) {
+    cache_drop(cache, slot);
+  }
+  if (cache->max == 0) {
+    pthread_mutex_unlock(&cache->lock);
+    cache->free_value(value);
+    free(key);
+    return;
+  }
+  while (cache->count >= cache->max) {
+    cache_drop_entry(cache, cache->lru.prev);
+  }
+  if (cache->count >= cache->nbuckets) {
+    cache_grow(cache);
+  }
+
+  e = malloc(sizeof(struct cache_entry) + strlen(key));
+  strcpy(e->key, key);
+  e->hash = hash;
+  e->expires = cache_now() + ttl;
+  e->value = value;
+  slot = &cache->buckets[hash & (cache->nbuckets - 1)];
+  e->hnext = *slot;
+  *slot = e;
+  lru_push_front(cache, e);
+  cache->count++;
+  pthread_mutex_unlock(&cache->lock);
+  free(key);
+}
+
+void cache_remove(struct smbcache *cache, const char *url)
+{
+  struct cache_entry **slot;
+  char *key = cache_key(url);
+
+  pthread_mutex_lock(&cache->lock);
+  slot = cache_slot(cache, key, cache_hash(key));
+  if (*slot != NULL) {
+    cache_drop(cache, slot);
+  }
+  pthread_mutex_unlock(&cache->lock);
+  free(key);
+}
+
+/* drops url and everything below it */
+void cache_remove_prefix(struct smbcache *cache, const char *url)
+{
+  struct cache_entry *e;
+  struct cache_entry *next;
+  char *key = cache_key(url);
+  size_t len = strlen(key);
+
+  pthread_mutex_lock(&cache->lock);
+  for (e = cache->lru.next; e != &cache->lru; e = next) {
+    next = e->next;
+    if (strncmp(e->key, key, len) == 0 && (e->key[len] == '\0' || e->key[len] == '/')) {
+      cache_drop_entry(cache, e);
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+  free(key);
+}
+
+void cache_clear(struct smbcache *cache)
+{
+  pthread_mutex_lock(&cache->lock);
+  while (cache->count > 0) {
+    cache_drop_entry(cache, cache->lru.prev);
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_set_max(struct smbcache *cache, size_t max)
+{
+  pthread_mutex_lock(&cache->lock);
+  cache->max = max;
+  while (cache->count > max) {
+    cache_drop_entry(cache, cache->lru.prev);
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+size_t cache_count(struct smbcache *cache)
+{
+  size_t count;
+
+  pthread_mutex_lock(&cache->lock);
+  count = cache->count;
+  pthread_mutex_unlock(&cache->lock);
+
+  return count;
+}
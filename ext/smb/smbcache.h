@@ -0,0 +1,70 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef RUBYSMB_SMBCACHE_H
+#define RUBYSMB_SMBCACHE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+  A url-keyed cache with per-entry expiry and LRU eviction. Safe to use
+  from worker threads; values are owned by the cache and released with
+  the free function given to cache_new. Lookups hand the value to a
+  callback while the lock is held, which should copy or reference it
+  without calling into Ruby.
+*/
+
+struct cache_entry {
+  struct cache_entry *hnext;
+  struct cache_entry *prev;
+  struct cache_entry *next;
+  unsigned long hash;
+  double expires;
+  void *value;
+  char key[1];
+};
+
+struct smbcache {
+  pthread_mutex_t lock;
+  struct cache_entry **buckets;
+  size_t nbuckets;
+  size_t count;
+  size_t max;
+  struct cache_entry lru;
+  void (*free_value)(void*);
+};
+
+typedef void (*cache_hit_fn)(void*, void*);
+
+double cache_now(void);
+struct smbcache *cache_new(size_t, void (*)(void*));
+bool cache_get(struct smbcache*, const char*, cache_hit_fn, void*);
+void cache_put(struct smbcache*, const char*, void*, double);
+void cache_remove(struct smbcache*, const char*);
+void cache_remove_prefix(struct smbcache*, const char*);
+void cache_clear(struct smbcache*);
+void cache_set_max(struct smbcache*, size_t);
+size_t cache_count(struct smbcache*);
+char *cache_key(const char*);
+char *cache_parent_key(const char*);
+
+#endif
@@ -0,0 +1,423 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include <libsmbclient.h>
+#include <ruby.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "rubysmb.h"
+#include "smbchunk.h"
+#include "smbctx.h"
+#include "smbpool.h"
+#include "smbutil.h"
+
+/*
+  SMB::File.each_chunk_parallel reads a file as byte ranges on the worker
+  pool, each on its own handle. Range i nominally covers
+  [i * chunk_size, (i + 1) * chunk_size) and is moved to record
+  boundaries by the worker itself: it starts after the first separator
+  ending at or past its nominal start and ends after the first one
+  ending at or past its nominal end, so neighbouring ranges agree
+  without talking to each other.
+*/
+
+#define CHUNK_DEFAULT_SIZE (8 * 1024 * 1024)
+#define CHUNK_MIN_SIZE 4096
+#define CHUNK_READ 65536
+
+struct chunk_task {
+  struct pool_item item;
+  long index;
+};
+
+struct chunk_result {
+  struct pool_item item;
+  long index;
+  int err;
+  off_t offset;
+  size_t len;
+  char *buf;
+  size_t data_off;
+};
+
+struct chunk_state {
+  struct smbpool *pool;
+  struct chunk_result *current;
+  struct chunk_result **pending;
+  char *url;
+  char *sep;
+  size_t seplen;
+  off_t size;
+  off_t chunk_size;
+  long nchunks;
+  long next_task;
+  long next_yield;
+  long window;
+  bool ordered;
+  long yielded;
+};
+
+static const char *find_sep(const char *buf, size_t len, const char *sep, size_t seplen)
+{
+  const char *p;
+
+  if (seplen == 1) {
+    return memchr(buf, sep[0], len);
+  }
+  for (p = buf; p + seplen <= buf + len; p++) {
+    if ((p = memchr(p, sep[0], buf + len - p)) == NULL) {
+      return NULL;
+    }
+    if (p + seplen <= buf + len && memcmp(p, sep, seplen) == 0) {
+      return p;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+  True if a proper prefix of sep is also a suffix, as with "\n\n". Such a
+  separator can overlap itself, and where a scan finds it depends on
+  where the scan starts, so ranges couldn't agree on record boundaries.
+*/
+
+static bool sep_overlaps(const char *sep, size_t seplen)
+{
+  size_t k;
+
+  for (k = 1; k < seplen; k++) {
+    if (memcmp(sep, sep + seplen - k, k) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* reads up to len bytes at the handle's position; returns bytes read or -1 */
+static ssize_t read_full(SMBCCTX *ctx, SMBCFILE *fh, char *buf, size_t len)
+{
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < len) {
+    n = smbc_getFunctionRead(ctx)(ctx, fh, buf + done, len - done);
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    done += n;
+  }
+
+  return done;
+}
+
+static void chunk_read(struct smbpool *pool, SMBCCTX *ctx, struct pool_item *item)
+{
+  struct chunk_task *task = (struct chunk_task*)item;
+  struct chunk_state *state = pool->data;
+  struct chunk_result *r = calloc(1, sizeof(struct chunk_result));
+  const char *p;
+  SMBCFILE *fh;
+  off_t nominal = task->index * state->chunk_size;
+  off_t from = (task->index == 0 ? 0 : nominal - (off_t)state->seplen);
+  off_t until = nominal + state->chunk_size;
+  size_t cap;
+  size_t len;
+  size_t start;
+  size_t search;
+  ssize_t n;
+  bool eof;
+
+  r->index = task->index;
+  free(task);
+
+  if (from < 0) {
+    from = 0;
+  }
+  if ((fh = smbc_getFunctionOpen(ctx)(ctx, state->url, O_RDONLY, 0)) == NULL) {
+    r->err = errno;
+    pool_emit(pool, &r->item);
+    return;
+  }
+  cap = until - from + CHUNK_READ;
+  r->buf = malloc(cap);
+  if (smbc_getFunctionLseek(ctx)(ctx, fh, from, SEEK_SET) < 0 ||
+      (n = read_full(ctx, fh, r->buf, until - from)) < 0) {
+    goto fail;
+  }
+  len = n;
+  eof = ((off_t)len < until - from);
+
+  if (r->index == 0) {
+    start = 0;
+  }
+  else if ((p = find_sep(r->buf, len, state->sep, state->seplen)) != NULL) {
+    start = p - r->buf + state->seplen;
+  }
+  else {
+    /* no record starts here; the previous range runs through it */
+    start = len;
+  }
+
+  /*
+    A range owns the records that start in [nominal, until). If the first
+    one starts at or past until, a record at least chunk_size long runs
+    through the whole range and belongs to an earlier one.
+  */
+  if (start >= (size_t)(until - from)) {
+    smbc_getFunctionClose(ctx)(ctx, fh);
+    r->len = 0;
+    pool_emit(pool, &r->item);
+    return;
+  }
+
+  /* the end: after the first separator that ends at or past the nominal end */
+  search = (until - from > (off_t)state->seplen ? until - from - state->seplen : 0);
+  if (search < start) {
+    search = start;
+  }
+  while (true) {
+    if (search < len && (p = find_sep(r->buf + search, len - search,
+					state->sep, state->seplen)) != NULL) {
+      len = p - r->buf + state->seplen;
+      break;
+    }
+    if (eof || pool_stopping(pool)) {
+      break;
+    }
+    if (len + 1 > search + state->seplen) {
+      search = len + 1 - state->seplen;
+    }
+    if (len + CHUNK_READ > cap) {
+      cap *= 2;
+      r->buf = realloc(r->buf, cap);
+    }
+    if ((n = read_full(ctx, fh, r->buf + len, CHUNK_READ)) < 0) {
+      goto fail;
+    }
+    eof = (n < CHUNK_READ);
+    len += n;
+  }
+  smbc_getFunctionClose(ctx)(ctx, fh);
+
+  r->data_off = start;
+  r->len = (len > start ? len - start : 0);
+  r->offset = from + start;
+  pool_emit(pool, &r->item);
+  return;
+
+ fail:
+  r->err = errno;
+  smbc_getFunctionClose(ctx)(ctx, fh);
+  free(r->buf);
+  r->buf = NULL;
+  pool_emit(pool, &r->item);
+}
+
+static void chunk_push_next(struct chunk_state *state)
+{
+  struct chunk_task *task;
+
+  if (state->next_task >= state->nchunks) {
+    return;
+  }
+  task = malloc(sizeof(struct chunk_task));
+  task->index = state->next_task++;
+  pool_push(state->pool, &task->item);
+}
+
+static void chunk_free(struct chunk_result *r)
+{
+  if (r != NULL) {
+    free(r->buf);
+    free(r);
+  }
+}
+
+/*
+  Hands r to the block, or raises its error. Every delivered chunk makes
+  room for the next task, which keeps at most window chunks in memory.
+*/
+
+static void chunk_deliver(struct chunk_state *state, struct chunk_result *r)
+{
+  VALUE chunk;
+  VALUE offset;
+  int err = r->err;
+
+  state->current = r;
+  chunk_push_next(state);
+  if (err != 0) {
+    state->current = NULL;
+    chunk_free(r);
+    errno = err;
+    rb_sys_fail(state->url);
+  }
+  if (r->len == 0) {
+    state->current = NULL;
+    chunk_free(r);
+    return;
+  }
+  chunk = rb_str_new(r->buf + r->data_off, r->len);
+  OBJ_FREEZE(chunk);
+  offset = OFFT2NUM(r->offset);
+  state->current = NULL;
+  chunk_free(r);
+  state->yielded++;
+  rb_yield_values(2, chunk, offset);
+}
+
+static VALUE chunk_run(VALUE arg)
+{
+  struct chunk_state *state = (struct chunk_state*)arg;
+  struct chunk_result *r;
+  long i;
+
+  for (i = 0; i < state->window; i++) {
+    chunk_push_next(state);
+  }
+  while ((r = (struct chunk_result*)pool_next(state->pool)) != NULL) {
+    if (!state->ordered) {
+      chunk_deliver(state, r);
+      continue;
+    }
+    state->pending[r->index] = r;
+    while (state->next_yield < state->nchunks && state->pending[state->next_yield] != NULL) {
+      r = state->pending[state->next_yield];
+      state->pending[state->next_yield++] = NULL;
+      chunk_deliver(state, r);
+    }
+  }
+
+  return Qnil;
+}
+
+static VALUE chunk_cleanup(VALUE arg)
+{
+  struct chunk_state *state = (struct chunk_state*)arg;
+  long i;
+
+  chunk_free(state->current);
+  state->current = NULL;
+  pool_free(state->pool);
+  state->pool = NULL;
+  if (state->pending != NULL) {
+    for (i = 0; i < state->nchunks; i++) {
+      chunk_free(state->pending[i]);
+    }
+    free(state->pending);
+  }
+  free(state->url);
+  free(state->sep);
+
+  return Qnil;
+}
+
+/*
+  SMB::File.each_chunk_parallel(url, opts = {}) { |chunk, offset| ... } -> chunks
+
+  Reads url in ranges of about :chunk_size bytes (default 8MB) on
+  :workers native threads (default 8), each range extended to end with
+  :separator (default "\n"), and yields every non-empty range with its
+  offset in the file. Chunks are frozen, so they can be passed on to
+  Ractors as they are. :ordered (default true) yields them in file
+  order; with false they come as soon as they are read. A separator
+  that can overlap itself, such as "\n\n", is refused.
+*/
+
+static VALUE smbfile_s_each_chunk_parallel(int argc, VALUE *argv, VALUE self)
+{
+  VALUE url;
+  VALUE opts;
+  VALUE sep;
+  VALUE v;
+  struct chunk_state state;
+  struct stat st;
+  char *urlp;
+  int nthreads;
+
+  RETURN_ENUMERATOR(self, argc, argv);
+
+  rb_scan_args(argc, argv, "11", &url, &opts);
+
+  StringValue(url);
+  urlp = StringValuePtr(url);
+
+  memset(&state, 0, sizeof(state));
+  state.chunk_size = CHUNK_DEFAULT_SIZE;
+  if (!NIL_P(v = util_opt(opts, "chunk_size"))) {
+    state.chunk_size = NUM2OFFT(v);
+    if (state.chunk_size < CHUNK_MIN_SIZE) {
+      rb_raise(rb_eArgError, "chunk_size must be at least %d", CHUNK_MIN_SIZE);
+    }
+  }
+  sep = util_opt(opts, "separator");
+  sep = (NIL_P(sep) ? rb_str_new2("\n") : sep);
+  StringValue(sep);
+  if (RSTRING_LEN(sep) == 0) {
+    rb_raise(rb_eArgError, "empty separator");
+  }
+  if (sep_overlaps(RSTRING_PTR(sep), RSTRING_LEN(sep))) {
+    rb_raise(rb_eArgError, "separator can overlap itself");
+  }
+  v = util_opt(opts, "workers");
+  nthreads = (NIL_P(v) ? pool_threads_opt(opts) : NUM2INT(v));
+  if (nthreads < 1 || nthreads > POOL_MAX_THREADS) {
+    rb_raise(rb_eArgError, "workers must be between 1 and %d", POOL_MAX_THREADS);
+  }
+  v = util_opt(opts, "ordered");
+  state.ordered = (NIL_P(v) ? true : RTEST(v));
+
+  /* stat through the global context first, so authentication runs here */
+  if (smbc_stat(urlp, &st) < 0) {
+    rb_sys_fail(urlp);
+  }
+  state.size = st.st_size;
+  state.nchunks = (state.size + state.chunk_size - 1) / state.chunk_size;
+  if (state.nchunks == 0) {
+    return INT2FIX(0);
+  }
+  state.seplen = RSTRING_LEN(sep);
+  state.sep = malloc(state.seplen);
+  memcpy(state.sep, RSTRING_PTR(sep), state.seplen);
+  state.url = strdup(urlp);
+  state.window = nthreads * 2;
+  if (state.ordered) {
+    state.pending = calloc(state.nchunks, sizeof(struct chunk_result*));
+  }
+
+  state.pool = pool_new(nthreads, chunk_read, &state);
+  rb_ensure(chunk_run, (VALUE)&state, chunk_cleanup, (VALUE)&state);
+
+  return LONG2NUM(state.yielded);
+}
+
+void init_smbchunk(void)
+{
+  rb_define_singleton_method(cSmbFile, "each_chunk_parallel", smbfile_s_each_chunk_parallel, -1);
+}
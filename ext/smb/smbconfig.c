@@ -0,0 +1,357 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include <libsmbclient.h>
+#include <ruby.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "rubysmb.h"
+#include "smbconfig.h"
+#include "smbctx.h"
+#include "smbfile.h"
+#include "smbutil.h"
+
+#define IO_SIZE_MIN 4096
+#define IO_SIZE_MAX (16 * 1024 * 1024)
+#define SYSTEM_CONFIG "/etc/samba/smb.conf"
+
+static const char *config_keys[] = {
+  "min_protocol", "max_protocol", "signing", "encryption", "timeout", "port",
+  "one_share_per_server", "browse_max_lmb_count", "use_kerberos",
+  "fallback_after_kerberos", "no_auto_anonymous_login", "use_ccache",
+  "case_sensitive", "full_time_names", "workgroup", "user", "netbios_name",
+  "io_size", "config", NULL
+};
+
+static const char *signing_values[] = {
+  "default", "disabled", "if_required", "desired", "required", NULL
+};
+
+static char *signing = NULL;
+
+static int bool_opt(VALUE opts, const char *name)
+{
+  VALUE v = util_opt(opts, name);
+
+  return (NIL_P(v) ? -1 : RTEST(v));
+}
+
+static int int_opt(VALUE opts, const char *name, int min, int max)
+{
+  VALUE v = util_opt(opts, name);
+  int n;
+
+  if (NIL_P(v)) {
+    return -1;
+  }
+  n = NUM2INT(v);
+  if (n < min || n > max) {
+    rb_raise(rb_eArgError, "%s must be between %d and %d", name, min, max);
+  }
+
+  return n;
+}
+
+static char *str_opt(VALUE opts, const char *name)
+{
+  VALUE v = util_opt(opts, name);
+
+  if (NIL_P(v)) {
+    return NULL;
+  }
+  if (SYMBOL_P(v)) {
+    v = rb_sym_to_s(v);
+  }
+
+  return strdup(StringValueCStr(v));
+}
+
+static int symbol_index(VALUE v, const char *name, const char **values)
+{
+  const char *s;
+  int i;
+
+  s = (SYMBOL_P(v) ? rb_id2name(SYM2ID(v)) : StringValueCStr(v));
+  for (i = 0; values[i] != NULL; i++) {
+    if (strcmp(s, values[i]) == 0) {
+      return i;
+    }
+  }
+  rb_raise(rb_eArgError, "invalid %s %s", name, s);
+
+  return -1;
+}
+
+static void check_keys(VALUE opts)
+{
+  VALUE keys = rb_funcall(opts, rb_intern("keys"), 0);
+  VALUE key;
+  const char *name;
+  long i;
+  int j;
+
+  for (i = 0; i < RARRAY_LEN(keys); i++) {
+    key = RARRAY_PTR(keys)[i];
+    name = (SYMBOL_P(key) ? rb_id2name(SYM2ID(key)) : StringValueCStr(key));
+    for (j = 0; config_keys[j] != NULL; j++) {
+      if (strcmp(name, config_keys[j]) == 0) {
+	break;
+      }
+    }
+    if (config_keys[j] == NULL) {
+      rb_raise(rb_eArgError, "unknown option %s", name);
+    }
+  }
+}
+
+/*
+  Signing, and the protocol range on libsmbclients without
+  smbc_setOptionProtocols, can only be set through smb.conf. Writes a
+  small one that includes the real configuration and loads it.
+*/
+
+static void load_config(SMBCCTX *ctx, const char *base, const char *signing_value,
+			const struct ctx_options *opts)
+{
+#ifdef HAVE_SMBC_SETCONFIGURATION
+  char path[] = "/tmp/rubysmb-XXXXXX";
+  FILE *fp;
+  int fd;
+  int ret;
+  int err;
+
+  if ((fd = mkstemp(path)) < 0 || (fp = fdopen(fd, "w")) == NULL) {
+    rb_sys_fail("mkstemp");
+  }
+  fprintf(fp, "[global]\n");
+  if (base != NULL) {
+    fprintf(fp, "\tinclude = %s\n", base);
+  }
+  if (signing_value != NULL) {
+    fprintf(fp, "\tclient signing = %s\n", signing_value);
+    fprintf(fp, "\tclient ipc signing = %s\n", signing_value);
+  }
+#ifndef HAVE_SMBC_SETOPTIONPROTOCOLS
+  if (opts->min_protocol != NULL) {
+    fprintf(fp, "\tclient min protocol = %s\n", opts->min_protocol);
+  }
+  if (opts->max_protocol != NULL) {
+    fprintf(fp, "\tclient max protocol = %s\n", opts->max_protocol);
+  }
+#endif
+  fclose(fp);
+
+  ret = smbc_setConfiguration(ctx, path);
+  err = errno;
+  unlink(path);
+  if (ret < 0) {
+    errno = err;
+    rb_sys_fail(base != NULL ? base : "smbc_setConfiguration");
+  }
+#else
+  rb_raise(rb_eNotImpError, "this libsmbclient can't load a configuration");
+#endif
+}
+
+static VALUE config_str(const char *s)
+{
+  return (s != NULL ? rb_str_new2(s) : Qnil);
+}
+
+static void config_set(VALUE hash, const char *name, VALUE v)
+{
+  if (!NIL_P(v)) {
+    rb_hash_aset(hash, ID2SYM(rb_intern(name)), v);
+  }
+}
+
+static VALUE config_bool(int v)
+{
+  return (v == -1 ? Qnil : (v ? Qtrue : Qfalse));
+}
+
+static VALUE config_int(int v)
+{
+  return (v == -1 ? Qnil : INT2FIX(v));
+}
+
+/*
+  SMB.configuration -> hash of the settings made with SMB.configure
+*/
+
+static VALUE smb_s_configuration(VALUE self)
+{
+  static const char *encryption[] = { "none", "request", "require" };
+  struct ctx_options opts;
+  VALUE hash = rb_hash_new();
+
+  ctx_get_options(&opts);
+  config_set(hash, "min_protocol", config_str(opts.min_protocol));
+  config_set(hash, "max_protocol", config_str(opts.max_protocol));
+  config_set(hash, "signing", signing != NULL ? ID2SYM(rb_intern(signing)) : Qnil);
+  config_set(hash, "encryption", opts.encryption != -1 ?
+	     ID2SYM(rb_intern(encryption[opts.encryption])) : Qnil);
+  config_set(hash, "timeout", opts.timeout != -1 ? rb_float_new(opts.timeout / 1000.0) : Qnil);
+  config_set(hash, "port", config_int(opts.port));
+  config_set(hash, "one_share_per_server", config_bool(opts.one_share_per_server));
+  config_set(hash, "browse_max_lmb_count", config_int(opts.browse_max_lmb_count));
+  config_set(hash, "use_kerberos", config_bool(opts.use_kerberos));
+  config_set(hash, "fallback_after_kerberos", config_bool(opts.fallback_after_kerberos));
+  config_set(hash, "no_auto_anonymous_login", config_bool(opts.no_auto_anonymous_login));
+  config_set(hash, "use_ccache", config_bool(opts.use_ccache));
+  config_set(hash, "case_sensitive", config_bool(opts.case_sensitive));
+  config_set(hash, "full_time_names", config_bool(opts.full_time_names));
+  config_set(hash, "workgroup", config_str(opts.workgroup));
+  config_set(hash, "user", config_str(opts.user));
+  config_set(hash, "netbios_name", config_str(opts.netbios_name));
+  config_set(hash, "io_size", INT2FIX(file_get_bufsize()));
+  ctx_options_free(&opts);
+
+  return hash;
+}
+
+static VALUE configure_body(VALUE arg)
+{
+  VALUE opts = ((VALUE*)arg)[0];
+  struct ctx_options *o = (struct ctx_options*)((VALUE*)arg)[1];
+  SMBCCTX *ctx = smbc_set_context(NULL);
+  VALUE v;
+  VALUE config;
+  const char *new_signing = NULL;
+  bool needs_config;
+  double secs;
+  int io_size;
+
+  o->port = int_opt(opts, "port", 1, 65535);
+  o->browse_max_lmb_count = int_opt(opts, "browse_max_lmb_count", 0, 1 << 20);
+  o->one_share_per_server = bool_opt(opts, "one_share_per_server");
+  o->use_kerberos = bool_opt(opts, "use_kerberos");
+  o->fallback_after_kerberos = bool_opt(opts, "fallback_after_kerberos");
+  o->no_auto_anonymous_login = bool_opt(opts, "no_auto_anonymous_login");
+  o->use_ccache = bool_opt(opts, "use_ccache");
+  o->case_sensitive = bool_opt(opts, "case_sensitive");
+  o->full_time_names = bool_opt(opts, "full_time_names");
+  o->min_protocol = str_opt(opts, "min_protocol");
+  o->max_protocol = str_opt(opts, "max_protocol");
+  o->workgroup = str_opt(opts, "workgroup");
+  o->user = str_opt(opts, "user");
+  o->netbios_name = str_opt(opts, "netbios_name");
+  if (!NIL_P(v = util_opt(opts, "timeout"))) {
+    secs = NUM2DBL(v);
+    if (secs < 0 || secs > 3600) {
+      rb_raise(rb_eArgError, "timeout must be between 0 and 3600 seconds");
+    }
+    o->timeout = (int)(secs * 1000);
+  }
+  if (!NIL_P(v = util_opt(opts, "encryption"))) {
+    static const char *levels[] = { "none", "request", "require", NULL };
+
+    o->encryption = symbol_index(v, "encryption", levels);
+  }
+  io_size = int_opt(opts, "io_size", IO_SIZE_MIN, IO_SIZE_MAX);
+  if (!NIL_P(v = util_opt(opts, "signing"))) {
+    new_signing = signing_values[symbol_index(v, "signing", signing_values)];
+  }
+
+  config = util_opt(opts, "config");
+  needs_config = (!NIL_P(config) || new_signing != NULL);
+#ifndef HAVE_SMBC_SETOPTIONPROTOCOLS
+  needs_config = needs_config || o->min_protocol != NULL || o->max_protocol != NULL;
+#endif
+  if (needs_config) {
+    if (NIL_P(config) && access(SYSTEM_CONFIG, R_OK) == 0) {
+      config = rb_str_new2(SYSTEM_CONFIG);
+    }
+    load_config(ctx, NIL_P(config) ? NULL : StringValueCStr(config),
+		new_signing != NULL ? new_signing : signing, o);
+    if (new_signing != NULL) {
+      free(signing);
+      signing = strdup(new_signing);
+    }
+  }
+
+  ctx_set_options(o);
+  if (!ctx_apply_options(ctx)) {
+    rb_raise(eSmbError, "libsmbclient refused protocol range %s..%s",
+	     o->min_protocol != NULL ? o->min_protocol : "",
+	     o->max_protocol != NULL ? o->max_protocol : "");
+  }
+  if (io_size != -1) {
+    file_set_bufsize(io_size);
+  }
+
+  return Qnil;
+}
+
+static VALUE configure_free(VALUE arg)
+{
+  ctx_options_free((struct ctx_options*)arg);
+
+  return Qnil;
+}
+
+/*
+  SMB.configure(opts) -> SMB.configuration
+
+  Settings apply to the global context right away and to every context
+  made for worker threads from then on. Settings that aren't given are
+  left as they are.
+
+    :min_protocol, :max_protocol  dialect names, e.g. "SMB2_10", "SMB3"
+    :signing      :default, :disabled, :if_required, :desired or :required
+    :encryption   :none, :request or :require
+    :timeout      seconds
+    :io_size      bytes per read for SMB::File buffers (4 KiB to 16 MiB)
+    :config       an smb.conf to load instead of the system one
+    :port, :workgroup, :user, :netbios_name, :one_share_per_server,
+    :browse_max_lmb_count, :use_kerberos, :fallback_after_kerberos,
+    :no_auto_anonymous_login, :use_ccache, :case_sensitive,
+    :full_time_names  the libsmbclient options of the same name
+
+  Signing (and :config) go through a generated smb.conf that includes the
+  system one, as libsmbclient has no call for them; that configuration is
+  process wide.
+*/
+
+static VALUE smb_s_configure(VALUE self, VALUE opts)
+{
+  struct ctx_options o;
+  VALUE args[2];
+
+  Check_Type(opts, T_HASH);
+  check_keys(opts);
+
+  ctx_options_init(&o);
+  args[0] = opts;
+  args[1] = (VALUE)&o;
+  rb_ensure(configure_body, (VALUE)args, configure_free, (VALUE)&o);
+
+  return smb_s_configuration(self);
+}
+
+void init_smbconfig(void)
+{
+  rb_define_module_function(mSMB, "configure", smb_s_configure, 1);
+  rb_define_module_function(mSMB, "configuration", smb_s_configuration, 0);
+}
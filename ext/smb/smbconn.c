@@ -0,0 +1,330 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include <libsmbclient.h>
+#include <ruby.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include "rubysmb.h"
+#include "smbconn.h"
+#include "smbctx.h"
+#include "smbutil.h"
+
+/*
+  Connections opened ahead of time on the global context, and kept warm.
+  Everything here runs on Ruby threads with the GVL held, like every
+  other use of the global context, so the list needs no lock of its own.
+*/
+
+struct conn {
+  struct conn *next;
+  char *server;
+  char *share;
+  char *url;
+  time_t connected;
+  time_t used;
+  int failures;
+  int err;
+};
+
+static struct conn *conns = NULL;
+static VALUE keepalive_thread = Qnil;
+static double keepalive_interval = 0;
+
+static int conn_open(struct conn *c)
+{
+  int dh;
+
+  if ((dh = smbc_opendir(c->url)) < 0) {
+    c->failures++;
+    c->err = errno;
+    return -1;
+  }
+  smbc_closedir(dh);
+  c->used = time(NULL);
+  c->err = 0;
+
+  return 0;
+}
+
+static struct conn *conn_find(const char *server, const char *share)
+{
+  struct conn *c;
+
+  for (c = conns; c != NULL; c = c->next) {
+    if (strcmp(c->server, server) == 0 && strcmp(c->share, share) == 0) {
+      return c;
+    }
+  }
+
+  return NULL;
+}
+
+static void conn_free(struct conn *c)
+{
+  free(c->server);
+  free(c->share);
+  free(c->url);
+  free(c);
+}
+
+/* the cached libsmbclient connection for c, if there is one */
+static SMBCSRV *conn_cached(SMBCCTX *ctx, struct conn *c)
+{
+  char workgroup[256] = "";
+  char username[256] = "";
+  char password[256] = "";
+  const char *share = (*c->share != '\0' ? c->share : "IPC$");
+
+  ctx_lookup_auth(c->server, share, false, workgroup, sizeof(workgroup),
+		  username, sizeof(username), password, sizeof(password));
+  memset(password, 0, sizeof(password));
+  if (*workgroup == '\0' && smbc_getWorkgroup(ctx) != NULL) {
+    strncpy(workgroup, smbc_getWorkgroup(ctx), sizeof(workgroup) - 1);
+  }
+  if (*username == '\0' && smbc_getUser(ctx) != NULL) {
+    strncpy(username, smbc_getUser(ctx), sizeof(username) - 1);
+  }
+
+  return smbc_getFunctionGetCachedServer(ctx)(ctx, c->server, share, workgroup, username);
+}
+
+/*
+  SMB.connect(server, share = nil) -> true
+  SMB.connect(url) -> true
+
+  Resolves the server and sets up the session and tree connect now, on
+  the global context, so the first real request doesn't pay for them.
+  The connection is remembered for SMB.keepalive and SMB.connections.
+*/
+
+static VALUE smb_s_connect(int argc, VALUE *argv, VALUE self)
+{
+  VALUE server;
+  VALUE share;
+  struct conn *c;
+  char *serverp;
+  char *sharep;
+  char *url;
+  int server_i, server_len;
+  int share_i, share_len;
+  int path_i, path_len;
+  int username_i, username_len;
+  int password_i, password_len;
+
+  rb_scan_args(argc, argv, "11", &server, &share);
+
+  StringValue(server);
+  serverp = StringValueCStr(server);
+  if (strncmp(serverp, "smb://", 6) == 0) {
+    url = ALLOCA_N(char, strlen(serverp) + 1);
+    strcpy(url, serverp);
+    if (!util_parse_url(url,
+			&server_i, &server_len,
+			&share_i, &share_len,
+			&path_i, &path_len,
+			&username_i, &username_len,
+			&password_i, &password_len) || server_i == 0) {
+      rb_raise(eSmbError, "invalid url");
+    }
+    url[server_i + server_len] = '\0';
+    serverp = url + server_i;
+    sharep = "";
+    if (share_i != 0) {
+      url[share_i + share_len] = '\0';
+      sharep = url + share_i;
+    }
+  }
+  else {
+    sharep = "";
+    if (!NIL_P(share)) {
+      StringValue(share);
+      sharep = StringValueCStr(share);
+    }
+  }
+
+  if ((c = conn_find(serverp, sharep)) == NULL) {
+    c = calloc(1, sizeof(struct conn));
+    c->server = strdup(serverp);
+    c->share = strdup(sharep);
+    c->url = malloc(strlen(serverp) + strlen(sharep) + 8);
+    sprintf(c->url, "smb://%s%s%s", serverp, *sharep != '\0' ? "/" : "", sharep);
+    if (conn_open(c) < 0) {
+      int err = c->err;
+
+      conn_free(c);
+      errno = err;
+      rb_sys_fail(StringValueCStr(server));
+    }
+    c->connected = c->used;
+    c->next = conns;
+    conns = c;
+  }
+  else if (conn_open(c) < 0) {
+    errno = c->err;
+    rb_sys_fail(c->url);
+  }
+
+  return Qtrue;
+}
+
+/*
+  SMB.connections -> [{ :server, :share, :connected, :idle, :failures }, ...]
+
+  :connected is whether libsmbclient still holds a live connection (nil
+  when it can't be told), :idle the seconds since the connection was last
+  opened or kept alive.
+*/
+
+static VALUE smb_s_connections(VALUE self)
+{
+  SMBCCTX *ctx = smbc_set_context(NULL);
+  SMBCSRV *srv;
+  struct conn *c;
+  VALUE list = rb_ary_new();
+  VALUE hash;
+  VALUE connected;
+  time_t now = time(NULL);
+
+  for (c = conns; c != NULL; c = c->next) {
+    connected = Qnil;
+    if (ctx != NULL && (srv = conn_cached(ctx, c)) != NULL) {
+      connected = (smbc_getFunctionCheckServer(ctx)(ctx, srv) == 0 ? Qtrue : Qfalse);
+    }
+    hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("server")), rb_str_new2(c->server));
+    rb_hash_aset(hash, ID2SYM(rb_intern("share")), *c->share != '\0' ? rb_str_new2(c->share) : Qnil);
+    rb_hash_aset(hash, ID2SYM(rb_intern("connected")), connected);
+    rb_hash_aset(hash, ID2SYM(rb_intern("idle")), LONG2NUM((long)(now - c->used)));
+    rb_hash_aset(hash, ID2SYM(rb_intern("failures")), INT2FIX(c->failures));
+    rb_ary_push(list, hash);
+  }
+
+  return list;
+}
+
+/*
+  SMB.disconnect(server = nil, share = nil) -> number forgotten
+
+  Forgets the matching connections and drops them from libsmbclient's
+  cache unless files are still open on them. With no arguments every
+  cached connection is purged.
+*/
+
+static VALUE smb_s_disconnect(int argc, VALUE *argv, VALUE self)
+{
+  SMBCCTX *ctx = smbc_set_context(NULL);
+  SMBCSRV *srv;
+  VALUE server;
+  VALUE share;
+  struct conn **p;
+  struct conn *c;
+  int removed = 0;
+
+  rb_scan_args(argc, argv, "02", &server, &share);
+
+  p = &conns;
+  while ((c = *p) != NULL) {
+    if ((NIL_P(server) || strcmp(c->server, StringValueCStr(server)) == 0) &&
+	(NIL_P(share) || strcmp(c->share, StringValueCStr(share)) == 0)) {
+      if (ctx != NULL && !NIL_P(server) && (srv = conn_cached(ctx, c)) != NULL) {
+	smbc_getFunctionRemoveUnusedServer(ctx)(ctx, srv);
+      }
+      *p = c->next;
+      conn_free(c);
+      removed++;
+    }
+    else {
+      p = &c->next;
+    }
+  }
+  if (ctx != NULL && NIL_P(server)) {
+    smbc_getFunctionPurgeCachedServers(ctx)(ctx);
+  }
+
+  return INT2FIX(removed);
+}
+
+static VALUE keepalive_loop(void *arg)
+{
+  struct conn *c;
+  double interval;
+
+  while ((interval = keepalive_interval) > 0) {
+    rb_thread_wait_for(rb_time_interval(rb_float_new(interval)));
+    if (rb_thread_current() != keepalive_thread) {
+      break;
+    }
+    /* a failed round trip reconnects on the next one, so just count it */
+    for (c = conns; c != NULL; c = c->next) {
+      conn_open(c);
+    }
+  }
+
+  return Qnil;
+}
+
+/*
+  SMB.keepalive(interval = 60) -> thread
+  SMB.keepalive(nil) -> nil
+
+  Starts (or retimes) a background thread that touches every connection
+  made with SMB.connect every interval seconds, so servers don't drop
+  them as idle; nil or 0 stops it.
+*/
+
+static VALUE smb_s_keepalive(int argc, VALUE *argv, VALUE self)
+{
+  VALUE interval;
+  double secs;
+
+  rb_scan_args(argc, argv, "01", &interval);
+
+  secs = (argc == 0 ? 60 : (RTEST(interval) ? NUM2DBL(interval) : 0));
+  if (secs < 0) {
+    rb_raise(rb_eArgError, "negative interval");
+  }
+  keepalive_interval = secs;
+
+  if (secs == 0) {
+    if (!NIL_P(keepalive_thread)) {
+      rb_funcall(keepalive_thread, rb_intern("kill"), 0);
+      keepalive_thread = Qnil;
+    }
+    return Qnil;
+  }
+  if (NIL_P(keepalive_thread) || !RTEST(rb_funcall(keepalive_thread, rb_intern("alive?"), 0))) {
+    keepalive_thread = rb_thread_create(keepalive_loop, NULL);
+  }
+
+  return keepalive_thread;
+}
+
+void init_smbconn(void)
+{
+  rb_global_variable(&keepalive_thread);
+  rb_define_module_function(mSMB, "connect", smb_s_connect, -1);
+  rb_define_module_function(mSMB, "connections", smb_s_connections, 0);
+  rb_define_module_function(mSMB, "disconnect", smb_s_disconnect, -1);
+  rb_define_module_function(mSMB, "keepalive", smb_s_keepalive, -1);
+}
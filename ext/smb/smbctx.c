@@ -0,0 +1,477 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include <libsmbclient.h>
+#include <ruby.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "rubysmb.h"
+#include "smbbackend.h"
+#include "smbctx.h"
+
+/*
+  Credentials for every context. Entries added through SMB.credentials
+  are explicit and answer the global context too, so auth_fn only calls
+  into Ruby when none of them fits. Answers handed out by
+  SMB.on_authentication are remembered as well, but only replayed to
+  worker contexts, which can't call back into Ruby.
+*/
+
+struct authent {
+  struct authent *next;
+  char *server;
+  char *share;
+  char *workgroup;
+  char *username;
+  char *password;
+  bool explicit;
+};
+
+static struct authent *auth_list = NULL;
+static pthread_mutex_t auth_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *auth_strdup(const char *s)
+{
+  return strdup(s != NULL ? s : "");
+}
+
+static void auth_copy(char *dest, const char *src, int maxlen)
+{
+  if (maxlen <= 0) {
+    return;
+  }
+  strncpy(dest, src, maxlen - 1);
+  dest[maxlen - 1] = '\0';
+}
+
+static void auth_wipe(char *s)
+{
+  if (s != NULL) {
+    memset(s, 0, strlen(s));
+    free(s);
+  }
+}
+
+static void auth_set(const char *server, const char *share,
+		     const char *workgroup, const char *username,
+		     const char *password, bool explicit)
+{
+  struct authent *a;
+
+  pthread_mutex_lock(&auth_lock);
+  for (a = auth_list; a != NULL; a = a->next) {
+    if (a->explicit == explicit && strcmp(a->server, server) == 0 &&
+	strcmp(a->share, share) == 0) {
+      break;
+    }
+  }
+  if (a == NULL) {
+    a = calloc(1, sizeof(struct authent));
+    a->server = auth_strdup(server);
+    a->share = auth_strdup(share);
+    a->explicit = explicit;
+    a->next = auth_list;
+    auth_list = a;
+  }
+  else {
+    free(a->workgroup);
+    free(a->username);
+    auth_wipe(a->password);
+  }
+  a->workgroup = auth_strdup(workgroup);
+  a->username = auth_strdup(username);
+  a->password = auth_strdup(password);
+  pthread_mutex_unlock(&auth_lock);
+}
+
+void ctx_remember_auth(const char *server, const char *share,
+		       const char *workgroup, const char *username,
+		       const char *password)
+{
+  auth_set(server, share, workgroup, username, password, false);
+}
+
+/* an empty server or share stands for any */
+void ctx_add_auth(const char *server, const char *share,
+		  const char *workgroup, const char *username,
+		  const char *password)
+{
+  auth_set(server != NULL ? server : "", share != NULL ? share : "",
+	   workgroup, username, password, true);
+}
+
+static void authent_free(struct authent *a)
+{
+  free(a->server);
+  free(a->share);
+  free(a->workgroup);
+  free(a->username);
+  auth_wipe(a->password);
+  free(a);
+}
+
+/* removes explicit entries; a NULL share removes every share on server */
+int ctx_remove_auth(const char *server, const char *share)
+{
+  struct authent **p;
+  struct authent *a;
+  int removed = 0;
+
+  pthread_mutex_lock(&auth_lock);
+  p = &auth_list;
+  while ((a = *p) != NULL) {
+    if (a->explicit && strcmp(a->server, server != NULL ? server : "") == 0 &&
+	(share == NULL || strcmp(a->share, share) == 0)) {
+      *p = a->next;
+      authent_free(a);
+      removed++;
+    }
+    else {
+      p = &a->next;
+    }
+  }
+  pthread_mutex_unlock(&auth_lock);
+
+  return removed;
+}
+
+/*
+  Removes every explicit entry. Remembered ones stay: the global context
+  doesn't ask for servers it is already connected to, so the pooled
+  contexts would have nothing left to log in with.
+*/
+
+void ctx_clear_auth(void)
+{
+  struct authent **p;
+  struct authent *a;
+
+  pthread_mutex_lock(&auth_lock);
+  p = &auth_list;
+  while ((a = *p) != NULL) {
+    if (a->explicit) {
+      *p = a->next;
+      authent_free(a);
+    }
+    else {
+      p = &a->next;
+    }
+  }
+  pthread_mutex_unlock(&auth_lock);
+}
+
+/*
+  Calls fn for every explicit entry. The entries are copied first, so fn
+  runs without the lock and may raise.
+*/
+
+void ctx_each_auth(void (*fn)(const char*, const char*, const char*, const char*, void*), void *arg)
+{
+  struct authent *a;
+  struct authent *copy = NULL;
+  struct authent *c;
+
+  pthread_mutex_lock(&auth_lock);
+  for (a = auth_list; a != NULL; a = a->next) {
+    if (a->explicit) {
+      c = calloc(1, sizeof(struct authent));
+      c->server = auth_strdup(a->server);
+      c->share = auth_strdup(a->share);
+      c->workgroup = auth_strdup(a->workgroup);
+      c->username = auth_strdup(a->username);
+      c->next = copy;
+      copy = c;
+    }
+  }
+  pthread_mutex_unlock(&auth_lock);
+
+  while ((c = copy) != NULL) {
+    copy = c->next;
+    fn(c->server, c->share, c->workgroup, c->username, arg);
+    authent_free(c);
+  }
+}
+
+/*
+  The most specific entry wins: the exact share, then the whole server,
+  then that share name on any server, then anything; explicit entries
+  beat remembered ones on a tie. A share given without a server still
+  has to match. A remembered answer for one share also stands in for
+  the rest of its server, as on_authentication callbacks rarely care
+  about the share.
+*/
+
+static int auth_score(const struct authent *a, const char *server, const char *share)
+{
+  int score;
+
+  if (*a->server == '\0') {
+    if (*a->share == '\0') {
+      score = 1;
+    }
+    else if (strcmp(a->share, share) == 0) {
+      score = 2;
+    }
+    else {
+      return 0;
+    }
+  }
+  else if (strcmp(a->server, server) != 0) {
+    return 0;
+  }
+  else if (*a->share == '\0') {
+    score = 3;
+  }
+  else if (strcmp(a->share, share) == 0) {
+    score = 4;
+  }
+  else if (!a->explicit) {
+    score = 3;
+  }
+  else {
+    return 0;
+  }
+
+  return score * 2 + (a->explicit ? 1 : 0);
+}
+
+bool ctx_lookup_auth(const char *server, const char *share, bool explicit_only,
+		     char *workgroup, int wgmaxlen,
+		     char *username, int unmaxlen,
+		     char *password, int pwmaxlen)
+{
+  struct authent *a;
+  struct authent *match = NULL;
+  int best = 0;
+  int score;
+
+  pthread_mutex_lock(&auth_lock);
+  for (a = auth_list; a != NULL; a = a->next) {
+    if (explicit_only && !a->explicit) {
+      continue;
+    }
+    if ((score = auth_score(a, server, share)) > best) {
+      best = score;
+      match = a;
+    }
+  }
+  if (match != NULL) {
+    auth_copy(workgroup, match->workgroup, wgmaxlen);
+    auth_copy(username, match->username, unmaxlen);
+    auth_copy(password, match->password, pwmaxlen);
+  }
+  pthread_mutex_unlock(&auth_lock);
+
+  return match != NULL;
+}
+
+static void ctx_auth_fn(SMBCCTX *ctx, const char *server, const char *share,
+			char *workgroup, int wgmaxlen,
+			char *username, int unmaxlen,
+			char *password, int pwmaxlen)
+{
+  ctx_lookup_auth(server, share, false, workgroup, wgmaxlen,
+		  username, unmaxlen, password, pwmaxlen);
+}
+
+static struct ctx_options options = {
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, NULL, NULL, NULL, NULL, NULL
+};
+static pthread_mutex_t options_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void ctx_options_init(struct ctx_options *opts)
+{
+  memset(opts, 0, sizeof(struct ctx_options));
+  opts->timeout = -1;
+  opts->port = -1;
+  opts->browse_max_lmb_count = -1;
+  opts->one_share_per_server = -1;
+  opts->use_kerberos = -1;
+  opts->fallback_after_kerberos = -1;
+  opts->no_auto_anonymous_login = -1;
+  opts->use_ccache = -1;
+  opts->case_sensitive = -1;
+  opts->full_time_names = -1;
+  opts->encryption = -1;
+}
+
+void ctx_options_free(struct ctx_options *opts)
+{
+  free(opts->min_protocol);
+  free(opts->max_protocol);
+  free(opts->workgroup);
+  free(opts->user);
+  free(opts->netbios_name);
+}
+
+#define MERGE_INT(f) if (opts->f != -1) options.f = opts->f
+#define MERGE_STR(f) if (opts->f != NULL) { free(options.f); options.f = strdup(opts->f); }
+#define COPY_STR(f) opts->f = (options.f != NULL ? strdup(options.f) : NULL)
+
+/* merges the settings that are set in opts into the current ones */
+void ctx_set_options(const struct ctx_options *opts)
+{
+  pthread_mutex_lock(&options_lock);
+  MERGE_INT(timeout);
+  MERGE_INT(port);
+  MERGE_INT(browse_max_lmb_count);
+  MERGE_INT(one_share_per_server);
+  MERGE_INT(use_kerberos);
+  MERGE_INT(fallback_after_kerberos);
+  MERGE_INT(no_auto_anonymous_login);
+  MERGE_INT(use_ccache);
+  MERGE_INT(case_sensitive);
+  MERGE_INT(full_time_names);
+  MERGE_INT(encryption);
+  MERGE_STR(min_protocol);
+  MERGE_STR(max_protocol);
+  MERGE_STR(workgroup);
+  MERGE_STR(user);
+  MERGE_STR(netbios_name);
+  pthread_mutex_unlock(&options_lock);
+}
+
+void ctx_get_options(struct ctx_options *opts)
+{
+  pthread_mutex_lock(&options_lock);
+  *opts = options;
+  COPY_STR(min_protocol);
+  COPY_STR(max_protocol);
+  COPY_STR(workgroup);
+  COPY_STR(user);
+  COPY_STR(netbios_name);
+  pthread_mutex_unlock(&options_lock);
+}
+
+/*
+  Returns false if libsmbclient refused the protocol range; everything
+  else is applied regardless.
+*/
+
+bool ctx_apply_options(SMBCCTX *ctx)
+{
+  bool ok = true;
+
+  pthread_mutex_lock(&options_lock);
+  if (options.timeout != -1) {
+    smbc_setTimeout(ctx, options.timeout);
+  }
+  if (options.port != -1) {
+    smbc_setPort(ctx, options.port);
+  }
+  if (options.browse_max_lmb_count != -1) {
+    smbc_setOptionBrowseMaxLmbCount(ctx, options.browse_max_lmb_count);
+  }
+  if (options.one_share_per_server != -1) {
+    smbc_setOptionOneSharePerServer(ctx, options.one_share_per_server);
+  }
+  if (options.use_kerberos != -1) {
+    smbc_setOptionUseKerberos(ctx, options.use_kerberos);
+  }
+  if (options.fallback_after_kerberos != -1) {
+    smbc_setOptionFallbackAfterKerberos(ctx, options.fallback_after_kerberos);
+  }
+  if (options.no_auto_anonymous_login != -1) {
+    smbc_setOptionNoAutoAnonymousLogin(ctx, options.no_auto_anonymous_login);
+  }
+  if (options.use_ccache != -1) {
+    smbc_setOptionUseCCache(ctx, options.use_ccache);
+  }
+  if (options.case_sensitive != -1) {
+    smbc_setOptionCaseSensitive(ctx, options.case_sensitive);
+  }
+  if (options.full_time_names != -1) {
+    smbc_setOptionFullTimeNames(ctx, options.full_time_names);
+  }
+  if (options.encryption != -1) {
+    smbc_setOptionSmbEncryptionLevel(ctx, (smbc_smb_encrypt_level)options.encryption);
+  }
+  if (options.workgroup != NULL) {
+    smbc_setWorkgroup(ctx, options.workgroup);
+  }
+  if (options.user != NULL) {
+    smbc_setUser(ctx, options.user);
+  }
+  if (options.netbios_name != NULL) {
+    smbc_setNetbiosName(ctx, options.netbios_name);
+  }
+#ifdef HAVE_SMBC_SETOPTIONPROTOCOLS
+  if (options.min_protocol != NULL || options.max_protocol != NULL) {
+    ok = smbc_setOptionProtocols(ctx, options.min_protocol, options.max_protocol);
+  }
+#endif
+  pthread_mutex_unlock(&options_lock);
+
+  return ok;
+}
+
+void ctx_init(void)
+{
+#ifdef HAVE_SMBC_THREAD_POSIX
+  smbc_thread_posix();
+#endif
+}
+
+SMBCCTX *ctx_new(void)
+{
+  SMBCCTX *ctx;
+
+  ctx = smbc_new_context();
+  if (ctx == NULL) {
+    return NULL;
+  }
+  smbc_setFunctionAuthDataWithContext(ctx, ctx_auth_fn);
+  ctx_apply_options(ctx);
+  if (smbc_init_context(ctx) == NULL) {
+    smbc_free_context(ctx, 1);
+    return NULL;
+  }
+  backend_apply(ctx);
+
+  return ctx;
+}
+
+void ctx_free(SMBCCTX *ctx)
+{
+  if (ctx != NULL) {
+    smbc_free_context(ctx, 1);
+  }
+}
+
+/*
+  malloc'd "base/name", safe to call without the GVL.
+*/
+
+char *ctx_url_join(const char *base, const char *name)
+{
+  size_t baselen = strlen(base);
+  size_t namelen = strlen(name);
+  char *url = malloc(baselen + namelen + 2);
+
+  memcpy(url, base, baselen);
+  if (baselen == 0 || base[baselen - 1] != '/') {
+    url[baselen++] = '/';
+  }
+  memcpy(url + baselen, name, namelen + 1);
+
+  return url;
+}
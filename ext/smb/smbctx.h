@@ -0,0 +1,68 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef RUBYSMB_SMBCTX_H
+#define RUBYSMB_SMBCTX_H
+
+#include <stdbool.h>
+
+/*
+  Private libsmbclient contexts for native worker threads. The global
+  context set up by smbc_init is only ever touched while holding the GVL;
+  anything running without it gets a context of its own.
+*/
+
+/* settings from SMB.configure, applied to every context; -1 or NULL is unset */
+struct ctx_options {
+  int timeout;
+  int port;
+  int browse_max_lmb_count;
+  int one_share_per_server;
+  int use_kerberos;
+  int fallback_after_kerberos;
+  int no_auto_anonymous_login;
+  int use_ccache;
+  int case_sensitive;
+  int full_time_names;
+  int encryption;
+  char *min_protocol;
+  char *max_protocol;
+  char *workgroup;
+  char *user;
+  char *netbios_name;
+};
+
+void ctx_init(void);
+void ctx_options_init(struct ctx_options*);
+void ctx_set_options(const struct ctx_options*);
+void ctx_get_options(struct ctx_options*);
+void ctx_options_free(struct ctx_options*);
+bool ctx_apply_options(SMBCCTX*);
+SMBCCTX *ctx_new(void);
+void ctx_free(SMBCCTX*);
+char *ctx_url_join(const char*, const char*);
+void ctx_remember_auth(const char*, const char*, const char*, const char*, const char*);
+void ctx_add_auth(const char*, const char*, const char*, const char*, const char*);
+int ctx_remove_auth(const char*, const char*);
+void ctx_clear_auth(void);
+void ctx_each_auth(void (*)(const char*, const char*, const char*, const char*, void*), void*);
+bool ctx_lookup_auth(const char*, const char*, bool, char*, int, char*, int, char*, int);
+
+#endif
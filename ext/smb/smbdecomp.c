@@ -0,0 +1,295 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+
+#include <ruby.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD_H
+#include <zstd.h>
+#endif
+#include "rubysmb.h"
+#include "smbbufpool.h"
+#include "smbdecomp.h"
+
+/*
+  Streaming decompression for SMB::File's read buffer. The file hands
+  a fill callback that reads compressed bytes from the share, and gets
+  decompressed bytes back in its own buffer, so gets/read/each_line work
+  on the decompressed stream unchanged. DECOMP_AUTO looks at the magic
+  of the first block and falls back to passing the bytes through.
+*/
+
+struct decomp {
+  enum decomp_kind requested;
+  enum decomp_kind kind;
+  char *in;
+  size_t insize;
+  size_t inlen;
+  size_t inpos;
+  bool in_eof;
+  bool started;
+  /* at the end of a gzip member or zstd frame, where EOF is fine */
+  bool boundary;
+#ifdef HAVE_ZLIB_H
+  z_stream z;
+  bool z_init;
+#endif
+#ifdef HAVE_ZSTD_H
+  ZSTD_DStream *zs;
+#endif
+};
+
+enum decomp_kind decomp_kind_opt(VALUE v)
+{
+  const char *name;
+
+  if (!RTEST(v)) {
+    return DECOMP_NONE;
+  }
+  if (v == Qtrue) {
+    return DECOMP_AUTO;
+  }
+  name = (SYMBOL_P(v) ? rb_id2name(SYM2ID(v)) : StringValuePtr(v));
+  if (strcmp(name, "auto") == 0) {
+    return DECOMP_AUTO;
+  }
+  if (strcmp(name, "gzip") == 0 || strcmp(name, "gz") == 0) {
+#ifndef HAVE_ZLIB_H
+    rb_raise(rb_eNotImpError, "gzip support was not compiled in");
+#endif
+    return DECOMP_GZIP;
+  }
+  if (strcmp(name, "zstd") == 0 || strcmp(name, "zst") == 0) {
+#ifndef HAVE_ZSTD_H
+    rb_raise(rb_eNotImpError, "zstd support was not compiled in");
+#endif
+    return DECOMP_ZSTD;
+  }
+  rb_raise(rb_eArgError, "unknown decompression %s", name);
+
+  return DECOMP_NONE;
+}
+
+struct decomp *decomp_new(enum decomp_kind kind, size_t insize)
+{
+  struct decomp *d = calloc(1, sizeof(struct decomp));
+
+  d->requested = kind;
+  d->kind = kind;
+  d->in = bufpool_get(insize < 65536 ? 65536 : insize, &d->insize);
+  d->boundary = true;
+
+  return d;
+}
+
+static enum decomp_kind decomp_detect(const unsigned char *p, size_t len)
+{
+  if (len >= 2 && p[0] == 0x1f && p[1] == 0x8b) {
+    return DECOMP_GZIP;
+  }
+  if (len >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd) {
+    return DECOMP_ZSTD;
+  }
+
+  return DECOMP_NONE;
+}
+
+static int decomp_start(struct decomp *d)
+{
+  if (d->started) {
+    return 0;
+  }
+  d->started = true;
+  switch (d->kind)
+    {
+    case DECOMP_GZIP:
+#ifdef HAVE_ZLIB_H
+      if (!d->z_init) {
+	/* 32 lets zlib take gzip and zlib headers alike */
+	if (inflateInit2(&d->z, 15 + 32) != Z_OK) {
+	  errno = ENOMEM;
+	  return -1;
+	}
+	d->z_init = true;
+      }
+      return 0;
+#else
+      errno = ENOTSUP;
+      return -1;
+#endif
+    case DECOMP_ZSTD:
+#ifdef HAVE_ZSTD_H
+      if (d->zs == NULL && (d->zs = ZSTD_createDStream()) == NULL) {
+	errno = ENOMEM;
+	return -1;
+      }
+      ZSTD_initDStream(d->zs);
+      return 0;
+#else
+      errno = ENOTSUP;
+      return -1;
+#endif
+    default:
+      return 0;
+    }
+}
+
+/*
+  Runs the decoder once over the buffered input; returns the number of
+  bytes produced, or -1 with errno set to EILSEQ on corrupt data.
+*/
+
+static ssize_t decomp_step(struct decomp *d, char *out, size_t len)
+{
+  switch (d->kind)
+    {
+#ifdef HAVE_ZLIB_H
+    case DECOMP_GZIP:
+      {
+	int ret;
+	size_t avail = d->inlen - d->inpos;
+
+	d->z.next_in = (Bytef*)d->in + d->inpos;
+	d->z.avail_in = avail;
+	d->z.next_out = (Bytef*)out;
+	d->z.avail_out = len;
+	ret = inflate(&d->z, Z_NO_FLUSH);
+	d->inpos += avail - d->z.avail_in;
+	if (ret == Z_STREAM_END) {
+	  /* concatenated members are one stream, as with gunzip */
+	  inflateReset(&d->z);
+	  d->boundary = true;
+	}
+	else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+	  errno = EILSEQ;
+	  return -1;
+	}
+	else if (avail != d->z.avail_in) {
+	  d->boundary = false;
+	}
+	return len - d->z.avail_out;
+      }
+#endif
+#ifdef HAVE_ZSTD_H
+    case DECOMP_ZSTD:
+      {
+	ZSTD_inBuffer in = { d->in, d->inlen, d->inpos };
+	ZSTD_outBuffer o = { out, len, 0 };
+	size_t ret = ZSTD_decompressStream(d->zs, &o, &in);
+
+	if (ZSTD_isError(ret)) {
+	  errno = EILSEQ;
+	  return -1;
+	}
+	d->inpos = in.pos;
+	d->boundary = (ret == 0);
+	return o.pos;
+      }
+#endif
+    default:
+      {
+	size_t n = d->inlen - d->inpos;
+
+	n = (n < len ? n : len);
+	memcpy(out, d->in + d->inpos, n);
+	d->inpos += n;
+	return n;
+      }
+    }
+}
+
+/*
+  Fills out with up to len decompressed bytes; returns 0 at the end of
+  the stream and -1 with errno set on failure. A stream that ends in
+  the middle of a member or frame is reported as EILSEQ.
+*/
+
+ssize_t decomp_read(struct decomp *d, char *out, size_t len, decomp_fill_fn fill, void *arg)
+{
+  ssize_t n;
+
+  while (true) {
+    if (d->inpos == d->inlen && !d->in_eof) {
+      if ((n = fill(arg, d->in, d->insize)) < 0) {
+	return -1;
+      }
+      d->inlen = n;
+      d->inpos = 0;
+      d->in_eof = (n == 0);
+    }
+    if (d->kind == DECOMP_AUTO) {
+      d->kind = decomp_detect((unsigned char*)d->in, d->inlen);
+    }
+    if (decomp_start(d) < 0) {
+      return -1;
+    }
+    if ((n = decomp_step(d, out, len)) != 0) {
+      return n;
+    }
+    if (d->inpos == d->inlen && d->in_eof) {
+      if (d->kind != DECOMP_NONE && !d->boundary) {
+	errno = EILSEQ;
+	return -1;
+      }
+      return 0;
+    }
+  }
+}
+
+/* forgets all state, for reading the stream again from the start */
+void decomp_reset(struct decomp *d)
+{
+#ifdef HAVE_ZLIB_H
+  if (d->z_init) {
+    inflateReset(&d->z);
+  }
+#endif
+  d->kind = d->requested;
+  d->inlen = 0;
+  d->inpos = 0;
+  d->in_eof = false;
+  d->started = false;
+  d->boundary = true;
+}
+
+void decomp_free(struct decomp *d)
+{
+  if (d == NULL) {
+    return;
+  }
+#ifdef HAVE_ZLIB_H
+  if (d->z_init) {
+    inflateEnd(&d->z);
+  }
+#endif
+#ifdef HAVE_ZSTD_H
+  if (d->zs != NULL) {
+    ZSTD_freeDStream(d->zs);
+  }
+#endif
+  bufpool_put(d->in, d->insize);
+  free(d);
+}
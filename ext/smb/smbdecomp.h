@@ -0,0 +1,45 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+
+#ifndef RUBYSMB_SMBDECOMP_H
+#define RUBYSMB_SMBDECOMP_H
+
+#include <sys/types.h>
+
+enum decomp_kind {
+  DECOMP_NONE,
+  DECOMP_AUTO,
+  DECOMP_GZIP,
+  DECOMP_ZSTD
+};
+
+/* reads up to len compressed bytes into buf; 0 at end of file */
+typedef ssize_t (*decomp_fill_fn)(void *arg, char *buf, size_t len);
+
+struct decomp;
+
+enum decomp_kind decomp_kind_opt(VALUE);
+struct decomp *decomp_new(enum decomp_kind, size_t);
+ssize_t decomp_read(struct decomp*, char*, size_t, decomp_fill_fn, void*);
+void decomp_reset(struct decomp*);
+void decomp_free(struct decomp*);
+
+#endif
@@ -25,53 +25,209 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "rubysmb.h"
 #include "smbdir.h"
 #include "smbfile.h"
+#include "smbcache.h"
+#include "smbmetrics.h"
+#include "smbbackend.h"
+#include "smburl.h"
+
+/*
+  A whole directory listing in one arena: each entry's name and comment
+  are packed back to back in data, with its offset and type kept in
+  parallel arrays, and the base url is stored once. Listings are
+  refcounted and shared by SMB::Dir objects, their entries and the
+  listing cache; they are malloc'd so any thread may drop the last
+  reference.
+*/
+
+struct dirlisting {
+  int refs;
+  int count;
+  int cap;
+  unsigned char *types;
+  uint32_t *offsets;
+  char *data;
+  size_t len;
+  size_t size;
+  struct smburl *base;
+  char url[1];
+};
+
+#define LISTING_NAME(l, i) ((l)->data + (l)->offsets[i])
 
 struct smbdir {
   int dh;
   char *url;
-  VALUE *entries;
+  struct dirlisting *listing;
   int count;
   int pos;
+  bool closed;
 };
 
+struct ttl_override {
+  struct ttl_override *next;
+  double ttl;
+  char url[1];
+};
+
+static struct smbcache *dircache = NULL;
+static double dircache_ttl = 0;
+static bool dircache_enabled = false;
+static struct ttl_override *dircache_overrides = NULL;
+
+/* entries are just a position in a listing, made when first asked for */
 struct smbdirentry {
-  char *url;
-  char *name;
-  char *comment;
-  int type;
+  struct dirlisting *listing;
+  int index;
 };
 
-static VALUE smbdirentry_new(struct smbc_dirent*, char*);
-static VALUE smbdirentry_name(VALUE);
-static VALUE smbdirentry_comment(VALUE);
+#define ENTRY_TYPE(ent) ((ent)->listing->types[(ent)->index])
+#define ENTRY_NAME(ent) LISTING_NAME((ent)->listing, (ent)->index)
+
+static void listing_release(void*);
+static VALUE entry_new(struct dirlisting*, int);
 
 static void dir_free(struct smbdir *dir)
 {
   if (dir->dh >= 0) {
     smbc_closedir(dir->dh);
     dir->dh = -1;
+    backend_handle_closed();
+  }
+  if (dir->listing != NULL) {
+    listing_release(dir->listing);
   }
-  xfree(dir->entries);
   xfree(dir->url);
   xfree(dir);
 }
 
-static void dir_mark(struct smbdir *dir)
+static void dir_check_open(struct smbdir *dir)
 {
-  int i;
+  if (dir->closed) {
+    rb_raise(rb_eIOError, "closed directory");
+  }
+}
 
-  for (i = 0; i < dir->count; i++) {
-    rb_gc_mark(dir->entries[i]);
+static struct dirlisting *listing_new(const char *url, int cap, size_t size)
+{
+  struct dirlisting *listing = malloc(sizeof(struct dirlisting) + strlen(url));
+
+  strcpy(listing->url, url);
+  listing->base = NULL;
+  listing->refs = 1;
+  listing->count = 0;
+  listing->cap = cap;
+  listing->types = malloc(listing->cap);
+  listing->offsets = malloc(listing->cap * sizeof(uint32_t));
+  listing->len = 0;
+  listing->size = size;
+  listing->data = malloc(listing->size);
+
+  return listing;
+}
+
+static void listing_add(struct dirlisting *listing, int type, const char *name, const char *comment)
+{
+  size_t namelen = strlen(name) + 1;
+  size_t commentlen = (comment != NULL ? strlen(comment) : 0) + 1;
+
+  if (listing->count == listing->cap) {
+    listing->cap *= 2;
+    listing->types = realloc(listing->types, listing->cap);
+    listing->offsets = realloc(listing->offsets, listing->cap * sizeof(uint32_t));
+  }
+  if (listing->len + namelen + commentlen > listing->size) {
+    while (listing->len + namelen + commentlen > listing->size) {
+      listing->size *= 2;
+    }
+    listing->data = realloc(listing->data, listing->size);
   }
+  listing->types[listing->count] = (unsigned char)type;
+  listing->offsets[listing->count] = (uint32_t)listing->len;
+  memcpy(listing->data + listing->len, name, namelen);
+  listing->len += namelen;
+  memcpy(listing->data + listing->len, comment != NULL ? comment : "", commentlen);
+  listing->len += commentlen;
+  listing->count++;
 }
 
-static void dir_check_open(struct smbdir *dir)
+static void listing_release(void *p)
 {
-  if (dir->dh < 0) {
-    rb_raise(rb_eIOError, "closed directory");
+  struct dirlisting *listing = p;
+
+  if (__sync_sub_and_fetch(&listing->refs, 1) == 0) {
+    free(listing->types);
+    free(listing->offsets);
+    free(listing->data);
+    free(listing->base);
+    free(listing);
+  }
+}
+
+static void listing_ref(void *p, void *arg)
+{
+  struct dirlisting *listing = p;
+
+  __sync_add_and_fetch(&listing->refs, 1);
+  *(struct dirlisting**)arg = listing;
+}
+
+static double dircache_ttl_for(const char *url)
+{
+  struct ttl_override *o;
+  size_t best = 0;
+  double ttl = dircache_ttl;
+  size_t len;
+
+  /* overrides outlive disable_cache but don't act without it */
+  if (!dircache_enabled) {
+    return 0;
+  }
+  for (o = dircache_overrides; o != NULL; o = o->next) {
+    len = strlen(o->url);
+    if (len >= best && strncmp(url, o->url, len) == 0 &&
+	(url[len] == '\0' || url[len] == '/' || o->url[len - 1] == '/')) {
+      best = len;
+      ttl = o->ttl;
+    }
+  }
+
+  return ttl;
+}
+
+/*
+  Called by everything in the extension that changes a directory, so a
+  cached listing never outlives a change made through this library.
+*/
+
+void dircache_invalidate(const char *url)
+{
+  char *parent;
+
+  if (dircache == NULL) {
+    return;
+  }
+  cache_remove(dircache, url);
+  if ((parent = cache_parent_key(url)) != NULL) {
+    cache_remove(dircache, parent);
+    free(parent);
+  }
+}
+
+void dircache_invalidate_tree(const char *url)
+{
+  char *parent;
+
+  if (dircache == NULL) {
+    return;
+  }
+  cache_remove_prefix(dircache, url);
+  if ((parent = cache_parent_key(url)) != NULL) {
+    cache_remove(dircache, parent);
+    free(parent);
   }
 }
 
@@ -82,37 +238,60 @@ static VALUE smbdir_new(VALUE self, VALUE url)
   int dh;
   char *urlp;
   struct smbc_dirent *ent;
-  VALUE ary;
-  int cap = 10;
+  struct dirlisting *listing = NULL;
+  double ttl = 0;
+  struct metrics_server *server = NULL;
+  uint64_t start;
 
-  Check_SafeStr(url);
+  StringValue(url);
 
   urlp = StringValuePtr(url);
 
-  dh = smbc_opendir(urlp);
-  if (dh < 0) {
-    rb_sys_fail(urlp);
+  if (dircache != NULL && (ttl = dircache_ttl_for(urlp)) > 0 &&
+      cache_get(dircache, urlp, listing_ref, &listing)) {
+    dh = -1;
+  }
+  else {
+    server = metrics_server(urlp);
+    start = metrics_start();
+    dh = smbc_opendir(urlp);
+    metrics_end(server, METRIC_OPENDIR, urlp, start, dh);
+    if (dh < 0) {
+      rb_sys_fail(urlp);
+    }
   }
 
-  obj = Data_Make_Struct(cSmbDir, struct smbdir, dir_mark, dir_free, dir);
+  obj = Data_Make_Struct(cSmbDir, struct smbdir, 0, dir_free, dir);
   dir->url = ALLOC_N(char, strlen(urlp) + 1);
   strcpy(dir->url, urlp);
   dir->dh = dh;
+  if (dh >= 0) {
+    backend_handle_opened();
+  }
   dir->pos = 0;
-
-  dir->count = 0;
-  dir->entries = ALLOC_N(VALUE, cap);
-  while (ent = smbc_readdir(dir->dh)) {
-    if (dir->count == cap) {
-      cap *= 2;
-      REALLOC_N(dir->entries, VALUE, cap);
+  dir->closed = false;
+
+  if (listing == NULL) {
+    dir->listing = listing_new(dir->url, 16, 512);
+    errno = 0;
+    start = metrics_start();
+    while (ent = smbc_readdir(dir->dh)) {
+      listing_add(dir->listing, ent->smbc_type, ent->name,
+		  ent->commentlen > 0 ? ent->comment : NULL);
+    }
+    metrics_end(server, METRIC_READDIR, urlp, start, (errno != 0 ? -1 : 0));
+    if (errno != 0) {
+      rb_sys_fail(dir->url);
+    }
+    if (ttl > 0) {
+      listing_ref(dir->listing, &listing);
+      cache_put(dircache, dir->url, listing, ttl);
     }
-    dir->entries[dir->count] = smbdirentry_new(ent, dir->url);
-    dir->count++;
   }
-  if (errno != 0) {
-    rb_sys_fail(dir->url);
+  else {
+    dir->listing = listing;
   }
+  dir->count = dir->listing->count;
 
   rb_obj_call_init(obj, 1, &url);
   
@@ -164,7 +343,9 @@ static VALUE smbdir_close(VALUE self)
   if (dir->dh >= 0) {
     smbc_closedir(dir->dh);
     dir->dh = -1;
+    backend_handle_closed();
   }
+  dir->closed = true;
 
   return Qnil;
 }
@@ -180,7 +361,7 @@ static VALUE smbdir_read(VALUE self)
     return Qnil;
   }
 
-  return smbdirentry_name(dir->entries[dir->pos++]);
+  return rb_str_new2(LISTING_NAME(dir->listing, dir->pos++));
 }
 
 static VALUE smbdir_each(VALUE self)
@@ -254,7 +435,7 @@ static VALUE smbdir_entries(VALUE self, VALUE url)
   ary = rb_ary_new();
 
   for (i = 0; i < dir->count; i++) {
-    rb_ary_push(ary, smbdirentry_name(dir->entries[i]));
+    rb_ary_push(ary, rb_str_new2(LISTING_NAME(dir->listing, i)));
   }
 
   smbdir_close(d);
@@ -284,11 +465,12 @@ static VALUE smbdir_foreach(VALUE self, VALUE url)
 
 static VALUE smbdir_delete(VALUE self, VALUE url)
 {
-  Check_SafeStr(url);
+  StringValue(url);
 
   if (smbc_rmdir(RSTRING(url)->as.heap.ptr) < 0) {
     rb_sys_fail(RSTRING(url)->as.heap.ptr);
   }
+  smb_invalidate_tree(RSTRING(url)->as.heap.ptr);
 
   return INT2FIX(0);
 }
@@ -308,7 +490,7 @@ static VALUE smbdir_mkdir(int argc, VALUE *argv, VALUE self)
 
   rb_scan_args(argc, argv, "11", &url, &rmode);
   
-  Check_SafeStr(url);
+  StringValue(url);
 
   if (argc == 1) {
     mode = 0644;
@@ -320,6 +502,7 @@ static VALUE smbdir_mkdir(int argc, VALUE *argv, VALUE self)
   if (smbc_mkdir(RSTRING(url)->as.heap.ptr, (mode_t)mode) < 0) {
     rb_sys_fail(RSTRING(url)->as.heap.ptr);
   }
+  smb_invalidate(RSTRING(url)->as.heap.ptr);
 
   return INT2FIX(0);
 }
@@ -336,54 +519,95 @@ static VALUE smbdir_at(VALUE self, VALUE pos)
     return Qnil;
   }
 
-  return dir->entries[NUM2INT(pos)];
+  return entry_new(dir->listing, i);
 }
 
 static VALUE smbdir_to_a(VALUE self)
 {
   VALUE ary;
   struct smbdir *dir;
+  int i;
 
   Data_Get_Struct(self, struct smbdir, dir);
   dir_check_open(dir);
 
-  return rb_ary_new4(dir->count, dir->entries);
+  ary = rb_ary_new2(dir->count);
+  for (i = 0; i < dir->count; i++) {
+    rb_ary_push(ary, entry_new(dir->listing, i));
+  }
+
+  return ary;
 }
 
 static void free_direntry(struct smbdirentry *ent)
 {
-  xfree(ent->url);
-  xfree(ent->name);
-  if (ent->comment != NULL)
-    xfree(ent->comment);
+  listing_release(ent->listing);
   xfree(ent);
 }
 
-static VALUE smbdirentry_new(struct smbc_dirent *smbc_ent, char *baseurl)
+static VALUE entry_new(struct dirlisting *listing, int index)
 {
   VALUE obj;
   struct smbdirentry *ent;
 
   obj = Data_Make_Struct(cSmbDirEntry, struct smbdirentry, 0, free_direntry, ent);
+  __sync_add_and_fetch(&listing->refs, 1);
+  ent->listing = listing;
+  ent->index = index;
 
-  ent->url = ALLOC_N(char, smbc_ent->namelen + strlen(baseurl) + 2);
-  strcpy(ent->url, baseurl);
-  if (baseurl[strlen(baseurl) - 1] != '/') {
-    strcat(ent->url, "/");
-  }
-  strcat(ent->url, smbc_ent->name);
-  ent->name = ALLOC_N(char, smbc_ent->namelen + 1);
-  strcpy(ent->name, smbc_ent->name);
-  if (smbc_ent->commentlen > 0) {
-    ent->comment = ALLOC_N(char, smbc_ent->commentlen + 1);
-    strcpy(ent->comment, smbc_ent->comment);
+  return obj;
+}
+
+/*
+  An entry that doesn't come from an SMB::Dir, e.g. one found by
+  SMB::Dir.walk. It gets a listing of its own.
+*/
+
+VALUE direntry_new(const char *baseurl, const char *name, const char *comment, int type)
+{
+  struct dirlisting *listing;
+  VALUE obj;
+
+  listing = listing_new(baseurl, 1, strlen(name) + (comment != NULL ? strlen(comment) : 0) + 2);
+  listing_add(listing, type, name, comment);
+  obj = entry_new(listing, 0);
+  listing_release(listing);
+
+  return obj;
+}
+
+static VALUE entry_url(struct smbdirentry *ent)
+{
+  const char *base = ent->listing->url;
+  size_t baselen = strlen(base);
+  VALUE url = rb_str_new(base, baselen);
+
+  if (baselen == 0 || base[baselen - 1] != '/') {
+    rb_str_cat(url, "/", 1);
   }
-  else {
-    ent->comment = NULL;
+  rb_str_cat2(url, ENTRY_NAME(ent));
+
+  return url;
+}
+
+/*
+  SMB::Dir::Entry#smb_url -> SMB::URL
+
+  Built straight from the listing, so a walk can hand out urls that
+  share their server and share names without a String per entry. The
+  directory's url is parsed once, for the first entry asked.
+*/
+
+static VALUE smbdirentry_smb_url(VALUE self)
+{
+  struct smbdirentry *ent;
+
+  Data_Get_Struct(self, struct smbdirentry, ent);
+  if (ent->listing->base == NULL) {
+    ent->listing->base = url_base_new(ent->listing->url);
   }
-  ent->type = smbc_ent->smbc_type;
 
-  return obj;
+  return url_new_join(ent->listing->base, ENTRY_NAME(ent));
 }
 
 static VALUE smbdirentry_name(VALUE self)
@@ -392,20 +616,23 @@ static VALUE smbdirentry_name(VALUE self)
 
   Data_Get_Struct(self, struct smbdirentry, ent);
 
-  return rb_str_new2(ent->name);
+  return rb_str_new2(ENTRY_NAME(ent));
 }
 
 static VALUE smbdirentry_comment(VALUE self)
 {
   struct smbdirentry *ent;
+  const char *comment;
 
   Data_Get_Struct(self, struct smbdirentry, ent);
 
-  if (ent->comment == NULL) {
+  comment = ENTRY_NAME(ent);
+  comment += strlen(comment) + 1;
+  if (*comment == '\0') {
     return Qnil;
   }
 
-  return rb_str_new2(ent->comment);
+  return rb_str_new2(comment);
 }
 
 static VALUE smbdirentry_smb_type(VALUE self)
@@ -414,7 +641,7 @@ static VALUE smbdirentry_smb_type(VALUE self)
 
   Data_Get_Struct(self, struct smbdirentry, ent);
 
-  return INT2FIX(ent->type);
+  return INT2FIX(ENTRY_TYPE(ent));
 }
 
 static VALUE smbdirentry_open(VALUE self)
@@ -423,15 +650,15 @@ static VALUE smbdirentry_open(VALUE self)
 
   Data_Get_Struct(self, struct smbdirentry, ent);
 
-  if (ent->type == SMBC_FILE) {
-    VALUE url = rb_str_new2(ent->url);
+  if (ENTRY_TYPE(ent) == SMBC_FILE) {
+    VALUE url = entry_url(ent);
     return smbfile_open(1, &url, cSmbFile);
   }
-  else if (ent->type == SMBC_DIR ||
-	   ent->type == SMBC_FILE_SHARE ||
-	   ent->type == SMBC_SERVER ||
-	   ent->type == SMBC_WORKGROUP) {
-    VALUE url = rb_str_new2(ent->url);
+  else if (ENTRY_TYPE(ent) == SMBC_DIR ||
+	   ENTRY_TYPE(ent) == SMBC_FILE_SHARE ||
+	   ENTRY_TYPE(ent) == SMBC_SERVER ||
+	   ENTRY_TYPE(ent) == SMBC_WORKGROUP) {
+    VALUE url = entry_url(ent);
     return smbdir_open(cSmbDir, url);
   }
   else {
@@ -447,7 +674,7 @@ static VALUE smbdirentry_url(VALUE self)
 
   Data_Get_Struct(self, struct smbdirentry, ent);
 
-  return rb_str_new2(ent->url);
+  return entry_url(ent);
 }
 
 static VALUE smbdirentry_workgroup_p(VALUE self)
@@ -456,7 +683,7 @@ static VALUE smbdirentry_workgroup_p(VALUE self)
 
   Data_Get_Struct(self, struct smbdirentry, ent);
 
-  return (ent->type == SMBC_WORKGROUP ? Qtrue : Qfalse);
+  return (ENTRY_TYPE(ent) == SMBC_WORKGROUP ? Qtrue : Qfalse);
 }
 
 static VALUE smbdirentry_server_p(VALUE self)
@@ -465,7 +692,7 @@ static VALUE smbdirentry_server_p(VALUE self)
 
   Data_Get_Struct(self, struct smbdirentry, ent);
 
-  return (ent->type == SMBC_SERVER ? Qtrue : Qfalse);
+  return (ENTRY_TYPE(ent) == SMBC_SERVER ? Qtrue : Qfalse);
 }
 
 static VALUE smbdirentry_file_share_p(VALUE self)
@@ -474,7 +701,7 @@ static VALUE smbdirentry_file_share_p(VALUE self)
 
   Data_Get_Struct(self, struct smbdirentry, ent);
 
-  return (ent->type == SMBC_FILE_SHARE ? Qtrue : Qfalse);
+  return (ENTRY_TYPE(ent) == SMBC_FILE_SHARE ? Qtrue : Qfalse);
 }
 
 static VALUE smbdirentry_printer_share_p(VALUE self)
@@ -483,7 +710,7 @@ static VALUE smbdirentry_printer_share_p(VALUE self)
 
   Data_Get_Struct(self, struct smbdirentry, ent);
 
-  return (ent->type == SMBC_PRINTER_SHARE ? Qtrue : Qfalse);
+  return (ENTRY_TYPE(ent) == SMBC_PRINTER_SHARE ? Qtrue : Qfalse);
 }
 
 static VALUE smbdirentry_comms_share_p(VALUE self)
@@ -492,7 +719,7 @@ static VALUE smbdirentry_comms_share_p(VALUE self)
 
   Data_Get_Struct(self, struct smbdirentry, ent);
 
-  return (ent->type == SMBC_COMMS_SHARE ? Qtrue : Qfalse);
+  return (ENTRY_TYPE(ent) == SMBC_COMMS_SHARE ? Qtrue : Qfalse);
 }
 
 static VALUE smbdirentry_ipc_share_p(VALUE self)
@@ -501,7 +728,7 @@ static VALUE smbdirentry_ipc_share_p(VALUE self)
 
   Data_Get_Struct(self, struct smbdirentry, ent);
 
-  return (ent->type == SMBC_IPC_SHARE ? Qtrue : Qfalse);
+  return (ENTRY_TYPE(ent) == SMBC_IPC_SHARE ? Qtrue : Qfalse);
 }
 
 static VALUE smbdirentry_dir_p(VALUE self)
@@ -510,7 +737,7 @@ static VALUE smbdirentry_dir_p(VALUE self)
 
   Data_Get_Struct(self, struct smbdirentry, ent);
 
-  return (ent->type == SMBC_DIR ? Qtrue : Qfalse);
+  return (ENTRY_TYPE(ent) == SMBC_DIR ? Qtrue : Qfalse);
 }
 
 static VALUE smbdirentry_file_p(VALUE self)
@@ -519,7 +746,7 @@ static VALUE smbdirentry_file_p(VALUE self)
 
   Data_Get_Struct(self, struct smbdirentry, ent);
 
-  return (ent->type == SMBC_FILE ? Qtrue : Qfalse);
+  return (ENTRY_TYPE(ent) == SMBC_FILE ? Qtrue : Qfalse);
 }
 
 static VALUE smbdirentry_link_p(VALUE self)
@@ -528,7 +755,99 @@ static VALUE smbdirentry_link_p(VALUE self)
 
   Data_Get_Struct(self, struct smbdirentry, ent);
 
-  return (ent->type == SMBC_LINK ? Qtrue : Qfalse);
+  return (ENTRY_TYPE(ent) == SMBC_LINK ? Qtrue : Qfalse);
+}
+
+/*
+  SMB::Dir.enable_cache(ttl, max_entries = 256)
+
+  Listings made through SMB::Dir.new, open, entries and foreach are kept
+  for ttl seconds, up to max_entries directories.
+*/
+
+static VALUE smbdir_s_enable_cache(int argc, VALUE *argv, VALUE self)
+{
+  VALUE ttl;
+  VALUE max;
+  long n;
+
+  rb_scan_args(argc, argv, "11", &ttl, &max);
+
+  n = NIL_P(max) ? 256 : NUM2LONG(max);
+  if (n < 1) {
+    rb_raise(rb_eArgError, "cache must hold at least one directory");
+  }
+  dircache_ttl = NUM2DBL(ttl);
+  dircache_enabled = true;
+  if (dircache == NULL) {
+    dircache = cache_new((size_t)n, listing_release);
+  }
+  else {
+    cache_set_max(dircache, (size_t)n);
+  }
+
+  return Qnil;
+}
+
+static VALUE smbdir_s_disable_cache(VALUE self)
+{
+  if (dircache != NULL) {
+    cache_clear(dircache);
+  }
+  dircache_ttl = 0;
+  dircache_enabled = false;
+
+  return Qnil;
+}
+
+static VALUE smbdir_s_clear_cache(VALUE self)
+{
+  if (dircache != NULL) {
+    cache_clear(dircache);
+  }
+
+  return Qnil;
+}
+
+/*
+  SMB::Dir.cache_ttl(url, ttl)
+
+  Overrides the cache ttl for url and the directories below it. A ttl of
+  0 keeps them out of the cache.
+*/
+
+static VALUE smbdir_s_cache_ttl(VALUE self, VALUE url, VALUE ttl)
+{
+  struct ttl_override *o;
+  char *key;
+
+  StringValue(url);
+  key = cache_key(StringValuePtr(url));
+
+  for (o = dircache_overrides; o != NULL; o = o->next) {
+    if (strcmp(o->url, key) == 0) {
+      break;
+    }
+  }
+  if (o == NULL) {
+    o = malloc(sizeof(struct ttl_override) + strlen(key));
+    strcpy(o->url, key);
+    o->next = dircache_overrides;
+    dircache_overrides = o;
+  }
+  o->ttl = NUM2DBL(ttl);
+  free(key);
+
+  if (dircache != NULL) {
+    cache_remove_prefix(dircache, StringValuePtr(url));
+  }
+
+  return ttl;
+}
+
+static VALUE smbdir_s_cache_size(VALUE self)
+{
+  return LONG2NUM(dircache != NULL ? (long)cache_count(dircache) : 0);
 }
 
 void init_smbdir(void)
@@ -553,6 +872,11 @@ void init_smbdir(void)
   rb_define_singleton_method(cSmbDir, "mkdir", smbdir_mkdir, -1);
   rb_define_singleton_method(cSmbDir, "unlink", smbdir_unlink, 1);
   rb_define_singleton_method(cSmbDir, "rmdir", smbdir_unlink, 1);
+  rb_define_singleton_method(cSmbDir, "enable_cache", smbdir_s_enable_cache, -1);
+  rb_define_singleton_method(cSmbDir, "disable_cache", smbdir_s_disable_cache, 0);
+  rb_define_singleton_method(cSmbDir, "clear_cache", smbdir_s_clear_cache, 0);
+  rb_define_singleton_method(cSmbDir, "cache_ttl", smbdir_s_cache_ttl, 2);
+  rb_define_singleton_method(cSmbDir, "cache_size", smbdir_s_cache_size, 0);
   rb_define_method(cSmbDir, "[]", smbdir_at, 1);
   rb_define_method(cSmbDir, "to_a", smbdir_to_a, 0);
   rb_define_alias(cSmbDir, "direntries", "to_a");
@@ -564,6 +888,7 @@ void init_smbdir(void)
   rb_define_method(cSmbDirEntry, "comment", smbdirentry_comment, 0);
   rb_define_method(cSmbDirEntry, "smb_type", smbdirentry_smb_type, 0);
   rb_define_method(cSmbDirEntry, "url", smbdirentry_url, 0);
+  rb_define_method(cSmbDirEntry, "smb_url", smbdirentry_smb_url, 0);
   rb_define_method(cSmbDirEntry, "workgroup?", smbdirentry_workgroup_p, 0);
   rb_define_method(cSmbDirEntry, "server?", smbdirentry_server_p, 0);
   rb_define_method(cSmbDirEntry, "file_share?", smbdirentry_file_share_p, 0);
@@ -20,7 +20,13 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #ifndef RUBYSMB_SMBDIR_H
 #define RUBYSMB_SMBDIR_H
 
+/* entry types a recursive walk descends into */
+#define SMBC_CONTAINER_P(t) ((t) == SMBC_DIR || (t) == SMBC_FILE_SHARE)
+
 void init_smbdir(void);
 VALUE smbdir_open(VALUE, VALUE);
+VALUE direntry_new(const char*, const char*, const char*, int);
+void dircache_invalidate(const char*);
+void dircache_invalidate_tree(const char*);
 
 #endif
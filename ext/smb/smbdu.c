@@ -0,0 +1,454 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include <libsmbclient.h>
+#include <ruby.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "rubysmb.h"
+#include "smbctx.h"
+#include "smbdu.h"
+#include "smbpool.h"
+#include "smbutil.h"
+
+/*
+  SMB::Dir.du sums a tree entirely on the worker pool. Every directory
+  down to the reporting depth gets a node; anything deeper is added to its
+  nearest reported ancestor, so the totals cost no Ruby objects per entry.
+  Only listing errors come back through the result queue.
+*/
+
+struct du_node {
+  struct du_node *parent;
+  uint64_t bytes;
+  uint64_t files;
+  uint64_t dirs;
+  char url[1];
+};
+
+struct du_task {
+  struct pool_item item;
+  struct du_node *node;
+  int depth;
+  bool in_share;
+  char url[1];
+};
+
+struct du_error {
+  struct pool_item item;
+  int err;
+  char url[1];
+};
+
+struct du_file {
+  uint64_t size;
+  char *url;
+};
+
+struct du_state {
+  struct smbpool *pool;
+  struct du_error *current;
+  pthread_mutex_t lock;
+  struct du_node **nodes;
+  long nnodes;
+  long nodecap;
+  struct du_file *top;
+  long ntop;
+  long max_top;
+  int max_depth;
+  int nthreads;
+  bool in_share;
+  VALUE errors;
+};
+
+static struct du_node *du_node_new(struct du_state *state, const char *url, struct du_node *parent)
+{
+  struct du_node *node;
+
+  node = malloc(sizeof(struct du_node) + strlen(url));
+  node->parent = parent;
+  node->bytes = 0;
+  node->files = 0;
+  node->dirs = 0;
+  strcpy(node->url, url);
+
+  pthread_mutex_lock(&state->lock);
+  if (state->nnodes == state->nodecap) {
+    state->nodecap = (state->nodecap == 0 ? 64 : state->nodecap * 2);
+    state->nodes = realloc(state->nodes, state->nodecap * sizeof(struct du_node*));
+  }
+  state->nodes[state->nnodes++] = node;
+  pthread_mutex_unlock(&state->lock);
+
+  return node;
+}
+
+static void du_push(struct smbpool *pool, struct du_node *node, const char *url,
+		    int depth, bool in_share)
+{
+  struct du_task *task;
+
+  task = malloc(sizeof(struct du_task) + strlen(url));
+  task->node = node;
+  task->depth = depth;
+  task->in_share = in_share;
+  strcpy(task->url, url);
+  pool_push(pool, &task->item);
+}
+
+/* top is a min-heap on size, so the smallest of the N largest is at 0 */
+
+static void top_sift_down(struct du_file *top, long n, long i)
+{
+  struct du_file tmp;
+  long child;
+
+  while ((child = 2 * i + 1) < n) {
+    if (child + 1 < n && top[child + 1].size < top[child].size) {
+      child++;
+    }
+    if (top[i].size <= top[child].size) {
+      break;
+    }
+    tmp = top[i];
+    top[i] = top[child];
+    top[child] = tmp;
+    i = child;
+  }
+}
+
+static void top_add(struct du_state *state, const char *dir, const char *name, uint64_t size)
+{
+  struct du_file tmp;
+  long i;
+
+  pthread_mutex_lock(&state->lock);
+  if (state->ntop < state->max_top) {
+    i = state->ntop++;
+    state->top[i].size = size;
+    state->top[i].url = ctx_url_join(dir, name);
+    while (i > 0 && state->top[(i - 1) / 2].size > state->top[i].size) {
+      tmp = state->top[i];
+      state->top[i] = state->top[(i - 1) / 2];
+      state->top[(i - 1) / 2] = tmp;
+      i = (i - 1) / 2;
+    }
+  }
+  else if (size > state->top[0].size) {
+    free(state->top[0].url);
+    state->top[0].size = size;
+    state->top[0].url = ctx_url_join(dir, name);
+    top_sift_down(state->top, state->ntop, 0);
+  }
+  pthread_mutex_unlock(&state->lock);
+}
+
+static void du_dir(struct smbpool *pool, struct du_state *state, struct du_task *task,
+		   const char *name, bool share)
+{
+  struct du_node *node = task->node;
+  char *url;
+
+  url = ctx_url_join(task->url, name);
+  if (task->depth < state->max_depth) {
+    node = du_node_new(state, url, task->node);
+  }
+  du_push(pool, node, url, task->depth + 1, task->in_share || share);
+  free(url);
+}
+
+static void du_list(struct smbpool *pool, SMBCCTX *ctx, struct pool_item *item)
+{
+  struct du_task *task = (struct du_task*)item;
+  struct du_state *state = pool->data;
+  struct du_error *e;
+  struct smbc_dirent *ent;
+  struct stat st;
+  SMBCFILE *dh;
+  uint64_t bytes = 0;
+  uint64_t files = 0;
+  uint64_t dirs = 0;
+  char *url;
+
+  if ((dh = smbc_getFunctionOpendir(ctx)(ctx, task->url)) == NULL) {
+    e = malloc(sizeof(struct du_error) + strlen(task->url));
+    e->err = errno;
+    strcpy(e->url, task->url);
+    pool_emit(pool, &e->item);
+    free(task);
+    return;
+  }
+
+#ifdef HAVE_SMBC_READDIRPLUS2
+  if (task->in_share) {
+    const struct libsmb_file_info *info;
+
+    while ((info = smbc_getFunctionReaddirPlus2(ctx)(ctx, dh, &st)) != NULL &&
+	   !pool_stopping(pool)) {
+      if (strcmp(info->name, ".") == 0 || strcmp(info->name, "..") == 0) {
+	continue;
+      }
+      if (S_ISDIR(st.st_mode)) {
+	du_dir(pool, state, task, info->name, false);
+	dirs++;
+	continue;
+      }
+      bytes += st.st_size;
+      files++;
+      if (state->max_top > 0) {
+	top_add(state, task->url, info->name, st.st_size);
+      }
+    }
+    goto done;
+  }
+#endif
+
+  while ((ent = smbc_getFunctionReaddir(ctx)(ctx, dh)) != NULL && !pool_stopping(pool)) {
+    if (strcmp(ent->name, ".") == 0 || strcmp(ent->name, "..") == 0) {
+      continue;
+    }
+    switch (ent->smbc_type) {
+    case SMBC_DIR:
+    case SMBC_FILE_SHARE:
+      du_dir(pool, state, task, ent->name, ent->smbc_type == SMBC_FILE_SHARE);
+      dirs++;
+      break;
+    case SMBC_FILE:
+    case SMBC_LINK:
+      url = ctx_url_join(task->url, ent->name);
+      if (smbc_getFunctionStat(ctx)(ctx, url, &st) == 0) {
+	bytes += st.st_size;
+	files++;
+	if (state->max_top > 0) {
+	  top_add(state, task->url, ent->name, st.st_size);
+	}
+      }
+      free(url);
+      break;
+    }
+  }
+
+#ifdef HAVE_SMBC_READDIRPLUS2
+ done:
+#endif
+  smbc_getFunctionClosedir(ctx)(ctx, dh);
+  __sync_fetch_and_add(&task->node->bytes, bytes);
+  __sync_fetch_and_add(&task->node->files, files);
+  __sync_fetch_and_add(&task->node->dirs, dirs);
+  free(task);
+}
+
+static VALUE du_run(VALUE arg)
+{
+  struct du_state *state = (struct du_state*)arg;
+  struct du_error *e;
+
+  while ((e = (struct du_error*)pool_next(state->pool)) != NULL) {
+    state->current = e;
+    rb_ary_push(state->errors, rb_ary_new3(2, rb_str_new2(e->url),
+					   rb_syserr_new(e->err, e->url)));
+    state->current = NULL;
+    free(e);
+  }
+
+  return Qnil;
+}
+
+static VALUE du_cleanup(VALUE arg)
+{
+  struct du_state *state = (struct du_state*)arg;
+
+  free(state->current);
+  state->current = NULL;
+  pool_free(state->pool);
+  state->pool = NULL;
+
+  return Qnil;
+}
+
+static int du_node_cmp(const void *a, const void *b)
+{
+  return strcmp((*(struct du_node* const*)a)->url, (*(struct du_node* const*)b)->url);
+}
+
+static int du_file_cmp(const void *a, const void *b)
+{
+  const struct du_file *fa = a;
+  const struct du_file *fb = b;
+
+  return (fa->size < fb->size) - (fa->size > fb->size);
+}
+
+static VALUE du_summary(struct du_node *node)
+{
+  VALUE hash = rb_hash_new();
+
+  rb_hash_aset(hash, ID2SYM(rb_intern("bytes")), ULL2NUM(node->bytes));
+  rb_hash_aset(hash, ID2SYM(rb_intern("files")), ULL2NUM(node->files));
+  rb_hash_aset(hash, ID2SYM(rb_intern("directories")), ULL2NUM(node->dirs));
+
+  return hash;
+}
+
+static VALUE du_result(struct du_state *state)
+{
+  VALUE result;
+  VALUE dirs;
+  VALUE top;
+  long i;
+
+  /* children always come after their parent, so one backwards pass totals the tree */
+  for (i = state->nnodes - 1; i > 0; i--) {
+    state->nodes[i]->parent->bytes += state->nodes[i]->bytes;
+    state->nodes[i]->parent->files += state->nodes[i]->files;
+    state->nodes[i]->parent->dirs += state->nodes[i]->dirs;
+  }
+
+  result = du_summary(state->nodes[0]);
+  qsort(state->nodes, state->nnodes, sizeof(struct du_node*), du_node_cmp);
+  dirs = rb_hash_new();
+  for (i = 0; i < state->nnodes; i++) {
+    rb_hash_aset(dirs, rb_str_new2(state->nodes[i]->url), du_summary(state->nodes[i]));
+  }
+  rb_hash_aset(result, ID2SYM(rb_intern("dirs")), dirs);
+
+  if (state->max_top > 0) {
+    qsort(state->top, state->ntop, sizeof(struct du_file), du_file_cmp);
+    top = rb_ary_new2(state->ntop);
+    for (i = 0; i < state->ntop; i++) {
+      rb_ary_push(top, rb_ary_new3(2, rb_str_new2(state->top[i].url),
+				   ULL2NUM(state->top[i].size)));
+    }
+    rb_hash_aset(result, ID2SYM(rb_intern("top")), top);
+  }
+  rb_hash_aset(result, ID2SYM(rb_intern("errors")), state->errors);
+
+  return result;
+}
+
+static VALUE du_free(VALUE arg)
+{
+  struct du_state *state = (struct du_state*)arg;
+  long i;
+
+  for (i = 0; i < state->nnodes; i++) {
+    free(state->nodes[i]);
+  }
+  free(state->nodes);
+  for (i = 0; i < state->ntop; i++) {
+    free(state->top[i].url);
+  }
+  free(state->top);
+  pthread_mutex_destroy(&state->lock);
+
+  return Qnil;
+}
+
+static VALUE du_body(VALUE arg)
+{
+  struct du_state *state = (struct du_state*)arg;
+
+  state->pool = pool_new(state->nthreads, du_list, state);
+  du_push(state->pool, state->nodes[0], state->nodes[0]->url, 0, state->in_share);
+  rb_ensure(du_run, arg, du_cleanup, arg);
+
+  return du_result(state);
+}
+
+/*
+  SMB::Dir.du(url, opts = {}) -> hash
+
+  Returns { :bytes, :files, :directories, :dirs, :errors } for everything
+  below url. :dirs maps each directory down to :depth levels (default 1)
+  to its own totals. With :top => n, :top lists the n largest files as
+  [url, size] pairs, largest first. Directories that can't be listed are
+  reported in :errors and left out of the totals. Also takes :threads.
+*/
+
+static VALUE smbdir_s_du(int argc, VALUE *argv, VALUE self)
+{
+  VALUE url;
+  VALUE opts;
+  VALUE v;
+  struct du_state state;
+  int server_i, server_len;
+  int share_i, share_len;
+  int path_i, path_len;
+  int username_i, username_len;
+  int password_i, password_len;
+  int nthreads;
+  int dh;
+  char *urlp;
+
+  rb_scan_args(argc, argv, "11", &url, &opts);
+
+  StringValue(url);
+  urlp = StringValuePtr(url);
+
+  if (!util_parse_url(urlp,
+		      &server_i, &server_len,
+		      &share_i, &share_len,
+		      &path_i, &path_len,
+		      &username_i, &username_len,
+		      &password_i, &password_len)) {
+    rb_raise(eSmbError, "invalid url");
+  }
+
+  memset(&state, 0, sizeof(state));
+  nthreads = pool_threads_opt(opts);
+  state.max_depth = NIL_P(v = util_opt(opts, "depth")) ? 1 : NUM2INT(v);
+  state.max_top = NIL_P(v = util_opt(opts, "top")) ? 0 : NUM2LONG(v);
+  if (state.max_depth < 0) {
+    rb_raise(rb_eArgError, "negative depth");
+  }
+  if (state.max_top < 0) {
+    rb_raise(rb_eArgError, "negative top");
+  }
+
+  /* as in SMB::Dir.walk, the root goes through the global context for auth */
+  if ((dh = smbc_opendir(urlp)) < 0) {
+    rb_sys_fail(urlp);
+  }
+  smbc_closedir(dh);
+
+  if (state.max_top > 0) {
+    state.top = malloc(state.max_top * sizeof(struct du_file));
+    if (state.top == NULL) {
+      rb_raise(rb_eNoMemError, "top %ld is too large", state.max_top);
+    }
+  }
+  pthread_mutex_init(&state.lock, NULL);
+  state.errors = rb_ary_new();
+  state.nthreads = nthreads;
+  state.in_share = (share_i != 0);
+  du_node_new(&state, urlp, NULL);
+
+  return rb_ensure(du_body, (VALUE)&state, du_free, (VALUE)&state);
+}
+
+void init_smbdu(void)
+{
+  rb_define_singleton_method(cSmbDir, "du", smbdir_s_du, -1);
+}
@@ -28,6 +28,13 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <sys/stat.h>
 #include "rubysmb.h"
 #include "smbfile.h"
+#include "smbdir.h"
+#include "smbstat.h"
+#include "smbutil.h"
+#include "smbmetrics.h"
+#include "smbdecomp.h"
+#include "smbbufpool.h"
+#include "smbbackend.h"
 
 #define BUFSIZE 4096
 
@@ -35,7 +42,9 @@ struct smbfile {
   int fh;
   int flags;
   char *url;
+  /* taken from the buffer pool on the first read, given back on close */
   char *buf;
+  size_t bufcap;
   int bufsize;
   int read;
   int bufpos;
@@ -45,8 +54,25 @@ struct smbfile {
   int pos;
   int lineno;
   int references;
+  struct metrics_server *server;
+  /* set when opened with :decompress; buf then holds decompressed bytes */
+  struct decomp *decomp;
+  off_t raw_pos;
 };
 
+/* read buffer size for newly opened files, set by SMB.configure(:io_size) */
+static int default_bufsize = BUFSIZE;
+
+void file_set_bufsize(int size)
+{
+  default_bufsize = size;
+}
+
+int file_get_bufsize(void)
+{
+  return default_bufsize;
+}
+
 static int mode_flags(const char *mode)
 {
   int flags = 0;
@@ -84,7 +110,11 @@ static void file_free(struct smbfile *file)
     return;
   }
   smbc_close(file->fh);
-  free(file->buf);
+  if (!file->closed) {
+    backend_handle_closed();
+  }
+  decomp_free(file->decomp);
+  bufpool_put(file->buf, file->bufcap);
   free(file->url);
   free(file);
 }
@@ -93,18 +123,25 @@ static VALUE file_open(char *url, int flags) {
   VALUE obj;
   struct smbfile *file;
   int fh;
+  struct metrics_server *server = metrics_server(url);
+  uint64_t start = metrics_start();
 
   fh = smbc_open(url, flags, 0);
+  metrics_end(server, METRIC_OPEN, url, start, (fh < 0 ? -1 : 0));
 
   if (fh < 0) {
     rb_sys_fail(url);
   }
+  if (flags & (O_CREAT | O_TRUNC)) {
+    smb_invalidate(url);
+  }
 
   obj = Data_Make_Struct(cSmbFile, struct smbfile, 0, file_free, file);
+  backend_handle_opened();
   file->fh = fh;
   file->flags = flags;
   file->url = ALLOC_N(char, strlen(url) + 1);
-  file->bufsize = BUFSIZE;
+  file->bufsize = default_bufsize;
   file->bufpos = 0;
   file->read = 0;
   file->closed = false;
@@ -112,30 +149,53 @@ static VALUE file_open(char *url, int flags) {
   file->sync = true;
   file->pos = 0;
   file->lineno = 0;
-  file->buf = ALLOC_N(char, file->bufsize);
+  file->buf = NULL;
+  file->bufcap = 0;
   file->references = 0;
+  file->server = server;
+  file->decomp = NULL;
+  file->raw_pos = 0;
   strcpy(file->url, url);
 
   return obj;
 }
 
+static off_t file_lseek(struct smbfile *file, off_t offset, int whence)
+{
+  uint64_t start = metrics_start();
+  off_t pos;
+
+  pos = smbc_lseek(file->fh, offset, whence);
+  metrics_end(file->server, METRIC_LSEEK, file->url, start, (pos < 0 ? -1 : 0));
+
+  return pos;
+}
+
 static void file_reopen(struct smbfile *file)
 {
+  uint64_t start = metrics_start();
+
   smbc_close(file->fh);
-  if ((file->fh = smbc_open(file->url, file->flags, 0)) < 0) {
+  file->fh = smbc_open(file->url, file->flags, 0);
+  metrics_end(file->server, METRIC_REOPEN, file->url, start, (file->fh < 0 ? -1 : 0));
+  if (file->fh < 0) {
     rb_sys_fail(file->url);
   }
-  if (smbc_lseek(file->fh, file->pos + file->read, SEEK_SET) < 0) {
+  if (file_lseek(file, (file->decomp != NULL ? file->raw_pos : file->pos + file->read), SEEK_SET) < 0) {
     rb_sys_fail(file->url);
   }
 }
 
-static size_t file_read(struct smbfile *file)
+static ssize_t file_read_raw(void *arg, char *buf, size_t len)
 {
-  int read;
+  struct smbfile *file = (struct smbfile*)arg;
+  ssize_t read;
+  uint64_t start;
 
  try:
-  read = smbc_read(file->fh, file->buf, file->bufsize);
+  start = metrics_start();
+  read = smbc_read(file->fh, buf, len);
+  metrics_end(file->server, METRIC_READ, file->url, start, read);
   if (read < 0) {
     if (errno != EBADF) {
       rb_sys_fail(file->url);
@@ -145,6 +205,34 @@ static size_t file_read(struct smbfile *file)
       goto try;
     }
   }
+  file->raw_pos += read;
+
+  return read;
+}
+
+static void file_buffer(struct smbfile *file)
+{
+  if (file->buf == NULL) {
+    file->buf = bufpool_get(file->bufsize, &file->bufcap);
+  }
+}
+
+/* refills the buffer; every refill counts as a buffer miss */
+static size_t file_read(struct smbfile *file)
+{
+  ssize_t read;
+
+  metrics_buffer(file->server, false);
+  file_buffer(file);
+  if (file->decomp == NULL) {
+    read = file_read_raw(file, file->buf, file->bufsize);
+  }
+  else if ((read = decomp_read(file->decomp, file->buf, file->bufsize, file_read_raw, file)) < 0) {
+    if (errno == EILSEQ) {
+      rb_raise(eSmbError, "corrupt or truncated compressed data in %s", file->url);
+    }
+    rb_sys_fail(file->url);
+  }
 
   file->read = read;
   file->eof = (read == 0);
@@ -174,17 +262,31 @@ static bool file_check_readable(struct smbfile *file)
   return true;
 }
 
+/*
+  SMB::File.new(url, mode = "r", opts = {})
+
+  :decompress => :auto reads gzip and zstd files as their decompressed
+  contents, telling them apart by their magic and passing other files
+  through; :gzip or :zstd insist on one format.
+*/
+
 static VALUE smbfile_new(int argc, VALUE *argv, VALUE self)
 {
-  VALUE rurl, vmode;
+  VALUE rurl, vmode, opts;
   char *url;
   int flags;
   char *mode;
   VALUE obj;
+  struct smbfile *file;
+  enum decomp_kind decomp;
 
-  rb_scan_args(argc, argv, "11", &rurl, &vmode);
+  rb_scan_args(argc, argv, "12", &rurl, &vmode, &opts);
+  if (TYPE(vmode) == T_HASH && NIL_P(opts)) {
+    opts = vmode;
+    vmode = Qnil;
+  }
 
-  Check_SafeStr(rurl);
+  StringValue(rurl);
 
   url = StringValuePtr(rurl);
   if (FIXNUM_P(vmode))
@@ -196,8 +298,16 @@ static VALUE smbfile_new(int argc, VALUE *argv, VALUE self)
       mode = NIL_P(vmode) ? "r" : StringValuePtr(vmode);
       flags = mode_flags(mode);
     }
+  decomp = decomp_kind_opt(util_opt(opts, "decompress"));
+  if (decomp != DECOMP_NONE && (flags & O_ACCMODE) != O_RDONLY) {
+    rb_raise(rb_eArgError, "decompression needs a file opened for reading only");
+  }
   
   obj = file_open(url, flags);
+  if (decomp != DECOMP_NONE) {
+    Data_Get_Struct(obj, struct smbfile, file);
+    file->decomp = decomp_new(decomp, file->bufsize);
+  }
   rb_obj_call_init(obj, argc, argv);
 
   return obj;
@@ -252,6 +362,9 @@ static VALUE smbfile_getc(VALUE self)
       return Qnil;
     }
   }
+  else {
+    metrics_buffer(file->server, true);
+  }
 
   return CHR2FIX(file->buf[file->bufpos++]);
 }
@@ -260,20 +373,25 @@ static VALUE smbfile_putc(VALUE self, VALUE obj)
 {
   struct smbfile *file;
   int c;
-  size_t wrote;
+  ssize_t wrote;
+  uint64_t start;
 
   Data_Get_Struct(self, struct smbfile, file);
 
   file_check_writable(file);
 
   c = NUM2CHR(obj);
-  smbc_lseek(file->fh, -(file->read - file->bufpos), SEEK_CUR);
+  file_lseek(file, -(file->read - file->bufpos), SEEK_CUR);
+  start = metrics_start();
   wrote = smbc_write(file->fh, &c, (size_t)1);
-  smbc_lseek(file->fh, file->read - file->bufpos, SEEK_CUR);
+  metrics_end(file->server, METRIC_WRITE, file->url, start, wrote);
+  statcache_invalidate(file->url);
+  file_lseek(file, file->read - file->bufpos, SEEK_CUR);
   if (wrote < 0) {
     rb_sys_fail(file->url);
   }
   if (file->bufpos == file->read && file->bufpos < file->bufsize) {
+    file_buffer(file);
     file->buf[file->bufpos++] = c;
     file->read++;
   }
@@ -321,6 +439,9 @@ static VALUE smbfile_gets(int argc, VALUE *argv, VALUE self)
     }
   }
   
+  if (file->bufpos < file->read) {
+    metrics_buffer(file->server, true);
+  }
   line = rb_str_new2("");
   while (true) {
     if (file->bufpos == file->read) {
@@ -368,7 +489,8 @@ static VALUE smbfile_gets(int argc, VALUE *argv, VALUE self)
 static VALUE smbfile_write(VALUE self, VALUE str)
 {
   struct smbfile *file;
-  size_t wrote;
+  ssize_t wrote;
+  uint64_t start;
 
   Data_Get_Struct(self, struct smbfile, file);
 
@@ -379,18 +501,23 @@ static VALUE smbfile_write(VALUE self, VALUE str)
     str = rb_obj_as_string(str);
   if (RSTRING(str)->as.heap.len == 0) return INT2FIX(0);
 
-  if (smbc_lseek(file->fh, file->pos + file->bufpos, SEEK_SET) < 0) {
+  if (file_lseek(file, file->pos + file->bufpos, SEEK_SET) < 0) {
     rb_sys_fail(file->url);
   }
  try:
-  if (wrote = smbc_write(file->fh, RSTRING(str)->as.heap.ptr, RSTRING(str)->as.heap.len) < 0) {
+  start = metrics_start();
+  wrote = smbc_write(file->fh, RSTRING(str)->as.heap.ptr, RSTRING(str)->as.heap.len);
+  metrics_end(file->server, METRIC_WRITE, file->url, start, wrote);
+  if (wrote < 0) {
     if (errno == EBADF) {
-      reopen(file);
+      file_reopen(file);
       goto try;
     }
     rb_sys_fail(file->url);
   }
 
+  statcache_invalidate(file->url);
+
   if (wrote == 0) /* can't trust libsmbclient =( */
     wrote = RSTRING(str)->as.heap.len;
   file->bufpos += wrote;
@@ -516,7 +643,7 @@ static VALUE smbfile_readlines(int argc, VALUE *argv, VALUE self)
   Data_Get_Struct(self, struct smbfile, file);
 
   ary = rb_ary_new();
-  while (!NIP_P(line = smbfile_gets(argc, argv, self))) {
+  while (!NIL_P(line = smbfile_gets(argc, argv, self))) {
     rb_ary_push(ary, line);
   }
 
@@ -553,6 +680,9 @@ static VALUE smbfile_read(int argc, VALUE *argv, VALUE self)
     if (max == 0) return rb_str_new2("");
   }
 
+  if (file->bufpos < file->read) {
+    metrics_buffer(file->server, true);
+  }
   str = rb_str_new2("");
   count = 0;
   while (count < max || max == 0) {
@@ -607,7 +737,15 @@ static VALUE smbfile_close(VALUE self)
   if (smbc_close(file->fh) < 0) {
     rb_sys_fail(file->url);
   }
+  if (!file->closed) {
+    backend_handle_closed();
+  }
   file->closed = true;
+  file->pos += file->bufpos;
+  file->bufpos = 0;
+  file->read = 0;
+  bufpool_put(file->buf, file->bufcap);
+  file->buf = NULL;
 
   return Qnil;
 }
@@ -621,6 +759,47 @@ static VALUE smbfile_closed_p(VALUE self)
   return (file->closed ? Qtrue : Qfalse);
 }
 
+/*
+  A decompressed stream can only be read from the start: seeking back
+  starts over, seeking forward reads and drops what is in between.
+*/
+
+static VALUE file_decomp_seek(struct smbfile *file, off_t offset, int whence)
+{
+  off_t target;
+
+  if (whence == SEEK_END) {
+    errno = ESPIPE;
+    rb_sys_fail(file->url);
+  }
+  target = (whence == SEEK_CUR ? file->pos + file->bufpos + offset : offset);
+  if (target < 0) {
+    errno = EINVAL;
+    rb_sys_fail(file->url);
+  }
+  if (target < file->pos + file->bufpos) {
+    if (file_lseek(file, 0, SEEK_SET) < 0) {
+      rb_sys_fail(file->url);
+    }
+    decomp_reset(file->decomp);
+    file->raw_pos = 0;
+    file->pos = 0;
+    file->bufpos = 0;
+    file->read = 0;
+    file->eof = false;
+  }
+  while (target > file->pos + file->read) {
+    file->bufpos = file->read;
+    file_read(file);
+    if (file->eof) {
+      break;
+    }
+  }
+  file->bufpos = (target - file->pos < file->read ? target - file->pos : file->read);
+
+  return INT2FIX(0);
+}
+
 static VALUE smbfile_seek(int argc, VALUE *argv, VALUE self)
 {
   VALUE roffset;
@@ -641,19 +820,26 @@ static VALUE smbfile_seek(int argc, VALUE *argv, VALUE self)
   }
   offset = NUM2INT(roffset);
 
+  if (file->decomp != NULL) {
+    return file_decomp_seek(file, offset, whence);
+  }
+
   if (whence == SEEK_SET)
     file->pos = offset;
   else if (whence == SEEK_CUR)
     file->pos += (offset + file->bufpos);
   else if (whence == SEEK_END) {
     struct stat st;
-    if (smbc_fstat(file->fh, &st) < 0) {
+    uint64_t start = metrics_start();
+    int ret = smbc_fstat(file->fh, &st);
+    metrics_end(file->server, METRIC_STAT, file->url, start, ret);
+    if (ret < 0) {
       rb_sys_fail(file->url);
     }
     file->pos = st.st_size + offset;
   }
   
-  if (smbc_lseek(file->fh, file->pos, SEEK_SET) < 0 && errno != 0) {
+  if (file_lseek(file, file->pos, SEEK_SET) < 0 && errno != 0) {
     rb_sys_fail(file->url);
   }
   file->bufpos = 0;
@@ -700,9 +886,13 @@ static VALUE smbfile_ungetc(VALUE self, VALUE chr)
     file->bufpos--;
     file->buf[file->bufpos] = ch;
   }
+  else if (file->decomp != NULL) {
+    file_decomp_seek(file, file->pos - 1, SEEK_SET);
+    file->buf[file->bufpos] = ch;
+  }
   else { /* file->bufpos == 0 */
     file->pos--;
-    smbc_lseek(file->fh, file->pos, SEEK_SET);
+    file_lseek(file, file->pos, SEEK_SET);
     file_read(file);
     file->buf[0] = ch;
   }
@@ -762,15 +952,107 @@ static VALUE smbfile_each_line(int argc, VALUE *argv, VALUE self)
   return self;
 }
 
+/* walks the read buffer itself instead of going through getc per byte */
 static VALUE smbfile_each_byte(VALUE self)
 {
-  VALUE chr;
+  struct smbfile *file;
+  unsigned char c;
+
+  RETURN_ENUMERATOR(self, 0, 0);
 
-  while (!NIP_P(chr = smbfile_getc(self))) {
-    rb_yield(chr);
+  Data_Get_Struct(self, struct smbfile, file);
+
+  file_check_readable(file);
+
+  if (file->bufpos < file->read) {
+    metrics_buffer(file->server, true);
+  }
+  while (true) {
+    if (file->bufpos == file->read) {
+      file_read(file);
+      if (file->eof) {
+	break;
+      }
+    }
+    c = file->buf[file->bufpos++];
+    rb_yield(INT2FIX(c));
   }
 
-  return Qnil;
+  return self;
+}
+
+/*
+  SMB::File#each_chunk(size = io_size, opts = {}) { |chunk| ... }
+
+  Yields the rest of the file in strings of size bytes, the last one
+  possibly shorter. With :reuse => true every chunk is the same string
+  refilled in place, so a block that only looks at the bytes makes no
+  garbage; it has to dup what it keeps.
+*/
+
+static VALUE smbfile_each_chunk(int argc, VALUE *argv, VALUE self)
+{
+  VALUE vsize;
+  VALUE opts;
+  VALUE str = Qnil;
+  struct smbfile *file;
+  long size;
+  long len;
+  long n;
+  bool reuse;
+
+  RETURN_ENUMERATOR(self, argc, argv);
+
+  rb_scan_args(argc, argv, "02", &vsize, &opts);
+  if (TYPE(vsize) == T_HASH && NIL_P(opts)) {
+    opts = vsize;
+    vsize = Qnil;
+  }
+
+  Data_Get_Struct(self, struct smbfile, file);
+
+  file_check_readable(file);
+
+  size = (NIL_P(vsize) ? file->bufsize : NUM2LONG(vsize));
+  if (size <= 0) {
+    rb_raise(rb_eArgError, "chunk size must be positive");
+  }
+  reuse = RTEST(util_opt(opts, "reuse"));
+
+  if (file->bufpos < file->read) {
+    metrics_buffer(file->server, true);
+  }
+  while (true) {
+    if (NIL_P(str) || !reuse) {
+      str = rb_str_new(NULL, size);
+    }
+    else {
+      /* the block may have kept a slice sharing our bytes */
+      rb_str_modify(str);
+      rb_str_resize(str, size);
+    }
+    len = 0;
+    while (len < size) {
+      if (file->bufpos == file->read) {
+	file_read(file);
+	if (file->eof) {
+	  break;
+	}
+      }
+      n = file->read - file->bufpos;
+      n = (n < size - len ? n : size - len);
+      memcpy(RSTRING_PTR(str) + len, file->buf + file->bufpos, n);
+      file->bufpos += n;
+      len += n;
+    }
+    if (len == 0) {
+      break;
+    }
+    rb_str_set_len(str, len);
+    rb_yield(str);
+  }
+
+  return self;
 }
 
 static VALUE smbfile_eof_p(VALUE self)
@@ -833,9 +1115,12 @@ static VALUE smbfile_delete(int argc, VALUE *argv, VALUE self)
   int i;
 
   for (i = 0; i < argc; i++) {
-    Check_SafeStr(argv[i]);
+    StringValue(argv[i]);
 
-    smbc_unlink(RSTRING(argv[i])->as.heap.ptr);
+    if (smbc_unlink(RSTRING(argv[i])->as.heap.ptr) < 0) {
+      rb_sys_fail(RSTRING(argv[i])->as.heap.ptr);
+    }
+    smb_invalidate(RSTRING(argv[i])->as.heap.ptr);
   }
 
   return INT2FIX(argc);
@@ -845,7 +1130,7 @@ static VALUE smbfile_dirname(VALUE self, VALUE url)
 {
   char *p;
 
-  Check_Type(url, T_STRING);
+  StringValue(url);
 
   p = strrchr(RSTRING(url)->as.heap.ptr, '/');
 
@@ -856,10 +1141,12 @@ static VALUE smbfile_stat(VALUE self)
 {
   struct smbfile *file;
   struct stat st;
+  uint64_t start;
 
   Data_Get_Struct(self, struct smbfile, file);
 
-  smbc_fstat(file->fh, &st);
+  start = metrics_start();
+  metrics_end(file->server, METRIC_STAT, file->url, start, smbc_fstat(file->fh, &st));
 
   return stat_new(&st);
 }
@@ -904,6 +1191,7 @@ void init_smbfile(void)
   rb_define_singleton_method(cSmbFile, "new", smbfile_new, -1);
   rb_define_method(cSmbFile, "initialize", smbfile_initialize, -1);
   rb_define_method(cSmbFile, "each_byte", smbfile_each_byte, 0);
+  rb_define_method(cSmbFile, "each_chunk", smbfile_each_chunk, -1);
   rb_define_method(cSmbFile, "each_line", smbfile_each_line, -1);
   rb_define_alias(cSmbFile, "each", "each_line");
   rb_define_method(cSmbFile, "eof?", smbfile_eof_p, 0);
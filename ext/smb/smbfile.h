@@ -23,5 +23,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 
 void init_smbfile(void);
 VALUE smbfile_open(int, VALUE*, VALUE);
+void file_set_bufsize(int);
+int file_get_bufsize(void);
 
 #endif
@@ -0,0 +1,426 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include <libsmbclient.h>
+#include <ruby.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "rubysmb.h"
+#include "smbctx.h"
+#include "smbdir.h"
+#include "smbglob.h"
+#include "smbpool.h"
+#include "smbutil.h"
+
+/*
+  SMB::Dir.glob compiles the pattern into path segments and runs it as a
+  small NFA: each directory task carries the set of segments that may
+  match its entries, as a bitmask. Entries are matched on the worker
+  threads; a directory is only listed if some segment can still match
+  below it, and only matching urls ever become Ruby strings.
+*/
+
+#define GLOB_MAX_SEGS 63
+
+enum {
+  GLOB_LITERAL,
+  GLOB_WILD,
+  GLOB_RECURSE
+};
+
+struct glob_seg {
+  int kind;
+  char *pat;
+};
+
+struct glob_pattern {
+  char *prefix;
+  int nsegs;
+  int fnflags;
+  bool casefold;
+  bool dirs_only;
+  struct glob_seg segs[GLOB_MAX_SEGS];
+};
+
+struct glob_task {
+  struct pool_item item;
+  uint64_t states;
+  char url[1];
+};
+
+struct glob_result {
+  struct pool_item item;
+  char url[1];
+};
+
+struct glob_state {
+  struct glob_pattern pat;
+  struct smbpool *pool;
+  struct glob_result *current;
+  int nthreads;
+  VALUE ary;
+};
+
+#define STATE(i) ((uint64_t)1 << (i))
+
+static bool glob_meta_p(const char *s, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == '\\') {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void glob_pattern_free(struct glob_pattern *pat)
+{
+  int i;
+
+  for (i = 0; i < pat->nsegs; i++) {
+    xfree(pat->segs[i].pat);
+  }
+  xfree(pat->prefix);
+  pat->nsegs = 0;
+  pat->prefix = NULL;
+}
+
+/*
+  Splits "smb://server/share/dir/x*y/..." into the literal prefix that can
+  be opened directly and the segments after it. Returns false if the
+  pattern has no wildcards at all.
+*/
+
+static bool glob_compile(struct glob_pattern *pat, char *url)
+{
+  int server_i, server_len;
+  int share_i, share_len;
+  int path_i, path_len;
+  int username_i, username_len;
+  int password_i, password_len;
+  char *p;
+  char *start;
+  char *end;
+  size_t len;
+
+  if (!util_parse_url(url,
+		      &server_i, &server_len,
+		      &share_i, &share_len,
+		      &path_i, &path_len,
+		      &username_i, &username_len,
+		      &password_i, &password_len)) {
+    rb_raise(eSmbError, "invalid url");
+  }
+  if (server_i == 0 || !share_i) {
+    if (server_i != 0 && glob_meta_p(url + server_i, server_len)) {
+      rb_raise(eSmbError, "wildcards aren't allowed in the server name");
+    }
+    return false;
+  }
+  if (glob_meta_p(url + server_i, server_len)) {
+    rb_raise(eSmbError, "wildcards aren't allowed in the server name");
+  }
+
+  /* find the first component with a wildcard in it */
+  start = url + share_i;
+  while (true) {
+    end = strchr(start, '/');
+    len = (end != NULL ? (size_t)(end - start) : strlen(start));
+    if (glob_meta_p(start, len)) {
+      break;
+    }
+    if (end == NULL) {
+      return false;
+    }
+    start = end + 1;
+  }
+
+  pat->prefix = ALLOC_N(char, start - url);
+  memcpy(pat->prefix, url, start - url - 1);
+  pat->prefix[start - url - 1] = '\0';
+
+  len = strlen(start);
+  pat->dirs_only = (len > 0 && start[len - 1] == '/');
+
+  for (p = start; *p; p = (end != NULL ? end + 1 : p + len)) {
+    struct glob_seg *seg;
+
+    end = strchr(p, '/');
+    len = (end != NULL ? (size_t)(end - p) : strlen(p));
+    if (len == 0) {
+      if (end == NULL) {
+	break;
+      }
+      continue;
+    }
+    /* collapse runs of ** */
+    if (len == 2 && strncmp(p, "**", 2) == 0 &&
+	pat->nsegs > 0 && pat->segs[pat->nsegs - 1].kind == GLOB_RECURSE) {
+      if (end == NULL) {
+	break;
+      }
+      continue;
+    }
+    if (pat->nsegs == GLOB_MAX_SEGS) {
+      glob_pattern_free(pat);
+      rb_raise(eSmbError, "pattern too deep");
+    }
+    seg = &pat->segs[pat->nsegs++];
+    seg->pat = ALLOC_N(char, len + 1);
+    memcpy(seg->pat, p, len);
+    seg->pat[len] = '\0';
+    if (len == 2 && strcmp(seg->pat, "**") == 0) {
+      seg->kind = GLOB_RECURSE;
+    }
+    else if (glob_meta_p(p, len)) {
+      seg->kind = GLOB_WILD;
+    }
+    else {
+      seg->kind = GLOB_LITERAL;
+    }
+    if (end == NULL) {
+      break;
+    }
+  }
+
+  /* a trailing ** is just a * */
+  if (pat->nsegs > 0 && pat->segs[pat->nsegs - 1].kind == GLOB_RECURSE) {
+    pat->segs[pat->nsegs - 1].kind = GLOB_WILD;
+  }
+
+  return true;
+}
+
+/* ** may match no directories at all, so it also enables what follows it */
+static uint64_t glob_closure(struct glob_pattern *pat, uint64_t states)
+{
+  int i;
+
+  for (i = 0; i < pat->nsegs; i++) {
+    if ((states & STATE(i)) && pat->segs[i].kind == GLOB_RECURSE) {
+      states |= STATE(i + 1);
+    }
+  }
+
+  return states;
+}
+
+static bool glob_seg_match(struct glob_pattern *pat, struct glob_seg *seg, const char *name)
+{
+  switch (seg->kind) {
+  case GLOB_LITERAL:
+    return (pat->casefold ? strcasecmp(seg->pat, name) : strcmp(seg->pat, name)) == 0;
+  case GLOB_WILD:
+    return fnmatch(seg->pat, name, pat->fnflags) == 0;
+  case GLOB_RECURSE:
+    /* like Ruby, ** doesn't descend into dot directories unless asked to */
+    return !(pat->fnflags & FNM_PERIOD) || name[0] != '.';
+  }
+
+  return false;
+}
+
+static void glob_push(struct smbpool *pool, const char *url, uint64_t states)
+{
+  struct glob_task *task;
+
+  task = malloc(sizeof(struct glob_task) + strlen(url));
+  task->states = states;
+  strcpy(task->url, url);
+  pool_push(pool, &task->item);
+}
+
+static void glob_list(struct smbpool *pool, SMBCCTX *ctx, struct pool_item *item)
+{
+  struct glob_task *task = (struct glob_task*)item;
+  struct glob_state *state = pool->data;
+  struct glob_pattern *pat = &state->pat;
+  uint64_t final = STATE(pat->nsegs);
+  struct smbc_dirent *ent;
+  SMBCFILE *dh;
+  uint64_t next;
+  bool container;
+  char *url;
+  int i;
+
+  if ((dh = smbc_getFunctionOpendir(ctx)(ctx, task->url)) == NULL) {
+    free(task);
+    return;
+  }
+
+  while ((ent = smbc_getFunctionReaddir(ctx)(ctx, dh)) != NULL) {
+    if (strcmp(ent->name, ".") == 0 || strcmp(ent->name, "..") == 0) {
+      continue;
+    }
+    container = SMBC_CONTAINER_P(ent->smbc_type);
+
+    next = 0;
+    for (i = 0; i < pat->nsegs; i++) {
+      if (!(task->states & STATE(i))) {
+	continue;
+      }
+      if (pat->segs[i].kind == GLOB_RECURSE) {
+	if (container && glob_seg_match(pat, &pat->segs[i], ent->name)) {
+	  next |= STATE(i);
+	}
+      }
+      else if (glob_seg_match(pat, &pat->segs[i], ent->name)) {
+	next |= STATE(i + 1);
+      }
+    }
+    if (next == 0) {
+      continue;
+    }
+    next = glob_closure(pat, next);
+
+    if ((next & final) && (container || !pat->dirs_only)) {
+      struct glob_result *r;
+
+      url = ctx_url_join(task->url, ent->name);
+      r = malloc(sizeof(struct glob_result) + strlen(url) + 1);
+      strcpy(r->url, url);
+      if (pat->dirs_only) {
+	strcat(r->url, "/");
+      }
+      free(url);
+      if (!pool_emit(pool, &r->item)) {
+	break;
+      }
+    }
+    if (container && (next & ~final)) {
+      url = ctx_url_join(task->url, ent->name);
+      glob_push(pool, url, next & ~final);
+      free(url);
+    }
+  }
+  smbc_getFunctionClosedir(ctx)(ctx, dh);
+  free(task);
+}
+
+static VALUE glob_run(VALUE arg)
+{
+  struct glob_state *state = (struct glob_state*)arg;
+  struct glob_result *r;
+  VALUE url;
+
+  state->pool = pool_new(state->nthreads, glob_list, state);
+  glob_push(state->pool, state->pat.prefix, glob_closure(&state->pat, STATE(0)));
+
+  while ((r = (struct glob_result*)pool_next(state->pool)) != NULL) {
+    state->current = r;
+    url = rb_str_new2(r->url);
+    state->current = NULL;
+    free(r);
+    if (NIL_P(state->ary)) {
+      rb_yield(url);
+    }
+    else {
+      rb_ary_push(state->ary, url);
+    }
+  }
+
+  return Qnil;
+}
+
+static VALUE glob_cleanup(VALUE arg)
+{
+  struct glob_state *state = (struct glob_state*)arg;
+
+  free(state->current);
+  state->current = NULL;
+  pool_free(state->pool);
+  state->pool = NULL;
+  glob_pattern_free(&state->pat);
+
+  return Qnil;
+}
+
+/*
+  SMB::Dir.glob(pattern, opts = {}) [{ |url| ... }]
+
+  Supports *, ?, [set] and ** within a share. Options: :threads,
+  :casefold, :dotmatch and :sort (default true, ignored with a block).
+*/
+
+static VALUE smbdir_s_glob(int argc, VALUE *argv, VALUE self)
+{
+  VALUE pattern;
+  VALUE opts;
+  VALUE v;
+  struct glob_state state;
+  struct stat st;
+  char *urlp;
+  int dh;
+
+  rb_scan_args(argc, argv, "11", &pattern, &opts);
+
+  StringValue(pattern);
+  urlp = StringValuePtr(pattern);
+
+  memset(&state, 0, sizeof(state));
+  state.nthreads = pool_threads_opt(opts);
+  state.pat.casefold = RTEST(util_opt(opts, "casefold"));
+  state.pat.fnflags = (state.pat.casefold ? FNM_CASEFOLD : 0) |
+    (RTEST(util_opt(opts, "dotmatch")) ? 0 : FNM_PERIOD);
+  state.ary = (rb_block_given_p() ? Qnil : rb_ary_new());
+
+  if (!glob_compile(&state.pat, urlp)) {
+    /* nothing to expand, it either exists or it doesn't */
+    if (smbc_stat(urlp, &st) == 0) {
+      if (NIL_P(state.ary)) {
+	rb_yield(rb_str_new2(urlp));
+      }
+      else {
+	rb_ary_push(state.ary, rb_str_new2(urlp));
+      }
+    }
+    return state.ary;
+  }
+
+  /* as in SMB::Dir.walk, this authenticates on the Ruby thread */
+  if ((dh = smbc_opendir(state.pat.prefix)) < 0) {
+    glob_pattern_free(&state.pat);
+    return state.ary;
+  }
+  smbc_closedir(dh);
+
+  rb_ensure(glob_run, (VALUE)&state, glob_cleanup, (VALUE)&state);
+
+  if (!NIL_P(state.ary) && (NIL_P(v = util_opt(opts, "sort")) || RTEST(v))) {
+    rb_ary_sort_bang(state.ary);
+  }
+
+  return state.ary;
+}
+
+void init_smbglob(void)
+{
+  rb_define_singleton_method(cSmbDir, "glob", smbdir_s_glob, -1);
+  rb_define_alias(rb_singleton_class(cSmbDir), "[]", "glob");
+}
@@ -0,0 +1,1177 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include <libsmbclient.h>
+#include <ruby.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "rubysmb.h"
+#include "smbctx.h"
+#include "smbdir.h"
+#include "smbindex.h"
+#include "smbpool.h"
+#include "smbstat.h"
+#include "smbutil.h"
+
+/*
+  SMB::Index keeps (path, size, mtime, type) for a whole tree in a local
+  file, so that questions about the tree don't need a crawl.
+
+  The file is a header, the root url, an array of fixed size records and
+  the relative paths they point into, in native byte order:
+
+    "SMBIDX02" count:u32 rootlen:u32 nameslen:u64 root (padded to 8)
+    records[count] names[nameslen]
+
+  Records are sorted on their relative path with '/' ordering before
+  every other byte, which puts each directory's subtree right after it and
+  makes any path prefix a contiguous range.
+*/
+
+#define INDEX_MAGIC "SMBIDX02"
+#define INDEX_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+struct index_header {
+  char magic[8];
+  uint32_t count;
+  uint32_t rootlen;
+  uint64_t nameslen;
+};
+
+struct index_rec {
+  uint64_t size;
+  int64_t mtime;
+  uint64_t off;
+  uint32_t len;
+  uint8_t type;
+  uint8_t pad[3];
+};
+
+struct smbindex {
+  char *path;
+  char *root;
+  char *buf;
+  const struct index_rec *recs;
+  const char *names;
+  uint32_t *end;
+  long count;
+  bool busy;
+};
+
+enum {
+  INDEX_ADDED,
+  INDEX_REMOVED,
+  INDEX_MODIFIED,
+  INDEX_ERROR
+};
+
+struct index_task {
+  struct pool_item item;
+  long old;
+  bool has_stat;
+  bool in_share;
+  struct stat st;
+  char rel[1];
+};
+
+struct index_event {
+  struct pool_item item;
+  int kind;
+  int err;
+  int type;
+  uint64_t size;
+  int64_t mtime;
+  char rel[1];
+};
+
+struct index_entry {
+  int type;
+  struct stat st;
+  char *name;
+};
+
+/* the new records, appended to by every worker */
+struct index_build {
+  struct smbpool *pool;
+  struct index_event *current;
+  const struct smbindex *old;
+  const char *root;
+  const char *path;
+  bool events;
+  bool in_share;
+  int nthreads;
+  pthread_mutex_t lock;
+  struct index_rec *recs;
+  long count;
+  long cap;
+  char *names;
+  size_t nameslen;
+  size_t namescap;
+  long relisted;
+  long added;
+  long removed;
+  long modified;
+  VALUE errors;
+  bool yield;
+};
+
+static int path_cmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+  size_t i;
+  unsigned char ca, cb;
+
+  for (i = 0; i < alen && i < blen; i++) {
+    ca = (a[i] == '/' ? 0 : (unsigned char)a[i]);
+    cb = (b[i] == '/' ? 0 : (unsigned char)b[i]);
+    if (ca != cb) {
+      return ca - cb;
+    }
+  }
+
+  return (alen > blen) - (alen < blen);
+}
+
+#define REC_NAME(idx, i) ((idx)->names + (idx)->recs[i].off)
+#define REC_DIR_P(idx, i) SMBC_CONTAINER_P((idx)->recs[i].type)
+
+static char *index_url(const char *root, const char *rel)
+{
+  if (*rel == '\0') {
+    return strdup(root);
+  }
+
+  return ctx_url_join(root, rel);
+}
+
+static char *index_rel_join(const char *rel, const char *name)
+{
+  if (*rel == '\0') {
+    return strdup(name);
+  }
+
+  return ctx_url_join(rel, name);
+}
+
+static void index_free(struct smbindex *idx)
+{
+  free(idx->path);
+  free(idx->root);
+  free(idx->buf);
+  free(idx->end);
+  free(idx);
+}
+
+/*
+  Reads an index file; the whole file stays in memory and the records
+  point into it. Returns NULL with errno set, or EINVAL for a file that
+  isn't an index.
+*/
+
+static struct smbindex *index_load(const char *path)
+{
+  struct smbindex *idx;
+  struct index_header *hdr;
+  FILE *fp;
+  long size;
+  long i;
+  long top;
+  long *stack;
+  size_t recs_off;
+  int err;
+
+  if ((fp = fopen(path, "rb")) == NULL) {
+    return NULL;
+  }
+  idx = calloc(1, sizeof(struct smbindex));
+  if (fseek(fp, 0, SEEK_END) < 0 || (size = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) < 0) {
+    goto fail;
+  }
+  idx->buf = malloc(size > 0 ? size : 1);
+  if (fread(idx->buf, 1, size, fp) != (size_t)size) {
+    errno = (ferror(fp) ? EIO : EINVAL);
+    goto fail;
+  }
+  fclose(fp);
+  fp = NULL;
+
+  hdr = (struct index_header*)idx->buf;
+  if ((size_t)size < sizeof(struct index_header) || memcmp(hdr->magic, INDEX_MAGIC, 8) != 0) {
+    errno = EINVAL;
+    goto fail;
+  }
+  recs_off = INDEX_ALIGN(sizeof(struct index_header) + hdr->rootlen);
+  if (recs_off + (uint64_t)hdr->count * sizeof(struct index_rec) + hdr->nameslen != (uint64_t)size) {
+    errno = EINVAL;
+    goto fail;
+  }
+
+  idx->path = strdup(path);
+  idx->root = malloc(hdr->rootlen + 1);
+  memcpy(idx->root, idx->buf + sizeof(struct index_header), hdr->rootlen);
+  idx->root[hdr->rootlen] = '\0';
+  idx->count = hdr->count;
+  idx->recs = (const struct index_rec*)(idx->buf + recs_off);
+  idx->names = idx->buf + recs_off + hdr->count * sizeof(struct index_rec);
+  for (i = 0; i < idx->count; i++) {
+    if ((uint64_t)idx->recs[i].off + idx->recs[i].len > hdr->nameslen) {
+      errno = EINVAL;
+      goto fail;
+    }
+  }
+
+  /* end[i] is one past the last record of i's subtree */
+  idx->end = malloc((idx->count + 1) * sizeof(uint32_t));
+  stack = malloc((idx->count + 1) * sizeof(long));
+  top = 0;
+  for (i = 0; i < idx->count; i++) {
+    while (top > 0) {
+      long d = stack[top - 1];
+      size_t dlen = idx->recs[d].len;
+
+      if (dlen == 0 ||
+	  (idx->recs[i].len > dlen && REC_NAME(idx, i)[dlen] == '/' &&
+	   memcmp(REC_NAME(idx, i), REC_NAME(idx, d), dlen) == 0)) {
+	break;
+      }
+      idx->end[d] = i;
+      top--;
+    }
+    idx->end[i] = i + 1;
+    if (REC_DIR_P(idx, i)) {
+      stack[top++] = i;
+    }
+  }
+  while (top > 0) {
+    idx->end[stack[--top]] = idx->count;
+  }
+  free(stack);
+
+  return idx;
+
+ fail:
+  err = errno;
+  if (fp != NULL) {
+    fclose(fp);
+  }
+  index_free(idx);
+  errno = err;
+  return NULL;
+}
+
+static void index_load_fail(const char *path)
+{
+  if (errno == EINVAL) {
+    rb_raise(eSmbError, "%s is not a valid index", path);
+  }
+  rb_sys_fail(path);
+}
+
+/* worker side */
+
+static void build_add(struct index_build *b, const char *rel, int type, uint64_t size, int64_t mtime)
+{
+  struct index_rec *rec;
+  size_t len = strlen(rel);
+
+  pthread_mutex_lock(&b->lock);
+  if (b->count == b->cap) {
+    b->cap = (b->cap == 0 ? 1024 : b->cap * 2);
+    b->recs = realloc(b->recs, b->cap * sizeof(struct index_rec));
+  }
+  while (b->nameslen + len > b->namescap) {
+    b->namescap = (b->namescap == 0 ? 16384 : b->namescap * 2);
+    b->names = realloc(b->names, b->namescap);
+  }
+  rec = &b->recs[b->count++];
+  rec->size = size;
+  rec->mtime = mtime;
+  rec->off = b->nameslen;
+  rec->len = len;
+  rec->type = type;
+  memset(rec->pad, 0, sizeof(rec->pad));
+  memcpy(b->names + b->nameslen, rel, len);
+  b->nameslen += len;
+  pthread_mutex_unlock(&b->lock);
+}
+
+static void build_event(struct index_build *b, int kind, const char *rel, int type,
+			uint64_t size, int64_t mtime, int err)
+{
+  struct index_event *e;
+
+  if (!b->events && kind != INDEX_ERROR) {
+    return;
+  }
+  e = malloc(sizeof(struct index_event) + strlen(rel));
+  e->kind = kind;
+  e->err = err;
+  e->type = type;
+  e->size = size;
+  e->mtime = mtime;
+  strcpy(e->rel, rel);
+  pool_emit(b->pool, &e->item);
+}
+
+static void build_push(struct index_build *b, long old, const char *rel,
+		       const struct stat *st, bool in_share)
+{
+  struct index_task *task;
+
+  task = malloc(sizeof(struct index_task) + strlen(rel));
+  task->old = old;
+  task->has_stat = (st != NULL);
+  task->in_share = in_share;
+  if (st != NULL) {
+    task->st = *st;
+  }
+  strcpy(task->rel, rel);
+  pool_push(b->pool, &task->item);
+}
+
+static char *old_name(const struct smbindex *idx, long i)
+{
+  return strndup(REC_NAME(idx, i), idx->recs[i].len);
+}
+
+/* copies old record i and its whole subtree unchanged */
+static void build_keep(struct index_build *b, long i)
+{
+  const struct smbindex *old = b->old;
+  char *rel;
+  long j;
+
+  for (j = i; j < (long)old->end[i]; j++) {
+    rel = old_name(old, j);
+    build_add(b, rel, old->recs[j].type, old->recs[j].size, old->recs[j].mtime);
+    free(rel);
+  }
+}
+
+static void build_removed(struct index_build *b, long i)
+{
+  const struct smbindex *old = b->old;
+  char *rel;
+  long j;
+
+  for (j = i; j < (long)old->end[i]; j++) {
+    rel = old_name(old, j);
+    build_event(b, INDEX_REMOVED, rel, old->recs[j].type, old->recs[j].size,
+		old->recs[j].mtime, 0);
+    free(rel);
+  }
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+  return strcmp(((const struct index_entry*)a)->name, ((const struct index_entry*)b)->name);
+}
+
+static void entries_free(struct index_entry *list, long count)
+{
+  long i;
+
+  for (i = 0; i < count; i++) {
+    free(list[i].name);
+  }
+  free(list);
+}
+
+/*
+  Lists dh into *entries. A listing that ends in an error gives -1 and
+  errno, as a partial one would make the rest look removed.
+*/
+
+static long list_entries(SMBCCTX *ctx, SMBCFILE *dh, const char *url, bool in_share,
+			 struct index_entry **entries)
+{
+  struct smbc_dirent *ent;
+  struct index_entry *list = NULL;
+  long count = 0;
+  long cap = 0;
+  char *eurl;
+  int err;
+
+#ifdef HAVE_SMBC_READDIRPLUS2
+  if (in_share) {
+    const struct libsmb_file_info *info;
+    struct stat st;
+
+    for (errno = 0; (info = smbc_getFunctionReaddirPlus2(ctx)(ctx, dh, &st)) != NULL; errno = 0) {
+      if (strcmp(info->name, ".") == 0 || strcmp(info->name, "..") == 0) {
+	continue;
+      }
+      if (count == cap) {
+	cap = (cap == 0 ? 32 : cap * 2);
+	list = realloc(list, cap * sizeof(struct index_entry));
+      }
+      list[count].type = (S_ISDIR(st.st_mode) ? SMBC_DIR : SMBC_FILE);
+      list[count].st = st;
+      list[count].name = strdup(info->name);
+      count++;
+    }
+    if (errno != 0) {
+      err = errno;
+      entries_free(list, count);
+      errno = err;
+      return -1;
+    }
+    *entries = list;
+    return count;
+  }
+#endif
+
+  for (errno = 0; (ent = smbc_getFunctionReaddir(ctx)(ctx, dh)) != NULL; errno = 0) {
+    if (strcmp(ent->name, ".") == 0 || strcmp(ent->name, "..") == 0) {
+      continue;
+    }
+    if (ent->smbc_type != SMBC_FILE && ent->smbc_type != SMBC_DIR &&
+	ent->smbc_type != SMBC_LINK && ent->smbc_type != SMBC_FILE_SHARE) {
+      continue;
+    }
+    if (count == cap) {
+      cap = (cap == 0 ? 32 : cap * 2);
+      list = realloc(list, cap * sizeof(struct index_entry));
+    }
+    list[count].type = ent->smbc_type;
+    list[count].name = strdup(ent->name);
+    eurl = ctx_url_join(url, ent->name);
+    if (smbc_getFunctionStat(ctx)(ctx, eurl, &list[count].st) < 0) {
+      memset(&list[count].st, 0, sizeof(struct stat));
+    }
+    free(eurl);
+    count++;
+  }
+  if (errno != 0) {
+    err = errno;
+    entries_free(list, count);
+    errno = err;
+    return -1;
+  }
+  *entries = list;
+
+  return count;
+}
+
+/*
+  Visits one directory. An unchanged mtime means the old children are
+  still right, so files are copied over and only subdirectories are
+  looked at; otherwise the directory is listed and diffed against the old
+  children. A directory that can't be looked at keeps its old subtree.
+*/
+
+static void build_visit(struct smbpool *pool, SMBCCTX *ctx, struct pool_item *item)
+{
+  struct index_task *task = (struct index_task*)item;
+  struct index_build *b = pool->data;
+  const struct smbindex *old = b->old;
+  struct index_entry *entries = NULL;
+  struct stat st;
+  SMBCFILE *dh;
+  char *name = NULL;
+  char *url;
+  char *rel;
+  long nentries;
+  long i;
+  long c;
+  int cmp;
+  int err;
+
+  url = index_url(b->root, task->rel);
+
+  if (task->has_stat) {
+    st = task->st;
+  }
+  else if (smbc_getFunctionStat(ctx)(ctx, url, &st) < 0) {
+    if (errno == ENOENT && task->old >= 0) {
+      build_removed(b, task->old);
+    }
+    else {
+      build_event(b, INDEX_ERROR, task->rel, 0, 0, 0, errno);
+      if (task->old >= 0) {
+	build_keep(b, task->old);
+      }
+    }
+    goto done;
+  }
+
+  /* some servers report no mtime at all, and then there's nothing to trust */
+  if (task->old >= 0 && st.st_mtime != 0 && old->recs[task->old].mtime == st.st_mtime) {
+    build_add(b, task->rel, old->recs[task->old].type, st.st_size, st.st_mtime);
+    for (c = task->old + 1; c < (long)old->end[task->old]; c = old->end[c]) {
+      name = old_name(old, c);
+      if (REC_DIR_P(old, c)) {
+	build_push(b, c, name, NULL,
+		   task->in_share || old->recs[c].type == SMBC_FILE_SHARE);
+      }
+      else {
+	build_add(b, name, old->recs[c].type, old->recs[c].size, old->recs[c].mtime);
+      }
+      free(name);
+    }
+    goto done;
+  }
+
+  if ((dh = smbc_getFunctionOpendir(ctx)(ctx, url)) == NULL) {
+    build_event(b, INDEX_ERROR, task->rel, 0, 0, 0, errno);
+    if (task->old >= 0) {
+      build_keep(b, task->old);
+    }
+    goto done;
+  }
+  nentries = list_entries(ctx, dh, url, task->in_share, &entries);
+  err = errno;
+  smbc_getFunctionClosedir(ctx)(ctx, dh);
+  if (nentries < 0) {
+    build_event(b, INDEX_ERROR, task->rel, 0, 0, 0, err);
+    if (task->old >= 0) {
+      build_keep(b, task->old);
+    }
+    goto done;
+  }
+  qsort(entries, nentries, sizeof(struct index_entry), entry_cmp);
+  __sync_fetch_and_add(&b->relisted, 1);
+
+  build_add(b, task->rel, task->old >= 0 ? old->recs[task->old].type : SMBC_DIR,
+	    st.st_size, st.st_mtime);
+
+  /* both sides are sorted by name, so the diff is a merge */
+  i = 0;
+  c = (task->old >= 0 ? task->old + 1 : 0);
+  while (i < nentries || (task->old >= 0 && c < (long)old->end[task->old])) {
+    bool have_old = (task->old >= 0 && c < (long)old->end[task->old]);
+
+    if (have_old) {
+      size_t skip = old->recs[task->old].len + (old->recs[task->old].len > 0);
+
+      free(name);
+      name = strndup(REC_NAME(old, c) + skip, old->recs[c].len - skip);
+    }
+    if (!have_old) {
+      cmp = -1;
+    }
+    else if (i >= nentries) {
+      cmp = 1;
+    }
+    else {
+      cmp = strcmp(entries[i].name, name);
+    }
+
+    if (cmp > 0 || (cmp == 0 && SMBC_CONTAINER_P(entries[i].type) != REC_DIR_P(old, c))) {
+      build_removed(b, c);
+      c = old->end[c];
+      if (cmp > 0) {
+	continue;
+      }
+      cmp = -1;
+    }
+
+    rel = index_rel_join(task->rel, entries[i].name);
+    if (SMBC_CONTAINER_P(entries[i].type)) {
+      if (cmp < 0) {
+	build_event(b, INDEX_ADDED, rel, entries[i].type, 0, entries[i].st.st_mtime, 0);
+      }
+      build_push(b, cmp == 0 ? c : -1, rel, &entries[i].st,
+		 task->in_share || entries[i].type == SMBC_FILE_SHARE);
+    }
+    else {
+      if (cmp < 0) {
+	build_event(b, INDEX_ADDED, rel, entries[i].type, entries[i].st.st_size,
+		    entries[i].st.st_mtime, 0);
+      }
+      else if ((uint64_t)entries[i].st.st_size != old->recs[c].size ||
+	       entries[i].st.st_mtime != old->recs[c].mtime) {
+	build_event(b, INDEX_MODIFIED, rel, entries[i].type, entries[i].st.st_size,
+		    entries[i].st.st_mtime, 0);
+      }
+      build_add(b, rel, entries[i].type, entries[i].st.st_size, entries[i].st.st_mtime);
+    }
+    free(rel);
+    if (cmp == 0) {
+      c = old->end[c];
+    }
+    i++;
+  }
+
+  entries_free(entries, nentries);
+  free(name);
+
+ done:
+  free(url);
+  free(task);
+}
+
+/* Ruby side */
+
+struct sort_rec {
+  const char *name;
+  const struct index_rec *rec;
+};
+
+static int sort_rec_cmp(const void *a, const void *b)
+{
+  const struct sort_rec *ra = a;
+  const struct sort_rec *rb = b;
+
+  return path_cmp(ra->name, ra->rec->len, rb->name, rb->rec->len);
+}
+
+/* writes the new records next to path and renames them into place */
+static void build_write(struct index_build *b, const char *path)
+{
+  struct index_header hdr;
+  struct index_rec rec;
+  struct sort_rec *sorted;
+  static const char zeros[8];
+  char *tmp;
+  FILE *fp;
+  long i;
+  uint64_t off;
+  int err;
+
+  sorted = malloc((b->count + 1) * sizeof(struct sort_rec));
+  for (i = 0; i < b->count; i++) {
+    sorted[i].name = b->names + b->recs[i].off;
+    sorted[i].rec = &b->recs[i];
+  }
+  qsort(sorted, b->count, sizeof(struct sort_rec), sort_rec_cmp);
+
+  tmp = malloc(strlen(path) + 5);
+  sprintf(tmp, "%s.tmp", path);
+  if ((fp = fopen(tmp, "wb")) == NULL) {
+    err = errno;
+    free(sorted);
+    free(tmp);
+    errno = err;
+    rb_sys_fail(path);
+  }
+
+  memcpy(hdr.magic, INDEX_MAGIC, 8);
+  hdr.count = b->count;
+  hdr.rootlen = strlen(b->root);
+  hdr.nameslen = b->nameslen;
+  fwrite(&hdr, sizeof(hdr), 1, fp);
+  fwrite(b->root, 1, hdr.rootlen, fp);
+  fwrite(zeros, 1, INDEX_ALIGN(sizeof(hdr) + hdr.rootlen) - sizeof(hdr) - hdr.rootlen, fp);
+  for (i = 0, off = 0; i < b->count; i++) {
+    rec = *sorted[i].rec;
+    rec.off = off;
+    off += rec.len;
+    fwrite(&rec, sizeof(rec), 1, fp);
+  }
+  for (i = 0; i < b->count; i++) {
+    fwrite(sorted[i].name, 1, sorted[i].rec->len, fp);
+  }
+  free(sorted);
+
+  errno = 0;
+  err = ferror(fp);
+  if (fclose(fp) != 0 || err || rename(tmp, path) < 0) {
+    err = (errno != 0 ? errno : EIO);
+    unlink(tmp);
+    free(tmp);
+    errno = err;
+    rb_sys_fail(path);
+  }
+  free(tmp);
+}
+
+static VALUE event_kind(int kind)
+{
+  switch (kind) {
+  case INDEX_ADDED:
+    return ID2SYM(rb_intern("added"));
+  case INDEX_REMOVED:
+    return ID2SYM(rb_intern("removed"));
+  default:
+    return ID2SYM(rb_intern("modified"));
+  }
+}
+
+static VALUE rec_stat(int type, uint64_t size, int64_t mtime)
+{
+  struct stat st;
+
+  memset(&st, 0, sizeof(st));
+  st.st_mode = (SMBC_CONTAINER_P(type) ? S_IFDIR | 0755 : S_IFREG | 0644);
+  st.st_size = size;
+  st.st_mtime = mtime;
+
+  return stat_new(&st);
+}
+
+static VALUE build_run(VALUE arg)
+{
+  struct index_build *b = (struct index_build*)arg;
+  struct index_event *e;
+  char *url;
+  int kind;
+  VALUE vurl;
+  VALUE st;
+
+  b->pool = pool_new(b->nthreads, build_visit, b);
+  build_push(b, b->old->count > 0 ? 0 : -1, "", NULL, b->in_share);
+
+  while ((e = (struct index_event*)pool_next(b->pool)) != NULL) {
+    b->current = e;
+    url = index_url(b->root, e->rel);
+    vurl = rb_str_new2(url);
+    free(url);
+    if (e->kind == INDEX_ERROR) {
+      rb_ary_push(b->errors, rb_ary_new3(2, vurl, rb_syserr_new(e->err, StringValuePtr(vurl))));
+      b->current = NULL;
+      free(e);
+      continue;
+    }
+    switch (e->kind) {
+    case INDEX_ADDED:
+      b->added++;
+      break;
+    case INDEX_REMOVED:
+      b->removed++;
+      break;
+    case INDEX_MODIFIED:
+      b->modified++;
+      break;
+    }
+    st = (b->yield ? rec_stat(e->type, e->size, e->mtime) : Qnil);
+    kind = e->kind;
+    b->current = NULL;
+    free(e);
+    if (b->yield) {
+      rb_yield_values(3, event_kind(kind), vurl, st);
+    }
+  }
+
+  return Qnil;
+}
+
+static VALUE build_cleanup(VALUE arg)
+{
+  struct index_build *b = (struct index_build*)arg;
+
+  free(b->current);
+  b->current = NULL;
+  pool_free(b->pool);
+  b->pool = NULL;
+
+  return Qnil;
+}
+
+static VALUE build_body(VALUE arg)
+{
+  struct index_build *b = (struct index_build*)arg;
+
+  rb_ensure(build_run, arg, build_cleanup, arg);
+  build_write(b, b->path);
+
+  return Qnil;
+}
+
+static VALUE build_free(VALUE arg)
+{
+  struct index_build *b = (struct index_build*)arg;
+
+  free(b->recs);
+  free(b->names);
+  pthread_mutex_destroy(&b->lock);
+
+  return Qnil;
+}
+
+/*
+  Crawls root against old (which may be empty) and writes the result to
+  path. The root goes through the global context first, as in
+  SMB::Dir.walk, so authentication callbacks run on the Ruby thread.
+*/
+
+static void index_crawl(struct index_build *b, const struct smbindex *old, const char *root,
+			const char *path, VALUE opts)
+{
+  int server_i, server_len;
+  int share_i, share_len;
+  int path_i, path_len;
+  int username_i, username_len;
+  int password_i, password_len;
+  char *rootcopy;
+  int dh;
+
+  rootcopy = ALLOCA_N(char, strlen(root) + 1);
+  strcpy(rootcopy, root);
+  if (!util_parse_url(rootcopy,
+		      &server_i, &server_len,
+		      &share_i, &share_len,
+		      &path_i, &path_len,
+		      &username_i, &username_len,
+		      &password_i, &password_len)) {
+    rb_raise(eSmbError, "invalid url");
+  }
+  if ((dh = smbc_opendir(root)) < 0) {
+    rb_sys_fail(root);
+  }
+  smbc_closedir(dh);
+
+  b->old = old;
+  b->root = root;
+  b->path = path;
+  b->in_share = (share_i != 0);
+  b->nthreads = pool_threads_opt(opts);
+  b->errors = rb_ary_new();
+  pthread_mutex_init(&b->lock, NULL);
+
+  rb_ensure(build_body, (VALUE)b, build_free, (VALUE)b);
+}
+
+static VALUE index_wrap(struct smbindex *idx)
+{
+  return Data_Wrap_Struct(cSmbIndex, 0, index_free, idx);
+}
+
+static struct smbindex *index_get(VALUE self)
+{
+  struct smbindex *idx;
+
+  Data_Get_Struct(self, struct smbindex, idx);
+
+  return idx;
+}
+
+static char *root_normalize(VALUE url)
+{
+  char *root;
+  size_t len;
+
+  StringValue(url);
+  root = strdup(StringValuePtr(url));
+  for (len = strlen(root); len > 6 && root[len - 1] == '/'; len--) {
+    root[len - 1] = '\0';
+  }
+
+  return root;
+}
+
+static VALUE build_s_body(VALUE arg)
+{
+  VALUE *args = (VALUE*)arg;
+  struct index_build b;
+  struct smbindex empty;
+  struct smbindex *idx;
+  char *root = (char*)args[0];
+  char *path = StringValuePtr(args[1]);
+
+  memset(&b, 0, sizeof(b));
+  memset(&empty, 0, sizeof(empty));
+  index_crawl(&b, &empty, root, path, args[2]);
+  if ((idx = index_load(path)) == NULL) {
+    index_load_fail(path);
+  }
+
+  return index_wrap(idx);
+}
+
+static VALUE free_ptr(VALUE ptr)
+{
+  free((void*)ptr);
+
+  return Qnil;
+}
+
+/*
+  SMB::Index.build(url, path, opts = {}) -> index
+
+  Crawls url on the worker pool (:threads) and writes the index to the
+  local file path.
+*/
+
+static VALUE smbindex_s_build(int argc, VALUE *argv, VALUE self)
+{
+  VALUE url;
+  VALUE path;
+  VALUE opts;
+  VALUE args[3];
+
+  rb_scan_args(argc, argv, "21", &url, &path, &opts);
+
+  StringValue(path);
+  args[0] = (VALUE)root_normalize(url);
+  args[1] = path;
+  args[2] = opts;
+
+  return rb_ensure(build_s_body, (VALUE)args, free_ptr, args[0]);
+}
+
+/*
+  SMB::Index.open(path) -> index
+*/
+
+static VALUE smbindex_s_open(VALUE self, VALUE path)
+{
+  struct smbindex *idx;
+
+  if ((idx = index_load(StringValuePtr(path))) == NULL) {
+    index_load_fail(StringValuePtr(path));
+  }
+
+  return index_wrap(idx);
+}
+
+static VALUE refresh_body(VALUE arg)
+{
+  VALUE *args = (VALUE*)arg;
+  struct smbindex *idx = (struct smbindex*)args[0];
+  struct smbindex *fresh;
+  struct index_build b;
+  VALUE summary;
+
+  memset(&b, 0, sizeof(b));
+  b.events = true;
+  b.yield = rb_block_given_p();
+  index_crawl(&b, idx, idx->root, idx->path, args[1]);
+  if ((fresh = index_load(idx->path)) == NULL) {
+    index_load_fail(idx->path);
+  }
+
+  free(idx->buf);
+  free(idx->end);
+  idx->buf = fresh->buf;
+  idx->end = fresh->end;
+  idx->recs = fresh->recs;
+  idx->names = fresh->names;
+  idx->count = fresh->count;
+  fresh->buf = NULL;
+  fresh->end = NULL;
+  index_free(fresh);
+
+  summary = rb_hash_new();
+  rb_hash_aset(summary, ID2SYM(rb_intern("added")), LONG2NUM(b.added));
+  rb_hash_aset(summary, ID2SYM(rb_intern("removed")), LONG2NUM(b.removed));
+  rb_hash_aset(summary, ID2SYM(rb_intern("modified")), LONG2NUM(b.modified));
+  rb_hash_aset(summary, ID2SYM(rb_intern("relisted")), LONG2NUM(b.relisted));
+  rb_hash_aset(summary, ID2SYM(rb_intern("errors")), b.errors);
+
+  return summary;
+}
+
+static VALUE refresh_done(VALUE arg)
+{
+  ((struct smbindex*)arg)->busy = false;
+
+  return Qnil;
+}
+
+/*
+  index.refresh(opts = {}) { |event, url, stat| ... } -> summary
+
+  Brings the index up to date. Only directories whose mtime changed are
+  listed again, so a file rewritten in place without touching its
+  directory isn't noticed. Yields :added, :removed or :modified for each
+  change and returns their counts, the number of directories listed and
+  any errors; directories that can't be read keep their old contents.
+*/
+
+static VALUE smbindex_refresh(int argc, VALUE *argv, VALUE self)
+{
+  struct smbindex *idx = index_get(self);
+  VALUE opts;
+  VALUE args[2];
+
+  rb_scan_args(argc, argv, "01", &opts);
+
+  if (idx->busy) {
+    rb_raise(eSmbError, "index is already being refreshed");
+  }
+  idx->busy = true;
+  args[0] = (VALUE)idx;
+  args[1] = opts;
+
+  return rb_ensure(refresh_body, (VALUE)args, refresh_done, (VALUE)idx);
+}
+
+static void range_opt(VALUE opts, const char *name, int64_t *lo, int64_t *hi)
+{
+  VALUE v = util_opt(opts, name);
+  VALUE beg, end;
+  int excl;
+
+  *lo = INT64_MIN;
+  *hi = INT64_MAX;
+  if (NIL_P(v)) {
+    return;
+  }
+  if (!rb_range_values(v, &beg, &end, &excl)) {
+    beg = end = v;
+    excl = 0;
+  }
+  if (rb_obj_is_kind_of(beg, rb_cTime)) {
+    beg = rb_funcall(beg, rb_intern("to_i"), 0);
+  }
+  if (rb_obj_is_kind_of(end, rb_cTime)) {
+    end = rb_funcall(end, rb_intern("to_i"), 0);
+  }
+  if (!NIL_P(beg)) {
+    *lo = NUM2LL(beg);
+  }
+  if (!NIL_P(end)) {
+    *hi = NUM2LL(end) - (excl ? 1 : 0);
+  }
+}
+
+/*
+  index.query(opts = {}) { |url, stat| ... }
+
+  Answers from the index alone. Options: :prefix (a url below the index
+  root, or a path relative to it), :size and :mtime (a Range, or a single
+  value; mtime takes Times or epoch seconds) and :type (:file or
+  :directory). Without a block returns the matches as [url, stat] pairs.
+*/
+
+static VALUE smbindex_query(int argc, VALUE *argv, VALUE self)
+{
+  struct smbindex *idx = index_get(self);
+  const struct index_rec *rec;
+  VALUE opts;
+  VALUE v;
+  VALUE result;
+  VALUE pair;
+  int64_t size_lo, size_hi;
+  int64_t mtime_lo, mtime_hi;
+  const char *prefix = "";
+  size_t plen;
+  size_t rootlen = strlen(idx->root);
+  long lo, hi, mid;
+  long i;
+  int type = 0;
+  char *url;
+
+  rb_scan_args(argc, argv, "01", &opts);
+
+  range_opt(opts, "size", &size_lo, &size_hi);
+  range_opt(opts, "mtime", &mtime_lo, &mtime_hi);
+  if (!NIL_P(v = util_opt(opts, "type"))) {
+    if (v == ID2SYM(rb_intern("file"))) {
+      type = 1;
+    }
+    else if (v == ID2SYM(rb_intern("directory"))) {
+      type = 2;
+    }
+    else {
+      rb_raise(rb_eArgError, "type must be :file or :directory");
+    }
+  }
+  if (!NIL_P(v = util_opt(opts, "prefix"))) {
+    prefix = StringValuePtr(v);
+    if (strncmp(prefix, idx->root, rootlen) == 0 &&
+	(prefix[rootlen] == '/' || prefix[rootlen] == '\0')) {
+      prefix += rootlen;
+    }
+    while (*prefix == '/') {
+      prefix++;
+    }
+  }
+  plen = strlen(prefix);
+  while (plen > 0 && prefix[plen - 1] == '/') {
+    plen--;
+  }
+
+  /* the prefix and everything below it form one run of records */
+  lo = 0;
+  hi = idx->count;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (path_cmp(REC_NAME(idx, mid), idx->recs[mid].len, prefix, plen) < 0) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+
+  result = (rb_block_given_p() ? Qnil : rb_ary_new());
+  for (i = lo; i < idx->count; i++) {
+    rec = &idx->recs[i];
+    if (plen > 0 &&
+	(rec->len < plen || memcmp(REC_NAME(idx, i), prefix, plen) != 0 ||
+	 (rec->len > plen && REC_NAME(idx, i)[plen] != '/'))) {
+      break;
+    }
+    if ((int64_t)rec->size < size_lo || (int64_t)rec->size > size_hi ||
+	rec->mtime < mtime_lo || rec->mtime > mtime_hi ||
+	(type == 1 && REC_DIR_P(idx, i)) || (type == 2 && !REC_DIR_P(idx, i))) {
+      continue;
+    }
+
+    url = malloc(rootlen + rec->len + 2);
+    memcpy(url, idx->root, rootlen);
+    if (rec->len > 0) {
+      url[rootlen] = '/';
+      memcpy(url + rootlen + 1, REC_NAME(idx, i), rec->len);
+      url[rootlen + 1 + rec->len] = '\0';
+    }
+    else {
+      url[rootlen] = '\0';
+    }
+    v = rb_str_new2(url);
+    free(url);
+
+    pair = rb_ary_new3(2, v, rec_stat(rec->type, rec->size, rec->mtime));
+    if (NIL_P(result)) {
+      rb_yield(pair);
+    }
+    else {
+      rb_ary_push(result, pair);
+    }
+  }
+
+  return NIL_P(result) ? self : result;
+}
+
+static VALUE smbindex_url(VALUE self)
+{
+  return rb_str_new2(index_get(self)->root);
+}
+
+static VALUE smbindex_path(VALUE self)
+{
+  return rb_str_new2(index_get(self)->path);
+}
+
+static VALUE smbindex_size(VALUE self)
+{
+  return LONG2NUM(index_get(self)->count);
+}
+
+void init_smbindex(void)
+{
+  cSmbIndex = rb_define_class_under(mSMB, "Index", rb_cObject);
+  rb_undef_alloc_func(cSmbIndex);
+  rb_define_singleton_method(cSmbIndex, "build", smbindex_s_build, -1);
+  rb_define_singleton_method(cSmbIndex, "open", smbindex_s_open, 1);
+  rb_define_method(cSmbIndex, "refresh", smbindex_refresh, -1);
+  rb_define_method(cSmbIndex, "query", smbindex_query, -1);
+  rb_define_method(cSmbIndex, "url", smbindex_url, 0);
+  rb_define_method(cSmbIndex, "path", smbindex_path, 0);
+  rb_define_method(cSmbIndex, "size", smbindex_size, 0);
+}
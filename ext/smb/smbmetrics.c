@@ -0,0 +1,453 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include <libsmbclient.h>
+#include <ruby.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "rubysmb.h"
+#include "smbmetrics.h"
+#include "smbtrace.h"
+
+/*
+  Latencies go into log-linear buckets in the spirit of HdrHistogram:
+  exact below 16us, then eight sub-buckets per power of two, which keeps
+  every bucket within 12.5% of the values it holds.
+*/
+
+#define METRICS_MAX_SERVERS 256
+#define METRICS_SUB_BITS 3
+#define METRICS_LINEAR 16
+#define METRICS_BUCKETS 256
+
+struct metrics_op {
+  uint64_t count;
+  uint64_t errors;
+  uint64_t bytes;
+  uint64_t total_us;
+  uint64_t buckets[METRICS_BUCKETS];
+};
+
+struct metrics_server {
+  struct metrics_op ops[METRIC_OPS];
+  uint64_t buffer_hits;
+  uint64_t buffer_misses;
+  char name[1];
+};
+
+static const char *op_names[METRIC_OPS] = {
+  "open", "read", "write", "lseek", "stat", "opendir", "readdir", "auth", "reopen"
+};
+
+static struct metrics_server *servers[METRICS_MAX_SERVERS];
+static int nservers = 0;
+static pthread_mutex_t servers_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool metrics_enabled = true;
+
+static struct metrics_server *server_new(const char *name, size_t len)
+{
+  struct metrics_server *srv;
+
+  srv = calloc(1, sizeof(struct metrics_server) + len);
+  memcpy(srv->name, name, len);
+  srv->name[len] = '\0';
+
+  return srv;
+}
+
+/*
+  Servers are only ever appended, and published after they are filled
+  in, so lookups need no lock. Past METRICS_MAX_SERVERS everything is
+  counted under the last slot, named "other".
+*/
+
+static struct metrics_server *server_lookup(const char *name, size_t len)
+{
+  struct metrics_server *srv;
+  int n = __sync_fetch_and_add(&nservers, 0);
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (strncmp(servers[i]->name, name, len) == 0 && servers[i]->name[len] == '\0') {
+      return servers[i];
+    }
+  }
+
+  pthread_mutex_lock(&servers_lock);
+  for (i = n; i < nservers; i++) {
+    if (strncmp(servers[i]->name, name, len) == 0 && servers[i]->name[len] == '\0') {
+      pthread_mutex_unlock(&servers_lock);
+      return servers[i];
+    }
+  }
+  if (nservers == METRICS_MAX_SERVERS - 1) {
+    name = "other";
+    len = 5;
+  }
+  if (nservers == METRICS_MAX_SERVERS) {
+    srv = servers[METRICS_MAX_SERVERS - 1];
+  }
+  else {
+    srv = server_new(name, len);
+    servers[nservers] = srv;
+    __sync_synchronize();
+    nservers++;
+  }
+  pthread_mutex_unlock(&servers_lock);
+
+  return srv;
+}
+
+struct metrics_server *metrics_server_named(const char *name)
+{
+  return server_lookup(name, strlen(name));
+}
+
+/* the server part of smb://[[domain;]user[:password]@]server[:port]/... */
+struct metrics_server *metrics_server(const char *url)
+{
+  const char *start;
+  const char *end;
+  const char *at;
+
+  start = (strncmp(url, "smb://", 6) == 0 ? url + 6 : url);
+  end = start + strcspn(start, "/");
+  for (at = end; at > start && at[-1] != '@'; at--);
+  if (at > start) {
+    start = at;
+  }
+  for (at = start; at < end && *at != ':'; at++);
+
+  return server_lookup(start, at - start);
+}
+
+const char *metrics_op_name(int op)
+{
+  return op_names[op];
+}
+
+uint64_t metrics_start(void)
+{
+  struct timespec ts;
+
+  if (!metrics_enabled && !trace_enabled()) {
+    return 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 + 1;
+}
+
+static int bucket_index(uint64_t us)
+{
+  int e;
+  int i;
+
+  if (us < METRICS_LINEAR) {
+    return us;
+  }
+  e = 63 - __builtin_clzll(us);
+  i = METRICS_LINEAR + (e - 4) * (1 << METRICS_SUB_BITS) +
+    (int)((us >> (e - METRICS_SUB_BITS)) & ((1 << METRICS_SUB_BITS) - 1));
+
+  return (i < METRICS_BUCKETS ? i : METRICS_BUCKETS - 1);
+}
+
+/* the largest value bucket i holds, in microseconds */
+static uint64_t bucket_upper(int i)
+{
+  int e;
+  int sub;
+
+  if (i < METRICS_LINEAR) {
+    return i;
+  }
+  e = (i - METRICS_LINEAR) / (1 << METRICS_SUB_BITS) + 4;
+  sub = (i - METRICS_LINEAR) % (1 << METRICS_SUB_BITS);
+
+  return ((uint64_t)((1 << METRICS_SUB_BITS) + sub + 1) << (e - METRICS_SUB_BITS)) - 1;
+}
+
+/*
+  Records one operation on url started at start (from metrics_start).
+  bytes is the amount transferred, or negative for a failure, in which
+  case errno is taken as its cause. errno is preserved.
+*/
+
+void metrics_end(struct metrics_server *srv, int op, const char *url,
+		 uint64_t start, int64_t bytes)
+{
+  struct metrics_op *m;
+  struct timespec ts;
+  uint64_t us;
+  int err = errno;
+
+  if (start == 0) {
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 + 1;
+  us = (us > start ? us - start : 0);
+  trace_op(op, url, us, bytes, (bytes < 0 ? err : 0));
+  if (!metrics_enabled || srv == NULL) {
+    errno = err;
+    return;
+  }
+  m = &srv->ops[op];
+  __sync_fetch_and_add(&m->count, 1);
+  __sync_fetch_and_add(&m->total_us, us);
+  __sync_fetch_and_add(&m->buckets[bucket_index(us)], 1);
+  if (bytes < 0) {
+    __sync_fetch_and_add(&m->errors, 1);
+  }
+  else if (bytes > 0) {
+    __sync_fetch_and_add(&m->bytes, bytes);
+  }
+  errno = err;
+}
+
+void metrics_buffer(struct metrics_server *srv, bool hit)
+{
+  if (!metrics_enabled || srv == NULL) {
+    return;
+  }
+  if (hit) {
+    __sync_fetch_and_add(&srv->buffer_hits, 1);
+  }
+  else {
+    __sync_fetch_and_add(&srv->buffer_misses, 1);
+  }
+}
+
+static uint64_t percentile(const struct metrics_op *m, double p)
+{
+  uint64_t want = (uint64_t)(m->count * p + 0.5);
+  uint64_t seen = 0;
+  int i;
+
+  if (want == 0) {
+    want = 1;
+  }
+  for (i = 0; i < METRICS_BUCKETS; i++) {
+    seen += m->buckets[i];
+    if (seen >= want) {
+      return bucket_upper(i);
+    }
+  }
+
+  return bucket_upper(METRICS_BUCKETS - 1);
+}
+
+static VALUE op_stats(const struct metrics_op *m)
+{
+  VALUE hash = rb_hash_new();
+  int i;
+  int max = 0;
+
+  for (i = 0; i < METRICS_BUCKETS; i++) {
+    if (m->buckets[i] > 0) {
+      max = i;
+    }
+  }
+  rb_hash_aset(hash, ID2SYM(rb_intern("count")), ULL2NUM(m->count));
+  rb_hash_aset(hash, ID2SYM(rb_intern("errors")), ULL2NUM(m->errors));
+  rb_hash_aset(hash, ID2SYM(rb_intern("bytes")), ULL2NUM(m->bytes));
+  rb_hash_aset(hash, ID2SYM(rb_intern("time")), rb_float_new(m->total_us / 1e6));
+  rb_hash_aset(hash, ID2SYM(rb_intern("p50")), rb_float_new(percentile(m, 0.5) / 1e6));
+  rb_hash_aset(hash, ID2SYM(rb_intern("p90")), rb_float_new(percentile(m, 0.9) / 1e6));
+  rb_hash_aset(hash, ID2SYM(rb_intern("p99")), rb_float_new(percentile(m, 0.99) / 1e6));
+  rb_hash_aset(hash, ID2SYM(rb_intern("max")), rb_float_new(bucket_upper(max) / 1e6));
+
+  return hash;
+}
+
+/*
+  SMB.stats -> { server => { op => { :count, :errors, :bytes, :time,
+  :p50, :p90, :p99, :max }, :buffer => { :hits, :misses } } }
+
+  Times are in seconds; percentiles are bucket upper bounds. Operations
+  that never ran are left out.
+*/
+
+static VALUE smb_s_stats(VALUE self)
+{
+  VALUE result = rb_hash_new();
+  VALUE server;
+  VALUE buffer;
+  struct metrics_server *srv;
+  int n = __sync_fetch_and_add(&nservers, 0);
+  int i;
+  int op;
+
+  for (i = 0; i < n; i++) {
+    srv = servers[i];
+    server = rb_hash_new();
+    for (op = 0; op < METRIC_OPS; op++) {
+      if (srv->ops[op].count > 0) {
+	rb_hash_aset(server, ID2SYM(rb_intern(op_names[op])), op_stats(&srv->ops[op]));
+      }
+    }
+    buffer = rb_hash_new();
+    rb_hash_aset(buffer, ID2SYM(rb_intern("hits")), ULL2NUM(srv->buffer_hits));
+    rb_hash_aset(buffer, ID2SYM(rb_intern("misses")), ULL2NUM(srv->buffer_misses));
+    rb_hash_aset(server, ID2SYM(rb_intern("buffer")), buffer);
+    rb_hash_aset(result, rb_str_new2(srv->name), server);
+  }
+
+  return result;
+}
+
+static void prom_line(VALUE out, const char *fmt, ...)
+{
+  char buf[512];
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  rb_str_cat2(out, buf);
+}
+
+/*
+  SMB.stats_prometheus -> String in the Prometheus text exposition format.
+  The fine buckets are folded into a fixed set of le bounds.
+*/
+
+static VALUE smb_s_stats_prometheus(VALUE self)
+{
+  static const uint64_t bounds[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+    250000, 500000, 1000000, 2500000, 5000000, 10000000
+  };
+  const int nbounds = sizeof(bounds) / sizeof(bounds[0]);
+  VALUE out = rb_str_new2("");
+  struct metrics_server *srv;
+  struct metrics_op *m;
+  uint64_t cum;
+  int n = __sync_fetch_and_add(&nservers, 0);
+  int i, op, b, k;
+
+  rb_str_cat2(out, "# TYPE smb_operations_total counter\n");
+  for (i = 0; i < n; i++) {
+    for (op = 0; op < METRIC_OPS; op++) {
+      if (servers[i]->ops[op].count > 0) {
+	prom_line(out, "smb_operations_total{server=\"%s\",op=\"%s\"} %llu\n",
+		  servers[i]->name, op_names[op], (unsigned long long)servers[i]->ops[op].count);
+      }
+    }
+  }
+  rb_str_cat2(out, "# TYPE smb_operation_errors_total counter\n");
+  for (i = 0; i < n; i++) {
+    for (op = 0; op < METRIC_OPS; op++) {
+      if (servers[i]->ops[op].count > 0) {
+	prom_line(out, "smb_operation_errors_total{server=\"%s\",op=\"%s\"} %llu\n",
+		  servers[i]->name, op_names[op], (unsigned long long)servers[i]->ops[op].errors);
+      }
+    }
+  }
+  rb_str_cat2(out, "# TYPE smb_bytes_total counter\n");
+  for (i = 0; i < n; i++) {
+    prom_line(out, "smb_bytes_total{server=\"%s\",direction=\"read\"} %llu\n",
+	      servers[i]->name, (unsigned long long)servers[i]->ops[METRIC_READ].bytes);
+    prom_line(out, "smb_bytes_total{server=\"%s\",direction=\"write\"} %llu\n",
+	      servers[i]->name, (unsigned long long)servers[i]->ops[METRIC_WRITE].bytes);
+  }
+  rb_str_cat2(out, "# TYPE smb_buffer_hits_total counter\n");
+  for (i = 0; i < n; i++) {
+    prom_line(out, "smb_buffer_hits_total{server=\"%s\"} %llu\n",
+	      servers[i]->name, (unsigned long long)servers[i]->buffer_hits);
+  }
+  rb_str_cat2(out, "# TYPE smb_buffer_misses_total counter\n");
+  for (i = 0; i < n; i++) {
+    prom_line(out, "smb_buffer_misses_total{server=\"%s\"} %llu\n",
+	      servers[i]->name, (unsigned long long)servers[i]->buffer_misses);
+  }
+
+  rb_str_cat2(out, "# TYPE smb_operation_duration_seconds histogram\n");
+  for (i = 0; i < n; i++) {
+    srv = servers[i];
+    for (op = 0; op < METRIC_OPS; op++) {
+      m = &srv->ops[op];
+      if (m->count == 0) {
+	continue;
+      }
+      cum = 0;
+      k = 0;
+      for (b = 0; b < nbounds; b++) {
+	for (; k < METRICS_BUCKETS && bucket_upper(k) <= bounds[b]; k++) {
+	  cum += m->buckets[k];
+	}
+	prom_line(out, "smb_operation_duration_seconds_bucket{server=\"%s\",op=\"%s\",le=\"%g\"} %llu\n",
+		  srv->name, op_names[op], bounds[b] / 1e6, (unsigned long long)cum);
+      }
+      prom_line(out, "smb_operation_duration_seconds_bucket{server=\"%s\",op=\"%s\",le=\"+Inf\"} %llu\n",
+		srv->name, op_names[op], (unsigned long long)m->count);
+      prom_line(out, "smb_operation_duration_seconds_sum{server=\"%s\",op=\"%s\"} %.6f\n",
+		srv->name, op_names[op], m->total_us / 1e6);
+      prom_line(out, "smb_operation_duration_seconds_count{server=\"%s\",op=\"%s\"} %llu\n",
+		srv->name, op_names[op], (unsigned long long)m->count);
+    }
+  }
+
+  return out;
+}
+
+/* clears the numbers but keeps the servers, which open files point at */
+static VALUE smb_s_reset_stats(VALUE self)
+{
+  int n = __sync_fetch_and_add(&nservers, 0);
+  int i;
+
+  for (i = 0; i < n; i++) {
+    memset(servers[i]->ops, 0, sizeof(servers[i]->ops));
+    servers[i]->buffer_hits = 0;
+    servers[i]->buffer_misses = 0;
+  }
+
+  return Qnil;
+}
+
+static VALUE smb_s_enable_stats(VALUE self)
+{
+  metrics_enabled = true;
+
+  return Qnil;
+}
+
+static VALUE smb_s_disable_stats(VALUE self)
+{
+  metrics_enabled = false;
+
+  return Qnil;
+}
+
+void init_smbmetrics(void)
+{
+  rb_define_module_function(mSMB, "stats", smb_s_stats, 0);
+  rb_define_module_function(mSMB, "stats_prometheus", smb_s_stats_prometheus, 0);
+  rb_define_module_function(mSMB, "reset_stats", smb_s_reset_stats, 0);
+  rb_define_module_function(mSMB, "enable_stats", smb_s_enable_stats, 0);
+  rb_define_module_function(mSMB, "disable_stats", smb_s_disable_stats, 0);
+}
@@ -0,0 +1,57 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef RUBYSMB_SMBMETRICS_H
+#define RUBYSMB_SMBMETRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+  Per-server operation counters and latency histograms. Recording is a
+  few atomic adds, safe from any thread, and costs two clock reads per
+  operation while metrics or tracing are enabled (metrics are by
+  default). metrics_end also hands every operation to smbtrace.
+*/
+
+enum {
+  METRIC_OPEN,
+  METRIC_READ,
+  METRIC_WRITE,
+  METRIC_LSEEK,
+  METRIC_STAT,
+  METRIC_OPENDIR,
+  METRIC_READDIR,
+  METRIC_AUTH,
+  METRIC_REOPEN,
+  METRIC_OPS
+};
+
+struct metrics_server;
+
+struct metrics_server *metrics_server(const char*);
+struct metrics_server *metrics_server_named(const char*);
+uint64_t metrics_start(void);
+void metrics_end(struct metrics_server*, int, const char*, uint64_t, int64_t);
+const char *metrics_op_name(int);
+void metrics_buffer(struct metrics_server*, bool);
+void init_smbmetrics(void);
+
+#endif
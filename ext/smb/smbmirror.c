@@ -0,0 +1,1089 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+/* for SEEK_DATA and SEEK_HOLE, before anything pulls in unistd.h */
+#define _GNU_SOURCE 1
+
+#include <libsmbclient.h>
+#include <ruby.h>
+#include <ruby/thread.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "rubysmb.h"
+#include "smbbufpool.h"
+#include "smbctx.h"
+#include "smbmirror.h"
+#include "smbpool.h"
+#include "smbutil.h"
+
+/*
+  SMB.mirror(src, dest) makes dest look like src, where one side is an
+  smb:// url and the other a local directory.
+
+  Both trees are scanned at the same time, the share on the worker pool
+  and the local side on a thread of its own, into plain arrays of
+  (relative path, type, size, mtime). Those are sorted and merged, and
+  only files that differ in size or mtime (or content, with :checksum)
+  are copied, again on the pool. Copied files get the source mtime, so
+  the next run skips them.
+
+  Copies are sparse: the destination is sized up front and only blocks
+  with data are written, so the holes of a local source (found with
+  SEEK_DATA/SEEK_HOLE) and runs of zeros are never sent.
+*/
+
+#define MIRROR_BUFSIZE (1024 * 1024)
+/* granularity of zero detection; a multiple of any sane allocation unit */
+#define MIRROR_ZERO_BLOCK 65536
+
+enum {
+  MIRROR_SCAN,
+  MIRROR_COPY,
+  MIRROR_DELETE
+};
+
+struct mirror_ent {
+  char *path;
+  bool dir;
+  off_t size;
+  time_t mtime;
+};
+
+struct mirror_list {
+  pthread_mutex_t lock;
+  struct mirror_ent *ents;
+  size_t count;
+  size_t cap;
+};
+
+struct mirror_err {
+  struct mirror_err *next;
+  int err;
+  char path[1];
+};
+
+struct mirror_task {
+  struct pool_item item;
+  int kind;
+  bool verify;
+  off_t size;
+  time_t mtime;
+  char path[1];
+};
+
+struct mirror_result {
+  struct pool_item item;
+  int kind;
+  int err;
+  bool copied;
+  off_t bytes;
+  off_t sparse;
+  char path[1];
+};
+
+struct mirror_state {
+  struct smbpool *pool;
+  struct mirror_result *current;
+  char *remote;
+  char *local;
+  bool download;
+  bool checksum;
+  bool delete;
+  bool dry_run;
+  bool sparse;
+  time_t window;
+  int nthreads;
+  struct mirror_list src;
+  struct mirror_list dst;
+  pthread_mutex_t err_lock;
+  struct mirror_err *errors;
+  pthread_t local_thread;
+  bool local_running;
+  bool remote_missing;
+  volatile bool src_incomplete;
+  volatile bool cancel;
+  long copied;
+  long skipped;
+  long deleted;
+  long dirs;
+  off_t bytes;
+  off_t sparse_bytes;
+};
+
+/* the remote and local lists, by side */
+#define REMOTE_LIST(st) ((st)->download ? &(st)->src : &(st)->dst)
+#define LOCAL_LIST(st) ((st)->download ? &(st)->dst : &(st)->src)
+
+static void list_add(struct mirror_list *list, const char *path, bool dir, off_t size, time_t mtime)
+{
+  struct mirror_ent *ent;
+
+  pthread_mutex_lock(&list->lock);
+  if (list->count == list->cap) {
+    list->cap = (list->cap == 0 ? 256 : list->cap * 2);
+    list->ents = realloc(list->ents, list->cap * sizeof(struct mirror_ent));
+  }
+  ent = &list->ents[list->count++];
+  ent->path = strdup(path);
+  ent->dir = dir;
+  ent->size = size;
+  ent->mtime = mtime;
+  pthread_mutex_unlock(&list->lock);
+}
+
+static void list_free(struct mirror_list *list)
+{
+  size_t i;
+
+  for (i = 0; i < list->count; i++) {
+    free(list->ents[i].path);
+  }
+  free(list->ents);
+  list->ents = NULL;
+  list->count = list->cap = 0;
+}
+
+static int ent_cmp(const void *a, const void *b)
+{
+  return strcmp(((const struct mirror_ent*)a)->path, ((const struct mirror_ent*)b)->path);
+}
+
+static void mirror_error(struct mirror_state *state, const char *path, int err)
+{
+  struct mirror_err *e = malloc(sizeof(struct mirror_err) + strlen(path));
+
+  strcpy(e->path, path);
+  e->err = err;
+  pthread_mutex_lock(&state->err_lock);
+  e->next = state->errors;
+  state->errors = e;
+  pthread_mutex_unlock(&state->err_lock);
+}
+
+/* root + "/" + rel, or just root for the empty relative path */
+static char *mirror_path(const char *root, const char *rel)
+{
+  return (*rel == '\0' ? strdup(root) : ctx_url_join(root, rel));
+}
+
+static char *rel_join(const char *rel, const char *name)
+{
+  return (*rel == '\0' ? strdup(name) : ctx_url_join(rel, name));
+}
+
+static struct mirror_task *task_new(int kind, const char *path)
+{
+  struct mirror_task *task = malloc(sizeof(struct mirror_task) + strlen(path));
+
+  task->kind = kind;
+  task->verify = false;
+  task->size = 0;
+  task->mtime = 0;
+  strcpy(task->path, path);
+
+  return task;
+}
+
+/*
+  Scanning
+*/
+
+/* whatever couldn't be listed on the source side keeps :delete away */
+static void scan_error(struct mirror_state *state, const char *rel, int err, bool remote)
+{
+  mirror_error(state, rel, err);
+  if (state->download == remote) {
+    state->src_incomplete = true;
+  }
+}
+
+static void scan_remote(struct smbpool *pool, SMBCCTX *ctx, struct mirror_task *task)
+{
+  struct mirror_state *state = pool->data;
+  struct mirror_list *list = REMOTE_LIST(state);
+  struct smbc_dirent *ent;
+  struct stat st;
+  SMBCFILE *dh;
+  char *url;
+  char *rel;
+
+  url = mirror_path(state->remote, task->path);
+  dh = smbc_getFunctionOpendir(ctx)(ctx, url);
+  if (dh == NULL) {
+    scan_error(state, task->path, errno, true);
+    free(url);
+    return;
+  }
+#ifdef HAVE_SMBC_READDIRPLUS2
+  /* one round trip per directory instead of a stat per file */
+  {
+    const struct libsmb_file_info *info;
+
+    for (errno = 0; (info = smbc_getFunctionReaddirPlus2(ctx)(ctx, dh, &st)) != NULL && !state->cancel; errno = 0) {
+      if (strcmp(info->name, ".") == 0 || strcmp(info->name, "..") == 0) {
+	continue;
+      }
+      rel = rel_join(task->path, info->name);
+      if (S_ISDIR(st.st_mode)) {
+	list_add(list, rel, true, 0, 0);
+	pool_push(pool, &task_new(MIRROR_SCAN, rel)->item);
+      }
+      else {
+	list_add(list, rel, false, st.st_size, st.st_mtime);
+      }
+      free(rel);
+    }
+    if (info == NULL && errno != 0) {
+      scan_error(state, task->path, errno, true);
+    }
+    smbc_getFunctionClosedir(ctx)(ctx, dh);
+    free(url);
+    return;
+  }
+#endif
+  for (errno = 0; (ent = smbc_getFunctionReaddir(ctx)(ctx, dh)) != NULL && !state->cancel; errno = 0) {
+    if (strcmp(ent->name, ".") == 0 || strcmp(ent->name, "..") == 0) {
+      continue;
+    }
+    if (ent->smbc_type != SMBC_FILE && ent->smbc_type != SMBC_DIR) {
+      continue;
+    }
+    rel = rel_join(task->path, ent->name);
+    if (ent->smbc_type == SMBC_DIR) {
+      list_add(list, rel, true, 0, 0);
+      pool_push(pool, &task_new(MIRROR_SCAN, rel)->item);
+    }
+    else {
+      char *fileurl = ctx_url_join(url, ent->name);
+
+      if (smbc_getFunctionStat(ctx)(ctx, fileurl, &st) == 0) {
+	list_add(list, rel, false, st.st_size, st.st_mtime);
+      }
+      else {
+	scan_error(state, rel, errno, true);
+      }
+      free(fileurl);
+    }
+    free(rel);
+  }
+  if (ent == NULL && errno != 0) {
+    scan_error(state, task->path, errno, true);
+  }
+  smbc_getFunctionClosedir(ctx)(ctx, dh);
+  free(url);
+}
+
+static void scan_local_dir(struct mirror_state *state, const char *rel)
+{
+  struct mirror_list *list = LOCAL_LIST(state);
+  struct dirent *ent;
+  struct stat st;
+  DIR *dh;
+  char *path;
+  char *child;
+  char *childrel;
+
+  path = mirror_path(state->local, rel);
+  if ((dh = opendir(path)) == NULL) {
+    /* a local destination that doesn't exist yet is fine */
+    if (!state->download || errno != ENOENT || *rel != '\0') {
+      scan_error(state, rel, errno, false);
+    }
+    free(path);
+    return;
+  }
+  for (errno = 0; (ent = readdir(dh)) != NULL && !state->cancel; errno = 0) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+    child = ctx_url_join(path, ent->d_name);
+    childrel = rel_join(rel, ent->d_name);
+    if (lstat(child, &st) < 0) {
+      scan_error(state, childrel, errno, false);
+    }
+    else if (S_ISDIR(st.st_mode)) {
+      list_add(list, childrel, true, 0, 0);
+      scan_local_dir(state, childrel);
+    }
+    else if (S_ISREG(st.st_mode)) {
+      list_add(list, childrel, false, st.st_size, st.st_mtime);
+    }
+    free(child);
+    free(childrel);
+  }
+  if (ent == NULL && errno != 0) {
+    scan_error(state, rel, errno, false);
+  }
+  closedir(dh);
+  free(path);
+}
+
+static void *scan_local(void *p)
+{
+  scan_local_dir(p, "");
+
+  return NULL;
+}
+
+/*
+  Transfers
+*/
+
+struct mfile {
+  SMBCCTX *ctx;
+  SMBCFILE *fh;
+  int fd;
+};
+
+static bool mfile_open(struct mfile *f, SMBCCTX *ctx, const char *path, bool remote, int flags)
+{
+  f->ctx = (remote ? ctx : NULL);
+  f->fh = NULL;
+  f->fd = -1;
+  if (remote) {
+    f->fh = smbc_getFunctionOpen(ctx)(ctx, path, flags, 0644);
+    return f->fh != NULL;
+  }
+  f->fd = open(path, flags, 0644);
+
+  return f->fd >= 0;
+}
+
+static ssize_t mfile_read(struct mfile *f, char *buf, size_t len)
+{
+  if (f->ctx != NULL) {
+    return smbc_getFunctionRead(f->ctx)(f->ctx, f->fh, buf, len);
+  }
+
+  return read(f->fd, buf, len);
+}
+
+static ssize_t mfile_write(struct mfile *f, const char *buf, size_t len)
+{
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < len) {
+    if (f->ctx != NULL) {
+      n = smbc_getFunctionWrite(f->ctx)(f->ctx, f->fh, buf + done, len - done);
+    }
+    else {
+      n = write(f->fd, buf + done, len - done);
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    done += n;
+  }
+
+  return (ssize_t)done;
+}
+
+static off_t mfile_lseek(struct mfile *f, off_t offset, int whence)
+{
+  if (f->ctx != NULL) {
+    return smbc_getFunctionLseek(f->ctx)(f->ctx, f->fh, offset, whence);
+  }
+
+  return lseek(f->fd, offset, whence);
+}
+
+static int mfile_truncate(struct mfile *f, off_t size)
+{
+  if (f->ctx != NULL) {
+    return smbc_getFunctionFtruncate(f->ctx)(f->ctx, f->fh, size);
+  }
+
+  return ftruncate(f->fd, size);
+}
+
+static int mfile_close(struct mfile *f)
+{
+  if (f->ctx != NULL) {
+    return (f->fh != NULL ? smbc_getFunctionClose(f->ctx)(f->ctx, f->fh) : 0);
+  }
+
+  return (f->fd >= 0 ? close(f->fd) : 0);
+}
+
+static int set_mtime(SMBCCTX *ctx, const char *path, bool remote, time_t mtime)
+{
+  struct timeval tv[2];
+
+  tv[0].tv_sec = tv[1].tv_sec = mtime;
+  tv[0].tv_usec = tv[1].tv_usec = 0;
+  if (remote) {
+    return smbc_getFunctionUtimes(ctx)(ctx, path, tv);
+  }
+
+  return utimes(path, tv);
+}
+
+/* FNV-1a over the whole file, 0 on success */
+static int checksum(SMBCCTX *ctx, const char *path, bool remote, char *buf, uint64_t *sum)
+{
+  struct mfile f;
+  uint64_t h = 14695981039346656037ULL;
+  ssize_t n;
+  ssize_t i;
+
+  if (!mfile_open(&f, ctx, path, remote, O_RDONLY)) {
+    return -1;
+  }
+  while ((n = mfile_read(&f, buf, MIRROR_BUFSIZE)) > 0) {
+    for (i = 0; i < n; i++) {
+      h ^= (unsigned char)buf[i];
+      h *= 1099511628211ULL;
+    }
+  }
+  mfile_close(&f);
+  *sum = h;
+
+  return (n < 0 ? -1 : 0);
+}
+
+/* comparing the block with itself one byte on lets libc's memcmp use SIMD */
+static bool is_zero(const char *p, size_t len)
+{
+  return len == 0 || (p[0] == 0 && memcmp(p, p + 1, len - 1) == 0);
+}
+
+/*
+  Writes the n bytes read from offset off, skipping zero blocks; out
+  is at *outpos and only seeks when a block was skipped.
+*/
+
+static int copy_block(struct mfile *out, const char *buf, size_t n, off_t off,
+		      off_t *outpos, struct mirror_result *r)
+{
+  size_t i = 0;
+  size_t start;
+  size_t len = 0;
+
+  while (i < n) {
+    start = i;
+    while (i < n) {
+      len = (n - i < MIRROR_ZERO_BLOCK ? n - i : MIRROR_ZERO_BLOCK);
+      if (is_zero(buf + i, len)) {
+	break;
+      }
+      i += len;
+    }
+    if (i > start) {
+      if (*outpos != off + (off_t)start && mfile_lseek(out, off + start, SEEK_SET) < 0) {
+	return -1;
+      }
+      if (mfile_write(out, buf + start, i - start) < 0) {
+	return -1;
+      }
+      *outpos = off + i;
+    }
+    if (i < n) {
+      r->sparse += len;
+      i += len;
+    }
+  }
+
+  return 0;
+}
+
+/*
+  Copies in to the empty out. A local source is read extent by extent;
+  where the filesystem doesn't know SEEK_DATA (EINVAL) the whole file
+  is one extent. The destination gets the source size first, so what
+  isn't written stays a hole on servers and filesystems that do them.
+*/
+
+static int copy_sparse(struct mirror_state *state, struct mfile *in, struct mfile *out,
+		       off_t size, char *buf, struct mirror_result *r)
+{
+  off_t pos = 0;
+  off_t outpos = 0;
+  off_t extent_end = -1;
+  size_t want;
+  ssize_t n;
+
+  if (in->ctx == NULL && (size = lseek(in->fd, 0, SEEK_END)) < 0) {
+    return -1;
+  }
+  if (size > 0 && mfile_truncate(out, size) < 0) {
+    return -1;
+  }
+  if (in->ctx == NULL && lseek(in->fd, 0, SEEK_SET) < 0) {
+    return -1;
+  }
+  while (!state->cancel) {
+#ifdef SEEK_DATA
+    if (in->ctx == NULL && extent_end >= 0 && pos >= extent_end) {
+      extent_end = -1;
+    }
+    if (in->ctx == NULL && extent_end < 0 && pos < size) {
+      off_t next;
+
+      if ((next = lseek(in->fd, pos, SEEK_DATA)) < 0) {
+	if (errno == ENXIO) {
+	  /* nothing but a hole up to the end */
+	  r->sparse += size - pos;
+	  r->bytes += size - pos;
+	  pos = size;
+	  break;
+	}
+	if (errno != EINVAL) {
+	  return -1;
+	}
+	extent_end = size;
+      }
+      else {
+	r->sparse += next - pos;
+	r->bytes += next - pos;
+	pos = next;
+	if ((extent_end = lseek(in->fd, pos, SEEK_HOLE)) < 0 ||
+	    lseek(in->fd, pos, SEEK_SET) < 0) {
+	  return -1;
+	}
+      }
+    }
+#endif
+    want = MIRROR_BUFSIZE;
+    if (extent_end > pos && extent_end - pos < (off_t)want) {
+      want = extent_end - pos;
+    }
+    if ((n = mfile_read(in, buf, want)) <= 0) {
+      if (n < 0) {
+	return -1;
+      }
+      break;
+    }
+    if (copy_block(out, buf, n, pos, &outpos, r) < 0) {
+      return -1;
+    }
+    pos += n;
+    r->bytes += n;
+  }
+  /* the source may have changed size since it was scanned */
+  if (!state->cancel && pos != size && mfile_truncate(out, pos) < 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static void copy_file(struct smbpool *pool, SMBCCTX *ctx, struct mirror_task *task,
+		      struct mirror_result *r)
+{
+  struct mirror_state *state = pool->data;
+  struct mfile in;
+  struct mfile out;
+  char *src;
+  char *dst;
+  char *buf;
+  size_t bufcap;
+  ssize_t n;
+
+  src = mirror_path(state->download ? state->remote : state->local, task->path);
+  dst = mirror_path(state->download ? state->local : state->remote, task->path);
+  buf = bufpool_get(MIRROR_BUFSIZE, &bufcap);
+
+  if (task->verify) {
+    uint64_t a;
+    uint64_t b;
+
+    if (checksum(ctx, src, state->download, buf, &a) == 0 &&
+	checksum(ctx, dst, !state->download, buf, &b) == 0 && a == b) {
+      set_mtime(ctx, dst, !state->download, task->mtime);
+      goto out;
+    }
+  }
+
+  if (!mfile_open(&in, ctx, src, state->download, O_RDONLY)) {
+    r->err = errno;
+    goto out;
+  }
+  if (!mfile_open(&out, ctx, dst, !state->download, O_WRONLY | O_CREAT | O_TRUNC)) {
+    r->err = errno;
+    mfile_close(&in);
+    goto out;
+  }
+  if (state->sparse) {
+    if (copy_sparse(state, &in, &out, task->size, buf, r) < 0 && !state->cancel) {
+      r->err = (errno != 0 ? errno : EIO);
+    }
+  }
+  else {
+    while ((n = mfile_read(&in, buf, MIRROR_BUFSIZE)) > 0 && !state->cancel) {
+      if (mfile_write(&out, buf, n) < 0) {
+	break;
+      }
+      r->bytes += n;
+    }
+    if (n != 0 && !state->cancel) {
+      r->err = (errno != 0 ? errno : EIO);
+    }
+  }
+  mfile_close(&in);
+  if (mfile_close(&out) < 0 && r->err == 0) {
+    r->err = errno;
+  }
+  if (state->cancel && r->err == 0) {
+    r->err = ECANCELED;
+  }
+  if (r->err != 0) {
+    /*
+      The destination was sized up front, so a partial copy would pass
+      for a finished one once it got the source mtime. Don't leave it.
+    */
+    if (state->download) {
+      unlink(dst);
+    }
+    else {
+      smbc_getFunctionUnlink(ctx)(ctx, dst);
+    }
+  }
+  else {
+    set_mtime(ctx, dst, !state->download, task->mtime);
+    r->copied = true;
+  }
+
+ out:
+  bufpool_put(buf, bufcap);
+  free(src);
+  free(dst);
+}
+
+static void mirror_run_task(struct smbpool *pool, SMBCCTX *ctx, struct pool_item *item)
+{
+  struct mirror_task *task = (struct mirror_task*)item;
+  struct mirror_state *state = pool->data;
+  struct mirror_result *r;
+  char *path;
+
+  if (task->kind == MIRROR_SCAN) {
+    scan_remote(pool, ctx, task);
+    free(task);
+    return;
+  }
+
+  r = malloc(sizeof(struct mirror_result) + strlen(task->path));
+  r->kind = task->kind;
+  r->err = 0;
+  r->copied = false;
+  r->bytes = 0;
+  strcpy(r->path, task->path);
+
+  if (task->kind == MIRROR_COPY) {
+    errno = 0;
+    copy_file(pool, ctx, task, r);
+  }
+  else {
+    path = mirror_path(state->download ? state->local : state->remote, task->path);
+    if ((state->download ? unlink(path) : smbc_getFunctionUnlink(ctx)(ctx, path)) < 0) {
+      r->err = errno;
+    }
+    free(path);
+  }
+  free(task);
+  pool_emit(pool, &r->item);
+}
+
+/*
+  Runs with the GVL released until the local scan thread is done.
+*/
+
+static void *join_local(void *p)
+{
+  struct mirror_state *state = p;
+
+  pthread_join(state->local_thread, NULL);
+  state->local_running = false;
+
+  return NULL;
+}
+
+static void cancel_local(void *p)
+{
+  ((struct mirror_state*)p)->cancel = true;
+}
+
+static VALUE mirror_drain(struct mirror_state *state)
+{
+  struct mirror_result *r;
+  char *url;
+
+  while ((r = (struct mirror_result*)pool_next(state->pool)) != NULL) {
+    state->current = r;
+    if (r->err != 0) {
+      mirror_error(state, r->path, r->err);
+    }
+    else if (r->kind == MIRROR_COPY) {
+      if (r->copied) {
+	state->copied++;
+	state->bytes += r->bytes;
+	state->sparse_bytes += r->sparse;
+      }
+      else {
+	state->skipped++;
+      }
+    }
+    else {
+      state->deleted++;
+    }
+    if (!state->download) {
+      url = mirror_path(state->remote, r->path);
+      smb_invalidate(url);
+      free(url);
+    }
+    state->current = NULL;
+    free(r);
+  }
+
+  return Qnil;
+}
+
+static void mirror_mkdir(struct mirror_state *state, const char *rel)
+{
+  char *path = mirror_path(state->download ? state->local : state->remote, rel);
+  int ret;
+
+  if (state->download) {
+    ret = mkdir(path, 0755);
+  }
+  else {
+    ret = smbc_mkdir(path, 0755);
+    smb_invalidate(path);
+  }
+  if (ret < 0 && errno != EEXIST) {
+    mirror_error(state, rel, errno);
+  }
+  else {
+    state->dirs++;
+  }
+  free(path);
+}
+
+static void mirror_rmdir(struct mirror_state *state, const char *rel)
+{
+  char *path = mirror_path(state->download ? state->local : state->remote, rel);
+  int ret;
+
+  if (state->download) {
+    ret = rmdir(path);
+  }
+  else {
+    ret = smbc_rmdir(path);
+    smb_invalidate_tree(path);
+  }
+  if (ret < 0) {
+    mirror_error(state, rel, errno);
+  }
+  else {
+    state->deleted++;
+  }
+  free(path);
+}
+
+static VALUE mirror_run(VALUE arg)
+{
+  struct mirror_state *state = (struct mirror_state*)arg;
+  struct mirror_ent *s;
+  struct mirror_ent *d;
+  struct mirror_task *task;
+  size_t i;
+  size_t j;
+  int cmp;
+
+  state->pool = pool_new(state->nthreads, mirror_run_task, state);
+
+  if (pthread_create(&state->local_thread, NULL, scan_local, state) != 0) {
+    rb_raise(eSmbError, "can't start scanner thread");
+  }
+  state->local_running = true;
+  if (!state->remote_missing) {
+    pool_push(state->pool, &task_new(MIRROR_SCAN, "")->item);
+    pool_next(state->pool);
+  }
+  rb_thread_call_without_gvl(join_local, state, cancel_local, state);
+  rb_thread_check_ints();
+
+  qsort(state->src.ents, state->src.count, sizeof(struct mirror_ent), ent_cmp);
+  qsort(state->dst.ents, state->dst.count, sizeof(struct mirror_ent), ent_cmp);
+
+  /* never delete on the strength of a source we couldn't read completely */
+  if (state->src_incomplete) {
+    state->delete = false;
+  }
+  if (state->download && !state->dry_run) {
+    mkdir(state->local, 0755);
+  }
+
+  /* directories are made here, in order, so parents come first */
+  for (i = j = 0; i < state->src.count || j < state->dst.count; ) {
+    s = (i < state->src.count ? &state->src.ents[i] : NULL);
+    d = (j < state->dst.count ? &state->dst.ents[j] : NULL);
+    cmp = (s == NULL ? 1 : d == NULL ? -1 : strcmp(s->path, d->path));
+
+    if (cmp < 0) {
+      if (s->dir) {
+	if (!state->dry_run) {
+	  mirror_mkdir(state, s->path);
+	}
+	else {
+	  state->dirs++;
+	}
+      }
+      else if (!state->dry_run) {
+	task = task_new(MIRROR_COPY, s->path);
+	task->size = s->size;
+	task->mtime = s->mtime;
+	pool_push(state->pool, &task->item);
+      }
+      else {
+	state->copied++;
+	state->bytes += s->size;
+      }
+      i++;
+    }
+    else if (cmp > 0) {
+      if (state->delete && !d->dir) {
+	if (!state->dry_run) {
+	  pool_push(state->pool, &task_new(MIRROR_DELETE, d->path)->item);
+	}
+	else {
+	  state->deleted++;
+	}
+      }
+      j++;
+    }
+    else {
+      if (s->dir != d->dir) {
+	mirror_error(state, s->path, s->dir ? ENOTDIR : EISDIR);
+      }
+      else if (!s->dir) {
+	bool differs = s->size != d->size ||
+	  (s->mtime > d->mtime ? s->mtime - d->mtime : d->mtime - s->mtime) > state->window;
+
+	if (!differs) {
+	  state->skipped++;
+	}
+	else if (state->dry_run) {
+	  state->copied++;
+	  state->bytes += s->size;
+	}
+	else {
+	  task = task_new(MIRROR_COPY, s->path);
+	  task->size = s->size;
+	  task->mtime = s->mtime;
+	  task->verify = state->checksum && s->size == d->size;
+	  pool_push(state->pool, &task->item);
+	}
+      }
+      i++;
+      j++;
+    }
+  }
+  mirror_drain(state);
+
+  /* emptied directories go last, deepest first */
+  if (state->delete) {
+    for (j = state->dst.count; j > 0; j--) {
+      d = &state->dst.ents[j - 1];
+      if (d->dir && bsearch(d, state->src.ents, state->src.count,
+			    sizeof(struct mirror_ent), ent_cmp) == NULL) {
+	if (!state->dry_run) {
+	  mirror_rmdir(state, d->path);
+	}
+	else {
+	  state->deleted++;
+	}
+      }
+    }
+  }
+
+  return Qnil;
+}
+
+static VALUE mirror_cleanup(VALUE arg)
+{
+  struct mirror_state *state = (struct mirror_state*)arg;
+
+  state->cancel = true;
+  if (state->local_running) {
+    pthread_join(state->local_thread, NULL);
+    state->local_running = false;
+  }
+  free(state->current);
+  state->current = NULL;
+  pool_free(state->pool);
+  state->pool = NULL;
+
+  return Qnil;
+}
+
+static VALUE mirror_summary(struct mirror_state *state)
+{
+  VALUE summary = rb_hash_new();
+  VALUE errors = rb_ary_new();
+  struct mirror_err *e;
+
+  for (e = state->errors; e != NULL; e = e->next) {
+    rb_ary_push(errors, rb_ary_new3(2, rb_str_new2(e->path),
+				    rb_syserr_new(e->err, e->path)));
+  }
+  rb_hash_aset(summary, ID2SYM(rb_intern("copied")), LONG2NUM(state->copied));
+  rb_hash_aset(summary, ID2SYM(rb_intern("bytes")), OFFT2NUM(state->bytes));
+  rb_hash_aset(summary, ID2SYM(rb_intern("sparse_bytes")), OFFT2NUM(state->sparse_bytes));
+  rb_hash_aset(summary, ID2SYM(rb_intern("skipped")), LONG2NUM(state->skipped));
+  rb_hash_aset(summary, ID2SYM(rb_intern("deleted")), LONG2NUM(state->deleted));
+  rb_hash_aset(summary, ID2SYM(rb_intern("directories")), LONG2NUM(state->dirs));
+  rb_hash_aset(summary, ID2SYM(rb_intern("errors")), errors);
+
+  return summary;
+}
+
+static void mirror_free(struct mirror_state *state)
+{
+  struct mirror_err *e;
+
+  list_free(&state->src);
+  list_free(&state->dst);
+  while ((e = state->errors) != NULL) {
+    state->errors = e->next;
+    free(e);
+  }
+  pthread_mutex_destroy(&state->src.lock);
+  pthread_mutex_destroy(&state->dst.lock);
+  pthread_mutex_destroy(&state->err_lock);
+  xfree(state->remote);
+  xfree(state->local);
+}
+
+static VALUE mirror_free_ensure(VALUE arg)
+{
+  mirror_free((struct mirror_state*)arg);
+
+  return Qnil;
+}
+
+static VALUE mirror_body(VALUE arg)
+{
+  rb_ensure(mirror_run, arg, mirror_cleanup, arg);
+
+  return mirror_summary((struct mirror_state*)arg);
+}
+
+/*
+  SMB.mirror(src, dest, opts = {}) -> summary hash
+
+  Exactly one of src and dest must be an smb:// url. Options: :threads,
+  :delete (remove what isn't in src), :checksum (compare contents of
+  same-sized files instead of trusting mtime), :mtime_window (seconds of
+  mtime difference to ignore, default 1), :dry_run and :sparse (skip
+  holes and zero blocks, default true; :sparse_bytes in the summary
+  counts what wasn't sent).
+*/
+
+static VALUE smb_s_mirror(int argc, VALUE *argv, VALUE self)
+{
+  VALUE src;
+  VALUE dest;
+  VALUE opts;
+  VALUE v;
+  struct mirror_state state;
+  char *srcp;
+  char *destp;
+  char *remote;
+  char *local;
+  int dh;
+
+  rb_scan_args(argc, argv, "21", &src, &dest, &opts);
+
+  StringValue(src);
+  StringValue(dest);
+  srcp = StringValuePtr(src);
+  destp = StringValuePtr(dest);
+
+  memset(&state, 0, sizeof(state));
+  state.download = (strncasecmp(srcp, "smb://", 6) == 0);
+  if (state.download == (strncasecmp(destp, "smb://", 6) == 0)) {
+    rb_raise(rb_eArgError, "one of src and dest must be an smb:// url, the other a local path");
+  }
+  remote = (state.download ? srcp : destp);
+  local = (state.download ? destp : srcp);
+
+  state.nthreads = pool_threads_opt(opts);
+  state.delete = RTEST(util_opt(opts, "delete"));
+  state.checksum = RTEST(util_opt(opts, "checksum"));
+  state.dry_run = RTEST(util_opt(opts, "dry_run"));
+  state.sparse = NIL_P(v = util_opt(opts, "sparse")) ? true : RTEST(v);
+  state.window = NIL_P(v = util_opt(opts, "mtime_window")) ? 1 : NUM2INT(v);
+
+  if (!state.download) {
+    struct stat st;
+
+    if (stat(local, &st) < 0) {
+      rb_sys_fail(local);
+    }
+    if (!S_ISDIR(st.st_mode)) {
+      errno = ENOTDIR;
+      rb_sys_fail(local);
+    }
+  }
+
+  /* authenticates on the Ruby thread, see SMB::Dir.walk */
+  if ((dh = smbc_opendir(remote)) < 0) {
+    if (state.download || errno != ENOENT) {
+      rb_sys_fail(remote);
+    }
+    if (state.dry_run) {
+      state.remote_missing = true;
+    }
+    else if (smbc_mkdir(remote, 0755) < 0) {
+      rb_sys_fail(remote);
+    }
+    smb_invalidate(remote);
+  }
+  else {
+    smbc_closedir(dh);
+  }
+
+  state.remote = ALLOC_N(char, strlen(remote) + 1);
+  strcpy(state.remote, remote);
+  state.local = ALLOC_N(char, strlen(local) + 1);
+  strcpy(state.local, local);
+  pthread_mutex_init(&state.src.lock, NULL);
+  pthread_mutex_init(&state.dst.lock, NULL);
+  pthread_mutex_init(&state.err_lock, NULL);
+
+  return rb_ensure(mirror_body, (VALUE)&state, mirror_free_ensure, (VALUE)&state);
+}
+
+void init_smbmirror(void)
+{
+  rb_define_module_function(mSMB, "mirror", smb_s_mirror, -1);
+}
@@ -0,0 +1,285 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include <libsmbclient.h>
+#include <ruby.h>
+#include <ruby/thread.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "rubysmb.h"
+#include "smbctx.h"
+#include "smbpool.h"
+#include "smbutil.h"
+
+struct worker_arg {
+  struct smbpool *pool;
+  int id;
+};
+
+static void *pool_worker(void *p)
+{
+  struct worker_arg *arg = p;
+  struct smbpool *pool = arg->pool;
+  SMBCCTX *ctx = pool->ctxs[arg->id];
+  struct pool_item *task;
+
+  free(arg);
+
+  pthread_mutex_lock(&pool->lock);
+  while (!pool->stopping) {
+    if (pool->tasks == NULL) {
+      pthread_cond_wait(&pool->work_cond, &pool->lock);
+      continue;
+    }
+    /* LIFO, so a tree walk stays depth first and the frontier stays small */
+    task = pool->tasks;
+    pool->tasks = task->next;
+    pool->active++;
+    pthread_mutex_unlock(&pool->lock);
+
+    pool->task_fn(pool, ctx, task);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->active--;
+    if (pool->active == 0 && pool->tasks == NULL) {
+      pthread_cond_broadcast(&pool->result_cond);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+static void pool_destroy(struct smbpool *pool)
+{
+  struct pool_item *item;
+  int i;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->work_cond);
+  pthread_cond_broadcast(&pool->space_cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 0; i < pool->nthreads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  for (i = 0; i < pool->size; i++) {
+    ctx_free(pool->ctxs[i]);
+  }
+  while ((item = pool->tasks) != NULL) {
+    pool->tasks = item->next;
+    free(item);
+  }
+  while ((item = pool->results) != NULL) {
+    pool->results = item->next;
+    free(item);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work_cond);
+  pthread_cond_destroy(&pool->result_cond);
+  pthread_cond_destroy(&pool->space_cond);
+  free(pool->threads);
+  free(pool->ctxs);
+  free(pool);
+}
+
+struct smbpool *pool_new(int nthreads, pool_task_fn fn, void *data)
+{
+  struct smbpool *pool;
+  struct worker_arg *arg;
+  int i;
+
+  pool = calloc(1, sizeof(struct smbpool));
+  pool->threads = calloc(nthreads, sizeof(pthread_t));
+  pool->ctxs = calloc(nthreads, sizeof(SMBCCTX*));
+  pool->size = nthreads;
+  pool->task_fn = fn;
+  pool->data = data;
+  pool->max_results = POOL_MAX_RESULTS;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_cond, NULL);
+  pthread_cond_init(&pool->result_cond, NULL);
+  pthread_cond_init(&pool->space_cond, NULL);
+
+  /* contexts are created here, one at a time, rather than by the workers */
+  for (i = 0; i < nthreads; i++) {
+    if ((pool->ctxs[i] = ctx_new()) == NULL) {
+      int err = errno;
+      pool_destroy(pool);
+      errno = err;
+      rb_sys_fail("smbc_new_context");
+    }
+  }
+  for (i = 0; i < nthreads; i++) {
+    arg = malloc(sizeof(struct worker_arg));
+    arg->pool = pool;
+    arg->id = i;
+    if (pthread_create(&pool->threads[i], NULL, pool_worker, arg) != 0) {
+      free(arg);
+      pool_destroy(pool);
+      rb_raise(eSmbError, "can't start worker thread");
+    }
+    pool->nthreads++;
+  }
+
+  return pool;
+}
+
+void pool_push(struct smbpool *pool, struct pool_item *task)
+{
+  pthread_mutex_lock(&pool->lock);
+  task->next = pool->tasks;
+  pool->tasks = task;
+  pthread_cond_signal(&pool->work_cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+  Called by workers. Blocks while the result queue is full. Returns false
+  (and frees the item) if the pool is shutting down, in which case the
+  caller should stop what it's doing.
+*/
+
+bool pool_emit(struct smbpool *pool, struct pool_item *result)
+{
+  pthread_mutex_lock(&pool->lock);
+  while (pool->nresults >= pool->max_results && !pool->stopping) {
+    pthread_cond_wait(&pool->space_cond, &pool->lock);
+  }
+  if (pool->stopping) {
+    pthread_mutex_unlock(&pool->lock);
+    free(result);
+    return false;
+  }
+  result->next = NULL;
+  if (pool->results_tail != NULL) {
+    pool->results_tail->next = result;
+  }
+  else {
+    pool->results = result;
+  }
+  pool->results_tail = result;
+  pool->nresults++;
+  pthread_cond_signal(&pool->result_cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  return true;
+}
+
+bool pool_stopping(struct smbpool *pool)
+{
+  bool stopping;
+
+  pthread_mutex_lock(&pool->lock);
+  stopping = pool->stopping;
+  pthread_mutex_unlock(&pool->lock);
+
+  return stopping;
+}
+
+static bool pool_done(struct smbpool *pool)
+{
+  return pool->results == NULL && pool->tasks == NULL && pool->active == 0;
+}
+
+static void *pool_wait(void *p)
+{
+  struct smbpool *pool = p;
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->results == NULL && !pool_done(pool) && !pool->interrupted) {
+    pthread_cond_wait(&pool->result_cond, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+static void pool_wakeup(void *p)
+{
+  struct smbpool *pool = p;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->interrupted = true;
+  pthread_cond_broadcast(&pool->result_cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+  Called with the GVL held. Returns the next result, or NULL once every
+  task has finished and every result has been consumed.
+*/
+
+struct pool_item *pool_next(struct smbpool *pool)
+{
+  struct pool_item *item;
+
+  while (true) {
+    pthread_mutex_lock(&pool->lock);
+    if ((item = pool->results) != NULL) {
+      pool->results = item->next;
+      if (pool->results == NULL) {
+	pool->results_tail = NULL;
+      }
+      pool->nresults--;
+      pthread_cond_signal(&pool->space_cond);
+      pthread_mutex_unlock(&pool->lock);
+      return item;
+    }
+    if (pool_done(pool)) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    pool->interrupted = false;
+    pthread_mutex_unlock(&pool->lock);
+
+    rb_thread_call_without_gvl(pool_wait, pool, pool_wakeup, pool);
+    rb_thread_check_ints();
+  }
+
+  return NULL;
+}
+
+void pool_free(struct smbpool *pool)
+{
+  if (pool != NULL) {
+    pool_destroy(pool);
+  }
+}
+
+int pool_threads_opt(VALUE opts)
+{
+  VALUE threads = util_opt(opts, "threads");
+  int n;
+
+  if (NIL_P(threads)) {
+    return POOL_DEFAULT_THREADS;
+  }
+  n = NUM2INT(threads);
+  if (n < 1 || n > POOL_MAX_THREADS) {
+    rb_raise(rb_eArgError, "threads must be between 1 and %d", POOL_MAX_THREADS);
+  }
+
+  return n;
+}
@@ -0,0 +1,78 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef RUBYSMB_SMBPOOL_H
+#define RUBYSMB_SMBPOOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+/*
+  A small pool of native threads, each with its own libsmbclient context.
+
+  Tasks and results are both pool_items: malloc'd blocks whose first member
+  is the link, freed with free(). Workers never touch Ruby objects; results
+  are handed to the thread that holds the GVL through pool_next, which
+  releases the GVL while it waits. The result queue is bounded so a slow
+  consumer stalls the workers instead of growing memory.
+*/
+
+#define POOL_MAX_THREADS 64
+#define POOL_DEFAULT_THREADS 8
+#define POOL_MAX_RESULTS 256
+
+struct pool_item {
+  struct pool_item *next;
+};
+
+struct smbpool;
+
+typedef void (*pool_task_fn)(struct smbpool*, SMBCCTX*, struct pool_item*);
+
+struct smbpool {
+  pthread_mutex_t lock;
+  pthread_cond_t work_cond;
+  pthread_cond_t result_cond;
+  pthread_cond_t space_cond;
+  pthread_t *threads;
+  SMBCCTX **ctxs;
+  int size;
+  int nthreads;
+  pool_task_fn task_fn;
+  void *data;
+  struct pool_item *tasks;
+  struct pool_item *results;
+  struct pool_item *results_tail;
+  int nresults;
+  int max_results;
+  int active;
+  bool stopping;
+  bool interrupted;
+};
+
+struct smbpool *pool_new(int, pool_task_fn, void*);
+void pool_push(struct smbpool*, struct pool_item*);
+bool pool_emit(struct smbpool*, struct pool_item*);
+bool pool_stopping(struct smbpool*);
+struct pool_item *pool_next(struct smbpool*);
+void pool_free(struct smbpool*);
+int pool_threads_opt(VALUE);
+
+#endif
@@ -25,11 +25,129 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <stdbool.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include "rubysmb.h"
 #include "smbstat.h"
+#include "smbcache.h"
+#include "smbmetrics.h"
 
 #define GET_ST struct stat *st; Data_Get_Struct(self, struct stat, st)
 
+/*
+  Metadata cache shared by SMB.stat, SMB::File::Stat.stat and
+  SMB::Util#stat. A miss that failed with ENOENT is cached as well, for
+  existence checks. Worker threads fill it in from directory listings.
+*/
+
+struct statent {
+  int err;
+  struct stat st;
+};
+
+static struct smbcache *statcache = NULL;
+static double statcache_ttl = 0;
+static double statcache_negative_ttl = 0;
+
+static void statent_copy(void *p, void *arg)
+{
+  memcpy(arg, p, sizeof(struct statent));
+}
+
+bool statcache_enabled(void)
+{
+  return statcache != NULL && statcache_ttl > 0;
+}
+
+void statcache_put(const char *url, const struct stat *st)
+{
+  struct statent *ent;
+
+  if (!statcache_enabled()) {
+    return;
+  }
+  ent = malloc(sizeof(struct statent));
+  ent->err = 0;
+  ent->st = *st;
+  cache_put(statcache, url, ent, statcache_ttl);
+}
+
+void statcache_invalidate(const char *url)
+{
+  char *parent;
+
+  if (statcache == NULL) {
+    return;
+  }
+  cache_remove(statcache, url);
+  if ((parent = cache_parent_key(url)) != NULL) {
+    cache_remove(statcache, parent);
+    free(parent);
+  }
+}
+
+void statcache_invalidate_tree(const char *url)
+{
+  char *parent;
+
+  if (statcache == NULL) {
+    return;
+  }
+  cache_remove_prefix(statcache, url);
+  if ((parent = cache_parent_key(url)) != NULL) {
+    cache_remove(statcache, parent);
+    free(parent);
+  }
+}
+
+/*
+  smbc_stat through the cache: same return value and errno.
+*/
+
+static int stat_timed(const char *url, struct stat *st)
+{
+  uint64_t start = metrics_start();
+  int ret;
+
+  ret = smbc_stat((char*)url, st);
+  if (start != 0) {
+    metrics_end(metrics_server(url), METRIC_STAT, url, start, ret);
+  }
+
+  return ret;
+}
+
+int stat_cached(const char *url, struct stat *st)
+{
+  struct statent ent;
+
+  if (!statcache_enabled()) {
+    return stat_timed(url, st);
+  }
+  if (cache_get(statcache, url, statent_copy, &ent)) {
+    if (ent.err != 0) {
+      errno = ent.err;
+      return -1;
+    }
+    *st = ent.st;
+    return 0;
+  }
+  if (stat_timed(url, st) < 0) {
+    if (errno == ENOENT && statcache_negative_ttl > 0) {
+      struct statent *neg = malloc(sizeof(struct statent));
+      int err = errno;
+
+      memset(neg, 0, sizeof(struct statent));
+      neg->err = ENOENT;
+      cache_put(statcache, url, neg, statcache_negative_ttl);
+      errno = err;
+    }
+    return -1;
+  }
+  statcache_put(url, st);
+
+  return 0;
+}
+
 VALUE stat_new(struct stat *st)
 {
   VALUE obj;
@@ -49,15 +167,63 @@ static VALUE smbstat_s_stat(VALUE self, VALUE url)
   struct stat st;
   VALUE obj;
 
-  Check_SafeStr(url);
+  StringValue(url);
 
-  if (smbc_stat(RSTRING(url)->as.heap.ptr, &st) < 0) {
+  if (stat_cached(RSTRING(url)->as.heap.ptr, &st) < 0) {
     rb_sys_fail(RSTRING(url)->as.heap.ptr);
   }
 
   return stat_new(&st);
 }
 
+/*
+  SMB.enable_stat_cache(ttl, max_entries = 4096, negative_ttl = ttl)
+*/
+
+static VALUE smb_s_enable_stat_cache(int argc, VALUE *argv, VALUE self)
+{
+  VALUE ttl;
+  VALUE max;
+  VALUE negative_ttl;
+  long n;
+
+  rb_scan_args(argc, argv, "12", &ttl, &max, &negative_ttl);
+
+  n = NIL_P(max) ? 4096 : NUM2LONG(max);
+  if (n < 1) {
+    rb_raise(rb_eArgError, "cache must hold at least one entry");
+  }
+  statcache_ttl = NUM2DBL(ttl);
+  statcache_negative_ttl = NIL_P(negative_ttl) ? statcache_ttl : NUM2DBL(negative_ttl);
+  if (statcache == NULL) {
+    statcache = cache_new((size_t)n, free);
+  }
+  else {
+    cache_set_max(statcache, (size_t)n);
+  }
+
+  return Qnil;
+}
+
+static VALUE smb_s_disable_stat_cache(VALUE self)
+{
+  statcache_ttl = 0;
+  if (statcache != NULL) {
+    cache_clear(statcache);
+  }
+
+  return Qnil;
+}
+
+static VALUE smb_s_clear_stat_cache(VALUE self)
+{
+  if (statcache != NULL) {
+    cache_clear(statcache);
+  }
+
+  return Qnil;
+}
+
 static VALUE smbstat_initialize(VALUE self)
 {
   return Qnil;
@@ -117,4 +283,8 @@ void init_smbstat(void)
   rb_define_method(cSmbStat, "size", smbstat_size, 0);
   rb_define_method(cSmbStat, "size?", smbstat_size_p, 0);
   rb_define_method(cSmbStat, "mode", smbstat_mode, 0);
+
+  rb_define_module_function(mSMB, "enable_stat_cache", smb_s_enable_stat_cache, -1);
+  rb_define_module_function(mSMB, "disable_stat_cache", smb_s_disable_stat_cache, 0);
+  rb_define_module_function(mSMB, "clear_stat_cache", smb_s_clear_stat_cache, 0);
 }
@@ -21,8 +21,14 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #define RUBYSMB_SMBSTAT_H
 
 #include <sys/stat.h>
+#include <stdbool.h>
 
 void init_smbstat(void);
 VALUE stat_new(struct stat*);
+int stat_cached(const char*, struct stat*);
+bool statcache_enabled(void);
+void statcache_put(const char*, const struct stat*);
+void statcache_invalidate(const char*);
+void statcache_invalidate_tree(const char*);
 
 #endif
@@ -0,0 +1,283 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include <libsmbclient.h>
+#include <ruby.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
+#include "rubysmb.h"
+#include "smbmetrics.h"
+#include "smbtrace.h"
+#include "smbutil.h"
+
+/*
+  Operations are recorded into a ring of fixed size slots. Writers claim
+  a slot with one atomic add and publish it by storing its sequence
+  number last; the (single, GVL holding) reader checks that number
+  before and after copying a slot, so a slot overwritten under it is
+  counted as dropped instead of returned torn.
+*/
+
+#define TRACE_DEFAULT_SIZE 65536
+#define TRACE_URL_MAX 200
+
+struct trace_event {
+  uint64_t seq;
+  uint64_t time_ns;
+  uint64_t duration_us;
+  int64_t bytes;
+  int32_t op;
+  int32_t err;
+  char url[TRACE_URL_MAX];
+};
+
+static struct trace_event *ring = NULL;
+static uint64_t ring_mask = 0;
+static uint64_t head = 0;
+static uint64_t tail = 0;
+static uint64_t dropped = 0;
+static bool tracing = false;
+
+bool trace_enabled(void)
+{
+  return tracing;
+}
+
+/*
+  Called by metrics_end for every timed operation. The USDT probe fires
+  whether or not the ring is recording, so a live process can be
+  traced with bpftrace or perf without calling SMB.trace_start:
+
+    bpftrace -e 'usdt:smb.so:rubysmb:op { printf("%s %s %d\n", str(arg0), str(arg1), arg3); }'
+*/
+
+/*
+  Returns url without a user:password@ part, copied into buf when there
+  is one to cut, so neither the ring nor the probe ever sees a password.
+*/
+
+static const char *trace_url(const char *url, char *buf, size_t size)
+{
+  const char *host;
+  const char *at = NULL;
+  const char *p;
+
+  if (url == NULL) {
+    return "";
+  }
+  if ((host = strstr(url, "://")) == NULL) {
+    return url;
+  }
+  host += 3;
+  for (p = host; *p != '\0' && *p != '/'; p++) {
+    if (*p == '@') {
+      at = p;
+    }
+  }
+  if (at == NULL) {
+    return url;
+  }
+  snprintf(buf, size, "%.*s%s", (int)(host - url), url, at + 1);
+
+  return buf;
+}
+
+void trace_op(int op, const char *url, uint64_t duration_us, int64_t bytes, int err)
+{
+  struct trace_event *ev;
+  struct timespec ts;
+  uint64_t i;
+  char buf[TRACE_URL_MAX];
+
+#ifndef HAVE_SYS_SDT_H
+  if (!tracing) {
+    return;
+  }
+#endif
+  url = trace_url(url, buf, sizeof(buf));
+#ifdef HAVE_SYS_SDT_H
+  DTRACE_PROBE5(rubysmb, op, metrics_op_name(op), url, bytes, duration_us, err);
+#endif
+  if (!tracing) {
+    return;
+  }
+  clock_gettime(CLOCK_REALTIME, &ts);
+  i = __sync_fetch_and_add(&head, 1);
+  ev = &ring[i & ring_mask];
+  ev->seq = 0;
+  __sync_synchronize();
+  ev->time_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec - duration_us * 1000;
+  ev->duration_us = duration_us;
+  ev->bytes = bytes;
+  ev->op = op;
+  ev->err = err;
+  strncpy(ev->url, url, TRACE_URL_MAX - 1);
+  ev->url[TRACE_URL_MAX - 1] = '\0';
+  __sync_synchronize();
+  ev->seq = i + 1;
+}
+
+/*
+  SMB.trace_start(:size => 65536) -> true
+
+  Starts recording operations into a ring of :size events (rounded up
+  to a power of two). Events that aren't drained before the ring wraps
+  are dropped, oldest first.
+*/
+
+static VALUE smb_s_trace_start(int argc, VALUE *argv, VALUE self)
+{
+  VALUE opts;
+  VALUE v;
+  long size = TRACE_DEFAULT_SIZE;
+  uint64_t n = 1;
+
+  rb_scan_args(argc, argv, "01", &opts);
+  if (!NIL_P(v = util_opt(opts, "size"))) {
+    size = NUM2LONG(v);
+    if (size < 1 || size > (1L << 24)) {
+      rb_raise(rb_eArgError, "trace size must be between 1 and %ld", 1L << 24);
+    }
+  }
+  while (n < (uint64_t)size) {
+    n <<= 1;
+  }
+  tracing = false;
+  if (ring == NULL || n != ring_mask + 1) {
+    /*
+      Workers may still be writing into the old ring, so it is left
+      allocated; this only happens when the size changes.
+    */
+    __sync_synchronize();
+    ring = calloc(n, sizeof(struct trace_event));
+    if (ring == NULL) {
+      rb_raise(rb_eNoMemError, "can't allocate trace buffer");
+    }
+    ring_mask = n - 1;
+  }
+  tail = head;
+  dropped = 0;
+  __sync_synchronize();
+  tracing = true;
+
+  return Qtrue;
+}
+
+/* SMB.trace_stop -> nil; recorded events stay drainable */
+static VALUE smb_s_trace_stop(VALUE self)
+{
+  tracing = false;
+
+  return Qnil;
+}
+
+static VALUE smb_s_tracing_p(VALUE self)
+{
+  return (tracing ? Qtrue : Qfalse);
+}
+
+static VALUE event_hash(const struct trace_event *ev)
+{
+  VALUE hash = rb_hash_new();
+
+  rb_hash_aset(hash, ID2SYM(rb_intern("time")),
+	       rb_time_nano_new(ev->time_ns / 1000000000, ev->time_ns % 1000000000));
+  rb_hash_aset(hash, ID2SYM(rb_intern("op")), ID2SYM(rb_intern(metrics_op_name(ev->op))));
+  rb_hash_aset(hash, ID2SYM(rb_intern("url")), rb_str_new2(ev->url));
+  rb_hash_aset(hash, ID2SYM(rb_intern("bytes")), LL2NUM(ev->bytes > 0 ? ev->bytes : 0));
+  rb_hash_aset(hash, ID2SYM(rb_intern("duration")), rb_float_new(ev->duration_us / 1e6));
+  rb_hash_aset(hash, ID2SYM(rb_intern("errno")), INT2FIX(ev->err));
+
+  return hash;
+}
+
+/*
+  SMB.trace_drain -> [ { :time, :op, :url, :bytes, :duration, :errno } ]
+  SMB.trace_drain { |event| ... } -> count
+
+  Returns and forgets the events recorded since the last drain, oldest
+  first.
+*/
+
+static VALUE smb_s_trace_drain(VALUE self)
+{
+  struct trace_event ev;
+  struct trace_event *slot;
+  VALUE result = rb_ary_new();
+  bool yield = rb_block_given_p();
+  uint64_t h;
+  uint64_t i;
+  uint64_t seq;
+  long count = 0;
+
+  if (ring == NULL) {
+    return (yield ? INT2FIX(0) : result);
+  }
+  h = __sync_fetch_and_add(&head, 0);
+  if (h - tail > ring_mask + 1) {
+    dropped += h - tail - (ring_mask + 1);
+    tail = h - (ring_mask + 1);
+  }
+  for (i = tail; i < h; i++) {
+    slot = &ring[i & ring_mask];
+    seq = slot->seq;
+    if (seq < i + 1) {
+      /* still being written; pick it up next time */
+      break;
+    }
+    __sync_synchronize();
+    memcpy(&ev, slot, sizeof(ev));
+    __sync_synchronize();
+    if (seq != i + 1 || slot->seq != seq) {
+      dropped++;
+      continue;
+    }
+    if (yield) {
+      rb_yield(event_hash(&ev));
+    }
+    else {
+      rb_ary_push(result, event_hash(&ev));
+    }
+    count++;
+  }
+  tail = i;
+
+  return (yield ? LONG2NUM(count) : result);
+}
+
+/* SMB.trace_dropped -> events lost to ring overflow since trace_start */
+static VALUE smb_s_trace_dropped(VALUE self)
+{
+  return ULL2NUM(dropped);
+}
+
+void init_smbtrace(void)
+{
+  rb_define_module_function(mSMB, "trace_start", smb_s_trace_start, -1);
+  rb_define_module_function(mSMB, "trace_stop", smb_s_trace_stop, 0);
+  rb_define_module_function(mSMB, "tracing?", smb_s_tracing_p, 0);
+  rb_define_module_function(mSMB, "trace_drain", smb_s_trace_drain, 0);
+  rb_define_module_function(mSMB, "trace_dropped", smb_s_trace_dropped, 0);
+}
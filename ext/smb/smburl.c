@@ -0,0 +1,460 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include <libsmbclient.h>
+#include <ruby.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rubysmb.h"
+#include "smburl.h"
+#include "smbutil.h"
+
+/*
+  Interned names live in an open addressing set that only grows; names
+  are never freed, there are only as many as there are servers and
+  shares.
+*/
+
+static const char **names = NULL;
+static size_t names_size = 0;
+static size_t names_count = 0;
+static pthread_mutex_t names_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t name_hash(const char *s, size_t len)
+{
+  size_t h = 5381;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h = h * 33 + (unsigned char)s[i];
+  }
+
+  return h;
+}
+
+static void names_grow(void)
+{
+  const char **old = names;
+  size_t oldsize = names_size;
+  size_t i;
+  size_t j;
+
+  names_size = (oldsize == 0 ? 64 : oldsize * 2);
+  names = calloc(names_size, sizeof(char*));
+  for (i = 0; i < oldsize; i++) {
+    if (old[i] != NULL) {
+      for (j = name_hash(old[i], strlen(old[i])) & (names_size - 1); names[j] != NULL;
+	   j = (j + 1) & (names_size - 1));
+      names[j] = old[i];
+    }
+  }
+  free(old);
+}
+
+const char *url_intern(const char *s, size_t len)
+{
+  const char *name;
+  char *copy;
+  size_t i;
+
+  pthread_mutex_lock(&names_lock);
+  if (names_count * 2 >= names_size) {
+    names_grow();
+  }
+  for (i = name_hash(s, len) & (names_size - 1); (name = names[i]) != NULL;
+       i = (i + 1) & (names_size - 1)) {
+    if (strncmp(name, s, len) == 0 && name[len] == '\0') {
+      pthread_mutex_unlock(&names_lock);
+      return name;
+    }
+  }
+  copy = malloc(len + 1);
+  memcpy(copy, s, len);
+  copy[len] = '\0';
+  names[i] = copy;
+  names_count++;
+  pthread_mutex_unlock(&names_lock);
+
+  return copy;
+}
+
+static void url_mark(struct smburl *url)
+{
+  rb_gc_mark(url->rstr);
+}
+
+static void url_free(struct smburl *url)
+{
+  xfree(url->str);
+  xfree(url);
+}
+
+static void url_parse(struct smburl *url)
+{
+  int server_i, server_len;
+  int share_i, share_len;
+
+  if (!util_parse_url(url->str,
+		      &server_i, &server_len,
+		      &share_i, &share_len,
+		      &url->path_i, &url->path_len,
+		      &url->username_i, &url->username_len,
+		      &url->password_i, &url->password_len)) {
+    rb_raise(eSmbError, "invalid url %s", url->str);
+  }
+  url->server = (server_i == 0 ? NULL : url_intern(url->str + server_i, server_len));
+  url->share = (share_i == 0 ? NULL : url_intern(url->str + share_i, share_len));
+  url->share_end = share_i + share_len;
+}
+
+static VALUE url_alloc(struct smburl **urlp, size_t len)
+{
+  VALUE obj;
+  struct smburl *url;
+
+  obj = Data_Make_Struct(cSmbURL, struct smburl, url_mark, url_free, url);
+  url->str = ALLOC_N(char, len + 1);
+  url->len = len;
+  url->rstr = Qnil;
+  *urlp = url;
+
+  return obj;
+}
+
+VALUE url_new(const char *s, size_t len)
+{
+  struct smburl *url;
+  VALUE obj = url_alloc(&url, len);
+
+  memcpy(url->str, s, len);
+  url->str[len] = '\0';
+  url_parse(url);
+
+  return obj;
+}
+
+/*
+  Below a share, a url made by appending to base has base's server,
+  share and user; they are taken over instead of parsed and looked up
+  again.
+*/
+
+static void url_parse_below(struct smburl *url, const struct smburl *base)
+{
+  if (base->share == NULL) {
+    url_parse(url);
+    return;
+  }
+  url->server = base->server;
+  url->share = base->share;
+  url->username_i = base->username_i;
+  url->username_len = base->username_len;
+  url->password_i = base->password_i;
+  url->password_len = base->password_len;
+  url->share_end = base->share_end;
+  url->path_i = base->share_end;
+  url->path_len = (int)url->len - url->path_i;
+  if (url->path_len <= 1) {
+    url->path_i = url->path_len = 0;
+  }
+}
+
+/*
+  str parsed into a plain struct for url_new_join, for callers that make
+  many urls below one directory. It points at str, which must outlive
+  it, and is released with free().
+*/
+
+struct smburl *url_base_new(const char *str)
+{
+  struct smburl parsed;
+  struct smburl *url;
+
+  memset(&parsed, 0, sizeof(parsed));
+  parsed.str = (char*)str;
+  parsed.len = strlen(str);
+  parsed.rstr = Qnil;
+  url_parse(&parsed);
+  url = malloc(sizeof(struct smburl));
+  *url = parsed;
+
+  return url;
+}
+
+/* base/name as an SMB::URL, without going through a String */
+VALUE url_new_join(const struct smburl *base, const char *name)
+{
+  struct smburl *url;
+  size_t namelen = strlen(name);
+  size_t slash = (base->len == 0 || base->str[base->len - 1] != '/' ? 1 : 0);
+  VALUE obj = url_alloc(&url, base->len + slash + namelen);
+
+  memcpy(url->str, base->str, base->len);
+  if (slash) {
+    url->str[base->len] = '/';
+  }
+  memcpy(url->str + base->len + slash, name, namelen + 1);
+  url_parse_below(url, base);
+
+  return obj;
+}
+
+struct smburl *url_get(VALUE obj)
+{
+  struct smburl *url;
+
+  Data_Get_Struct(obj, struct smburl, url);
+
+  return url;
+}
+
+static VALUE part(struct smburl *url, int i, int len)
+{
+  return (i == 0 ? Qnil : rb_str_new(url->str + i, len));
+}
+
+/*
+  SMB::URL.new(url)
+
+  Strings are parsed; an SMB::URL is returned as it is, since urls are
+  immutable.
+*/
+
+static VALUE smburl_s_new(VALUE self, VALUE str)
+{
+  if (rb_obj_is_kind_of(str, cSmbURL)) {
+    return str;
+  }
+  StringValue(str);
+
+  return url_new(RSTRING_PTR(str), RSTRING_LEN(str));
+}
+
+/* the url as a frozen String, made once */
+static VALUE smburl_to_s(VALUE self)
+{
+  struct smburl *url = url_get(self);
+
+  if (NIL_P(url->rstr)) {
+    url->rstr = rb_str_new(url->str, url->len);
+    OBJ_FREEZE(url->rstr);
+  }
+
+  return url->rstr;
+}
+
+static VALUE smburl_server(VALUE self)
+{
+  struct smburl *url = url_get(self);
+
+  return (url->server == NULL ? Qnil : rb_str_new2(url->server));
+}
+
+static VALUE smburl_share(VALUE self)
+{
+  struct smburl *url = url_get(self);
+
+  return (url->share == NULL ? Qnil : rb_str_new2(url->share));
+}
+
+static VALUE smburl_path(VALUE self)
+{
+  struct smburl *url = url_get(self);
+
+  return part(url, url->path_i, url->path_len);
+}
+
+static VALUE smburl_username(VALUE self)
+{
+  struct smburl *url = url_get(self);
+
+  return part(url, url->username_i, url->username_len);
+}
+
+static VALUE smburl_password(VALUE self)
+{
+  struct smburl *url = url_get(self);
+
+  return part(url, url->password_i, url->password_len);
+}
+
+/*
+  SMB::URL#join(name, ...) -> SMB::URL
+
+  Appends path components. Below a share the server and share are taken
+  over from self instead of being parsed and looked up again.
+*/
+
+static VALUE smburl_join(int argc, VALUE *argv, VALUE self)
+{
+  struct smburl *base = url_get(self);
+  struct smburl *url;
+  VALUE obj;
+  size_t len = base->len;
+  size_t n;
+  char *p;
+  int i;
+
+  for (i = 0; i < argc; i++) {
+    StringValue(argv[i]);
+    len += RSTRING_LEN(argv[i]) + 1;
+  }
+  obj = url_alloc(&url, len);
+  memcpy(url->str, base->str, base->len);
+  p = url->str + base->len;
+  for (i = 0; i < argc; i++) {
+    if (p == url->str || p[-1] != '/') {
+      *p++ = '/';
+    }
+    n = RSTRING_LEN(argv[i]);
+    memcpy(p, RSTRING_PTR(argv[i]), n);
+    p += n;
+  }
+  *p = '\0';
+  url->len = p - url->str;
+  url_parse_below(url, base);
+
+  return obj;
+}
+
+/*
+  SMB::URL#parent -> SMB::URL or nil
+
+  The url one component up: smb://s/share/dir for smb://s/share/dir/file,
+  and smb:// for smb://s. smb:// itself has no parent.
+*/
+
+static VALUE smburl_parent(VALUE self)
+{
+  struct smburl *url = url_get(self);
+  size_t len = url->len;
+
+  while (len > 0 && url->str[len - 1] == '/') {
+    len--;
+  }
+  while (len > 0 && url->str[len - 1] != '/') {
+    len--;
+  }
+  if (len <= 6) {
+    return (url->server == NULL ? Qnil : url_new("smb://", 6));
+  }
+  while (len > 6 && url->str[len - 1] == '/') {
+    len--;
+  }
+
+  return url_new(url->str, len);
+}
+
+/* the last path component, or the share or server name */
+static VALUE smburl_name(VALUE self)
+{
+  struct smburl *url = url_get(self);
+  size_t end = url->len;
+  size_t start;
+
+  while (end > 0 && url->str[end - 1] == '/') {
+    end--;
+  }
+  for (start = end; start > 0 && url->str[start - 1] != '/'; start--);
+  if (start <= 6) {
+    return (url->server == NULL ? Qnil : rb_str_new2(url->server));
+  }
+
+  return rb_str_new(url->str + start, end - start);
+}
+
+static VALUE smburl_simplify(VALUE self)
+{
+  struct smburl *url = url_get(self);
+  char *buf = ALLOC_N(char, url->len + 1);
+  VALUE obj;
+
+  memcpy(buf, url->str, url->len + 1);
+  util_simplify_url(buf);
+  obj = url_new(buf, strlen(buf));
+  xfree(buf);
+
+  return obj;
+}
+
+static VALUE smburl_equal(VALUE self, VALUE other)
+{
+  struct smburl *url = url_get(self);
+
+  if (rb_obj_is_kind_of(other, cSmbURL)) {
+    struct smburl *o = url_get(other);
+
+    return (o->len == url->len && memcmp(o->str, url->str, url->len) == 0 ? Qtrue : Qfalse);
+  }
+  if (TYPE(other) == T_STRING) {
+    return ((size_t)RSTRING_LEN(other) == url->len &&
+	    memcmp(RSTRING_PTR(other), url->str, url->len) == 0 ? Qtrue : Qfalse);
+  }
+
+  return Qfalse;
+}
+
+static VALUE smburl_eql(VALUE self, VALUE other)
+{
+  return (rb_obj_is_kind_of(other, cSmbURL) ? smburl_equal(self, other) : Qfalse);
+}
+
+static VALUE smburl_hash(VALUE self)
+{
+  struct smburl *url = url_get(self);
+
+  return LONG2FIX((long)(name_hash(url->str, url->len) >> 1));
+}
+
+static VALUE smburl_inspect(VALUE self)
+{
+  struct smburl *url = url_get(self);
+  VALUE str = rb_str_new2("#<SMB::URL ");
+
+  rb_str_cat(str, url->str, url->len);
+  rb_str_cat(str, ">", 1);
+
+  return str;
+}
+
+void init_smburl(void)
+{
+  cSmbURL = rb_define_class_under(mSMB, "URL", rb_cObject);
+  rb_undef_alloc_func(cSmbURL);
+  rb_define_singleton_method(cSmbURL, "new", smburl_s_new, 1);
+  rb_define_method(cSmbURL, "to_s", smburl_to_s, 0);
+  rb_define_method(cSmbURL, "to_str", smburl_to_s, 0);
+  rb_define_method(cSmbURL, "url", smburl_to_s, 0);
+  rb_define_method(cSmbURL, "server", smburl_server, 0);
+  rb_define_method(cSmbURL, "share", smburl_share, 0);
+  rb_define_method(cSmbURL, "path", smburl_path, 0);
+  rb_define_method(cSmbURL, "username", smburl_username, 0);
+  rb_define_method(cSmbURL, "password", smburl_password, 0);
+  rb_define_method(cSmbURL, "join", smburl_join, -1);
+  rb_define_method(cSmbURL, "+", smburl_join, -1);
+  rb_define_method(cSmbURL, "parent", smburl_parent, 0);
+  rb_define_method(cSmbURL, "name", smburl_name, 0);
+  rb_define_method(cSmbURL, "simplify", smburl_simplify, 0);
+  rb_define_method(cSmbURL, "==", smburl_equal, 1);
+  rb_define_method(cSmbURL, "eql?", smburl_eql, 1);
+  rb_define_method(cSmbURL, "hash", smburl_hash, 0);
+  rb_define_method(cSmbURL, "inspect", smburl_inspect, 0);
+}
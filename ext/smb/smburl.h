@@ -0,0 +1,54 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef RUBYSMB_SMBURL_H
+#define RUBYSMB_SMBURL_H
+
+#include <stddef.h>
+
+/*
+  A url parsed once. server and share point into a process-wide table
+  of interned names, so the millions of urls of a large walk share them;
+  only the url string itself is per object.
+*/
+
+struct smburl {
+  char *str;
+  size_t len;
+  const char *server;
+  const char *share;
+  int share_end;
+  int path_i;
+  int path_len;
+  int username_i;
+  int username_len;
+  int password_i;
+  int password_len;
+  VALUE rstr;
+};
+
+VALUE url_new(const char*, size_t);
+struct smburl *url_base_new(const char*);
+VALUE url_new_join(const struct smburl*, const char*);
+struct smburl *url_get(VALUE);
+const char *url_intern(const char*, size_t);
+void init_smburl(void);
+
+#endif
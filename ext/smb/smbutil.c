@@ -26,8 +26,8 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <sys/stat.h>
 #include "rubysmb.h"
 #include "smbstat.h"
-
-#define STRORNIL(x, i, l) (i == 0 ? Qnil : rb_str_new((x) + (i), (l)))
+#include "smburl.h"
+#include "smbutil.h"
 
 #define PREFIX "smb:"
 
@@ -37,7 +37,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
   Format is smb://[[[domain;]user[:password@]]server[/share[/path[/file]]]]
 */
 
-static int util_parse_url(char *url,
+int util_parse_url(char *url,
 		   int *server_i, int *server_len,
 		   int *share_i, int *share_len,
 		   int *path_i, int *path_len,
@@ -128,7 +128,7 @@ static int util_parse_url(char *url,
 }
 
 /*
-  Simplifies .., . and / in url.
+  Simplifies .., . and / in url, in place; the result is never longer.
 */
 
 void util_simplify_url(char *url)
@@ -140,7 +140,6 @@ void util_simplify_url(char *url)
   int password_i, password_len;
   char *src;
   char *dest;
-  char *buf;
 
   if (!util_parse_url(url,
 		      &server_i, &server_len,
@@ -159,13 +158,10 @@ void util_simplify_url(char *url)
   if (!share_i)
     return;
 
-  buf = ALLOC_N(char, strlen(url) + 1);
-  strcpy(buf, url);
-  dest = buf + share_i;
-  src = url + share_i;
+  dest = src = url + share_i;
   while (*src) {
     if (strncmp(src, "..", 2) == 0 && (src[2] == '/' || src[2] == '\0')) {
-      for (dest -= 2; *dest != '/'; dest--);
+      for (dest -= 2; dest > url + share_i - 1 && *dest != '/'; dest--);
       src += 2;
     }
     else if (strncmp(src, ".", 1) == 0) {
@@ -178,119 +174,102 @@ void util_simplify_url(char *url)
 	continue;
       }
     }
-    /*    else if (strncmp(src, "//", 2) == 0) {
-      dest = buf + server_i - 1;
-      src += 2;
-    }
-    else if (strncmp(src, "/", 1) == 0) {
-      dest = buf + share_i - 1;
-      src++;
-      }*/
     *dest = *src;
     dest++;
     src++;
   }
 
   *dest = '\0';
-  strcpy(url, buf);
-  free(buf);
-}
-
-static VALUE smbutil_simplify(VALUE self)
-{
-  ID url_id = rb_intern("url");
-  char *buf;
-  VALUE url;
-
-  url = rb_funcall(self, url_id, 0);
-  buf = ALLOC_N(char, RSTRING(url)->as.heap.len);
-  strcpy(buf, RSTRING(url)->as.heap.ptr);
-  util_simplify_url(buf);
-  url = rb_str_new2(buf);
-  free(buf);
-
-  return url;
 }
 
 static VALUE smbutil_m_simplify(VALUE self, VALUE url)
 {
   VALUE nurl;
-  char *buf;
 
-  Check_Type(url, T_STRING);
+  StringValue(url);
 
-  buf = ALLOC_N(char, RSTRING(url)->as.heap.len + 1);
-  strcpy(buf, RSTRING(url)->as.heap.ptr);
-  util_simplify_url(buf);
-  nurl = rb_str_new2(buf);
-  free(buf);
+  nurl = rb_str_new(RSTRING_PTR(url), RSTRING_LEN(url));
+  util_simplify_url(RSTRING_PTR(nurl));
+  rb_str_set_len(nurl, strlen(RSTRING_PTR(nurl)));
 
   return nurl;
 }
 
-static VALUE util_geturlary(VALUE obj)
+/*
+  The object's url as an SMB::URL, parsed the first time it is asked
+  for and kept in @smb_url.
+*/
+
+static VALUE util_geturl(VALUE obj)
 {
-  VALUE url = rb_iv_get(obj, "@smb_url_ary");
-  ID url_id = rb_intern("url");
+  VALUE url = rb_iv_get(obj, "@smb_url");
 
   if (NIL_P(url)) {
-    char *url_p;
-    int server_i;
-    int share_i;
-    int path_i;
-    int username_i;
-    int password_i;
-    int server_len;
-    int share_len;
-    int path_len;
-    int username_len;
-    int password_len;
-    VALUE ary = rb_ary_new();
-
-    url = rb_funcall(obj, url_id, 0);
-    url_p = RSTRING(url)->as.heap.ptr;
-    if (!util_parse_url(url_p,
-		       &server_i, &server_len,
-		       &share_i, &share_len,
-		       &path_i, &path_len,
-		       &username_i, &username_len,
-		       &password_i, &password_len)) {
-      rb_raise(eSmbError, "invalid url");
+    url = rb_funcall(obj, rb_intern("url"), 0);
+    if (!rb_obj_is_kind_of(url, cSmbURL)) {
+      StringValue(url);
+      url = url_new(RSTRING_PTR(url), RSTRING_LEN(url));
     }
-    rb_ary_push(ary, STRORNIL(url_p, server_i, server_len));
-    rb_ary_push(ary, STRORNIL(url_p, share_i, share_len));
-    rb_ary_push(ary, STRORNIL(url_p, path_i, path_len));
-    rb_ary_push(ary, STRORNIL(url_p, username_i, username_len));
-    rb_ary_push(ary, STRORNIL(url_p, password_i, password_len));
-    url = rb_iv_set(obj, "@smb_url_ary", ary);
+    rb_iv_set(obj, "@smb_url", url);
   }
 
   return url;
 }
 
+static VALUE smbutil_smb_url(VALUE self)
+{
+  return util_geturl(self);
+}
+
+/* the current url simplified, as a new String */
+static VALUE smbutil_simplify(VALUE self)
+{
+  return smbutil_m_simplify(self, rb_funcall(self, rb_intern("url"), 0));
+}
+
+#define URLPART(u, i, l) ((u)->i == 0 ? Qnil : rb_str_new((u)->str + (u)->i, (u)->l))
+
 static VALUE smbutil_server(VALUE self)
 {
-  return rb_ary_entry(util_geturlary(self), 0);
+  struct smburl *url = url_get(util_geturl(self));
+
+  return (url->server == NULL ? Qnil : rb_str_new2(url->server));
 }
 
 static VALUE smbutil_share(VALUE self)
 {
-  return rb_ary_entry(util_geturlary(self), 1);
+  struct smburl *url = url_get(util_geturl(self));
+
+  return (url->share == NULL ? Qnil : rb_str_new2(url->share));
 }
 
 static VALUE smbutil_path(VALUE self)
 {
-  return rb_ary_entry(util_geturlary(self), 2);
+  return URLPART(url_get(util_geturl(self)), path_i, path_len);
 }
 
 static VALUE smbutil_username(VALUE self)
 {
-  return rb_ary_entry(util_geturlary(self), 3);
+  return URLPART(url_get(util_geturl(self)), username_i, username_len);
 }
 
 static VALUE smbutil_password(VALUE self)
 {
-  return rb_ary_entry(util_geturlary(self), 4);
+  return URLPART(url_get(util_geturl(self)), password_i, password_len);
+}
+
+/*
+  Looks up an option in the trailing options hash of a method call.
+*/
+
+VALUE util_opt(VALUE opts, const char *name)
+{
+  if (NIL_P(opts)) {
+    return Qnil;
+  }
+  Check_Type(opts, T_HASH);
+
+  return rb_hash_aref(opts, ID2SYM(rb_intern(name)));
 }
 
 static VALUE smbutil_stat(VALUE self)
@@ -299,7 +278,7 @@ static VALUE smbutil_stat(VALUE self)
   struct stat st;
 
   url = rb_funcall(self, rb_intern("url"), 0);
-  if (smbc_stat(RSTRING(url)->as.heap.ptr, &st) < 0) {
+  if (stat_cached(RSTRING(url)->as.heap.ptr, &st) < 0) {
     rb_sys_fail(RSTRING(url)->as.heap.ptr);
   }
 
@@ -317,5 +296,6 @@ void init_smbutil()
   rb_define_method(mSmbUtil, "password", smbutil_password, 0);
   rb_define_method(mSmbUtil, "stat", smbutil_stat, 0);
   rb_define_method(mSmbUtil, "simplify", smbutil_simplify, 0);
+  rb_define_method(mSmbUtil, "smb_url", smbutil_smb_url, 0);
   rb_define_module_function(mSmbUtil, "simplify_url", smbutil_m_simplify, 1);
 }
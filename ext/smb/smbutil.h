@@ -21,7 +21,8 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #define RUBYSMB_SMBUTIL_H
 
 void init_smbutil(void);
-void util_parse_url(char*, char*, int*, char*, int*, char*, int*, char*, int*, char*, int*);
+int util_parse_url(char*, int*, int*, int*, int*, int*, int*, int*, int*, int*, int*);
 void util_simplify_url(char*);
+VALUE util_opt(VALUE, const char*);
 
 #endif
@@ -0,0 +1,328 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include <libsmbclient.h>
+#include <ruby.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "rubysmb.h"
+#include "smbctx.h"
+#include "smbdir.h"
+#include "smbpool.h"
+#include "smbstat.h"
+#include "smbutil.h"
+
+/*
+  SMB::Dir.walk lists directories on a pool of native threads. Workers only
+  ever list: every entry goes back to the Ruby thread, which decides (depth
+  limit, prune callback) whether a directory is handed back to the pool.
+*/
+
+struct walk_task {
+  struct pool_item item;
+  int depth;
+  bool in_share;
+  char url[1];
+};
+
+/* buf holds "dir\0name\0comment\0"; a negative type reports a failed dir */
+struct walk_result {
+  struct pool_item item;
+  int type;
+  int err;
+  int depth;
+  bool in_share;
+  bool has_stat;
+  struct stat st;
+  size_t name_off;
+  size_t comment_off;
+  char buf[1];
+};
+
+struct walk_state {
+  struct smbpool *pool;
+  struct walk_result *current;
+  VALUE prune;
+  int max_depth;
+  bool want_stat;
+  bool ignore_errors;
+};
+
+static void walk_push(struct smbpool *pool, const char *url, int depth, bool in_share)
+{
+  struct walk_task *task;
+
+  task = malloc(sizeof(struct walk_task) + strlen(url));
+  task->depth = depth;
+  task->in_share = in_share;
+  strcpy(task->url, url);
+  pool_push(pool, &task->item);
+}
+
+static struct walk_result *walk_result_new(struct walk_task *task, const char *name,
+					   const char *comment, int type)
+{
+  struct walk_result *r;
+  size_t dirlen = strlen(task->url);
+  size_t namelen = strlen(name);
+  size_t commentlen = (comment != NULL ? strlen(comment) : 0);
+
+  r = malloc(sizeof(struct walk_result) + dirlen + namelen + commentlen + 2);
+  r->type = type;
+  r->err = 0;
+  r->depth = task->depth;
+  r->in_share = task->in_share || type == SMBC_FILE_SHARE;
+  r->has_stat = false;
+  r->name_off = dirlen + 1;
+  r->comment_off = r->name_off + namelen + 1;
+  memcpy(r->buf, task->url, dirlen + 1);
+  memcpy(r->buf + r->name_off, name, namelen + 1);
+  memcpy(r->buf + r->comment_off, comment != NULL ? comment : "", commentlen + 1);
+
+  return r;
+}
+
+static bool dot_p(const char *name)
+{
+  return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+}
+
+/* a directory that can't be listed, or only in part, becomes an error result */
+static void walk_list_failed(struct smbpool *pool, struct walk_task *task, int err)
+{
+  struct walk_result *r = walk_result_new(task, "", NULL, -1);
+
+  r->err = err;
+  pool_emit(pool, &r->item);
+}
+
+static void walk_list(struct smbpool *pool, SMBCCTX *ctx, struct pool_item *item)
+{
+  struct walk_task *task = (struct walk_task*)item;
+  struct walk_state *state = pool->data;
+  struct walk_result *r;
+  struct smbc_dirent *ent;
+  SMBCFILE *dh;
+  char *url;
+
+  dh = smbc_getFunctionOpendir(ctx)(ctx, task->url);
+  if (dh == NULL) {
+    walk_list_failed(pool, task, errno);
+    free(task);
+    return;
+  }
+
+#ifdef HAVE_SMBC_READDIRPLUS2
+  /* inside a share one round trip gives us the attributes as well */
+  if (task->in_share && state->want_stat) {
+    const struct libsmb_file_info *info;
+    struct stat st;
+
+    for (errno = 0; (info = smbc_getFunctionReaddirPlus2(ctx)(ctx, dh, &st)) != NULL; errno = 0) {
+      if (dot_p(info->name)) {
+	continue;
+      }
+      r = walk_result_new(task, info->name, NULL, S_ISDIR(st.st_mode) ? SMBC_DIR : SMBC_FILE);
+      r->has_stat = true;
+      r->st = st;
+      if (statcache_enabled()) {
+	url = ctx_url_join(task->url, info->name);
+	statcache_put(url, &st);
+	free(url);
+      }
+      if (!pool_emit(pool, &r->item)) {
+	break;
+      }
+    }
+    if (info == NULL && errno != 0) {
+      walk_list_failed(pool, task, errno);
+    }
+    smbc_getFunctionClosedir(ctx)(ctx, dh);
+    free(task);
+    return;
+  }
+#endif
+
+  for (errno = 0; (ent = smbc_getFunctionReaddir(ctx)(ctx, dh)) != NULL; errno = 0) {
+    if (dot_p(ent->name)) {
+      continue;
+    }
+    r = walk_result_new(task, ent->name, ent->commentlen > 0 ? ent->comment : NULL,
+			ent->smbc_type);
+    if (state->want_stat &&
+	(ent->smbc_type == SMBC_FILE || ent->smbc_type == SMBC_DIR || ent->smbc_type == SMBC_LINK)) {
+      url = ctx_url_join(task->url, ent->name);
+      r->has_stat = (smbc_getFunctionStat(ctx)(ctx, url, &r->st) == 0);
+      if (r->has_stat) {
+	statcache_put(url, &r->st);
+      }
+      free(url);
+    }
+    if (!pool_emit(pool, &r->item)) {
+      break;
+    }
+  }
+  if (ent == NULL && errno != 0) {
+    walk_list_failed(pool, task, errno);
+  }
+  smbc_getFunctionClosedir(ctx)(ctx, dh);
+  free(task);
+}
+
+static VALUE walk_run(VALUE arg)
+{
+  struct walk_state *state = (struct walk_state*)arg;
+  struct walk_result *r;
+  VALUE entry;
+  VALUE st;
+  bool descend;
+  char *url;
+
+  while ((r = (struct walk_result*)pool_next(state->pool)) != NULL) {
+    state->current = r;
+
+    if (r->type < 0) {
+      if (!state->ignore_errors) {
+	VALUE dir = rb_str_new2(r->buf);
+	int err = r->err;
+
+	state->current = NULL;
+	free(r);
+	errno = err;
+	rb_sys_fail(StringValuePtr(dir));
+      }
+      state->current = NULL;
+      free(r);
+      continue;
+    }
+
+    entry = direntry_new(r->buf, r->buf + r->name_off, r->buf + r->comment_off, r->type);
+    st = (r->has_stat ? stat_new(&r->st) : Qnil);
+
+    descend = SMBC_CONTAINER_P(r->type) &&
+      (state->max_depth == 0 || r->depth < state->max_depth);
+    if (descend && !NIL_P(state->prune)) {
+      descend = !RTEST(rb_funcall(state->prune, rb_intern("call"), 2, entry, st));
+    }
+    if (descend) {
+      url = ctx_url_join(r->buf, r->buf + r->name_off);
+      walk_push(state->pool, url, r->depth + 1, r->in_share);
+      free(url);
+    }
+
+    state->current = NULL;
+    free(r);
+
+    rb_yield_values(2, entry, st);
+  }
+
+  return Qnil;
+}
+
+static VALUE walk_cleanup(VALUE arg)
+{
+  struct walk_state *state = (struct walk_state*)arg;
+
+  free(state->current);
+  state->current = NULL;
+  pool_free(state->pool);
+  state->pool = NULL;
+
+  return Qnil;
+}
+
+/*
+  SMB::Dir.walk(url, opts = {}) { |entry, stat| ... }
+
+  Options: :threads (default 8), :depth (levels below url, default
+  unlimited), :prune (callable taking entry and stat, true skips the
+  directory), :stat (default true), :ignore_errors (skip directories that
+  can't be listed instead of raising).
+*/
+
+static VALUE smbdir_s_walk(int argc, VALUE *argv, VALUE self)
+{
+  VALUE url;
+  VALUE opts;
+  VALUE v;
+  struct walk_state state;
+  int server_i, server_len;
+  int share_i, share_len;
+  int path_i, path_len;
+  int username_i, username_len;
+  int password_i, password_len;
+  int nthreads;
+  int dh;
+  char *urlp;
+
+  RETURN_ENUMERATOR(self, argc, argv);
+
+  rb_scan_args(argc, argv, "11", &url, &opts);
+
+  StringValue(url);
+  urlp = StringValuePtr(url);
+
+  if (!util_parse_url(urlp,
+		      &server_i, &server_len,
+		      &share_i, &share_len,
+		      &path_i, &path_len,
+		      &username_i, &username_len,
+		      &password_i, &password_len)) {
+    rb_raise(eSmbError, "invalid url");
+  }
+
+  nthreads = pool_threads_opt(opts);
+  state.prune = util_opt(opts, "prune");
+  state.max_depth = NIL_P(v = util_opt(opts, "depth")) ? 0 : NUM2INT(v);
+  state.want_stat = NIL_P(v = util_opt(opts, "stat")) ? true : RTEST(v);
+  state.ignore_errors = RTEST(util_opt(opts, "ignore_errors"));
+  state.current = NULL;
+  if (state.max_depth < 0) {
+    rb_raise(rb_eArgError, "negative depth");
+  }
+  if (!NIL_P(state.prune) && !rb_respond_to(state.prune, rb_intern("call"))) {
+    rb_raise(rb_eArgError, "prune must respond to call");
+  }
+
+  /*
+    Open the root through the global context first: it reports a bad url
+    the usual way, and any SMB.on_authentication callback runs here, on
+    the Ruby thread, where the workers can pick its answer up.
+  */
+  if ((dh = smbc_opendir(urlp)) < 0) {
+    rb_sys_fail(urlp);
+  }
+  smbc_closedir(dh);
+
+  state.pool = pool_new(nthreads, walk_list, &state);
+  walk_push(state.pool, urlp, 1, share_i != 0);
+
+  rb_ensure(walk_run, (VALUE)&state, walk_cleanup, (VALUE)&state);
+
+  return Qnil;
+}
+
+void init_smbwalk(void)
+{
+  rb_define_singleton_method(cSmbDir, "walk", smbdir_s_walk, -1);
+}
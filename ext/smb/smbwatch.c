@@ -0,0 +1,459 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include <libsmbclient.h>
+#include <ruby.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/time.h>
+#include "rubysmb.h"
+#include "smbctx.h"
+#include "smbpool.h"
+#include "smbutil.h"
+#include "smbwatch.h"
+
+#ifdef HAVE_SMBC_NOTIFY
+
+/*
+  SMB::Dir#watch keeps a change notification open on a single pool
+  worker, with its own context, so waiting for the server never holds the
+  GVL. Notifications are merged per name on the worker and handed over
+  once they have been quiet for :latency seconds.
+*/
+
+enum {
+  WATCH_CREATED,
+  WATCH_MODIFIED,
+  WATCH_DELETED,
+  WATCH_RENAMED,
+  WATCH_ERROR
+};
+
+struct watch_event {
+  struct pool_item item;
+  int kind;
+  int err;
+  char *from;
+  char name[1];
+};
+
+struct watch_state {
+  struct smbpool *pool;
+  struct watch_event *current;
+  const char *url;
+  bool recursive;
+  uint32_t filter;
+  unsigned latency_ms;
+  /* worker side */
+  struct watch_event **pending;
+  long npending;
+  long cap;
+  double first;
+  char *rename_from;
+};
+
+static double watch_now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static struct watch_event *event_new(int kind, const char *name, const char *from)
+{
+  struct watch_event *e;
+  size_t len = strlen(name);
+  char *p;
+
+  e = malloc(sizeof(struct watch_event) + len + (from != NULL ? strlen(from) + 1 : 0));
+  e->kind = kind;
+  e->err = 0;
+  strcpy(e->name, name);
+  if (from != NULL) {
+    e->from = e->name + len + 1;
+    strcpy(e->from, from);
+  }
+  else {
+    e->from = NULL;
+  }
+  /* recursive notifications name paths with backslashes */
+  for (p = e->name; *p != '\0'; p++) {
+    if (*p == '\\') {
+      *p = '/';
+    }
+  }
+  for (p = e->from; p != NULL && *p != '\0'; p++) {
+    if (*p == '\\') {
+      *p = '/';
+    }
+  }
+
+  return e;
+}
+
+static long pending_find(struct watch_state *state, const char *name)
+{
+  long i;
+
+  for (i = state->npending - 1; i >= 0; i--) {
+    if (state->pending[i] != NULL && strcmp(state->pending[i]->name, name) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static void pending_add(struct watch_state *state, struct watch_event *e)
+{
+  if (state->npending == 0) {
+    state->first = watch_now();
+  }
+  if (state->npending == state->cap) {
+    state->cap = (state->cap == 0 ? 16 : state->cap * 2);
+    state->pending = realloc(state->pending, state->cap * sizeof(struct watch_event*));
+  }
+  state->pending[state->npending++] = e;
+}
+
+static void pending_set(struct watch_state *state, long i, struct watch_event *e)
+{
+  free(state->pending[i]);
+  state->pending[i] = e;
+}
+
+/*
+  Folds one notification into what is already pending: a file created and
+  deleted inside the window disappears, repeated writes become one
+  :modified, and a rename of something just created is just a create.
+*/
+
+static void watch_merge(struct watch_state *state, uint32_t action, const char *name)
+{
+  struct watch_event *e;
+  long i;
+
+  switch (action) {
+  case SMBC_NOTIFY_ACTION_ADDED:
+    if ((i = pending_find(state, name)) >= 0 && state->pending[i]->kind == WATCH_DELETED) {
+      pending_set(state, i, event_new(WATCH_MODIFIED, name, NULL));
+    }
+    else if (i < 0) {
+      pending_add(state, event_new(WATCH_CREATED, name, NULL));
+    }
+    break;
+  case SMBC_NOTIFY_ACTION_MODIFIED:
+    if (pending_find(state, name) < 0) {
+      pending_add(state, event_new(WATCH_MODIFIED, name, NULL));
+    }
+    break;
+  case SMBC_NOTIFY_ACTION_REMOVED:
+    if ((i = pending_find(state, name)) < 0) {
+      pending_add(state, event_new(WATCH_DELETED, name, NULL));
+    }
+    else if (state->pending[i]->kind == WATCH_CREATED) {
+      pending_set(state, i, NULL);
+    }
+    else if (state->pending[i]->kind == WATCH_RENAMED) {
+      pending_set(state, i, event_new(WATCH_DELETED, state->pending[i]->from, NULL));
+    }
+    else {
+      pending_set(state, i, event_new(WATCH_DELETED, name, NULL));
+    }
+    break;
+  case SMBC_NOTIFY_ACTION_OLD_NAME:
+    free(state->rename_from);
+    state->rename_from = strdup(name);
+    break;
+  case SMBC_NOTIFY_ACTION_NEW_NAME:
+    if (state->rename_from == NULL) {
+      pending_add(state, event_new(WATCH_CREATED, name, NULL));
+      break;
+    }
+    if ((i = pending_find(state, state->rename_from)) >= 0 &&
+	state->pending[i]->kind == WATCH_CREATED) {
+      pending_set(state, i, event_new(WATCH_CREATED, name, NULL));
+    }
+    else {
+      e = event_new(WATCH_RENAMED, name, state->rename_from);
+      if (i >= 0) {
+	pending_set(state, i, e);
+      }
+      else {
+	pending_add(state, e);
+      }
+    }
+    free(state->rename_from);
+    state->rename_from = NULL;
+    break;
+  }
+}
+
+static bool watch_flush(struct watch_state *state)
+{
+  long i;
+  bool ok = true;
+
+  for (i = 0; i < state->npending; i++) {
+    if (state->pending[i] == NULL) {
+      continue;
+    }
+    if (ok) {
+      ok = pool_emit(state->pool, &state->pending[i]->item);
+    }
+    else {
+      free(state->pending[i]);
+    }
+  }
+  state->npending = 0;
+
+  return ok;
+}
+
+/* nonzero stops smbc_notify */
+static int watch_callback(const struct smbc_notify_callback_action *actions,
+			  size_t nactions, void *data)
+{
+  struct watch_state *state = data;
+  size_t i;
+
+  if (pool_stopping(state->pool)) {
+    return 1;
+  }
+  for (i = 0; i < nactions; i++) {
+    watch_merge(state, actions[i].action, actions[i].filename);
+  }
+  if (state->npending > 0 && watch_now() - state->first >= state->latency_ms / 1000.0) {
+    return !watch_flush(state);
+  }
+
+  return 0;
+}
+
+static void watch_run_task(struct smbpool *pool, SMBCCTX *ctx, struct pool_item *item)
+{
+  struct watch_state *state = pool->data;
+  struct watch_event *e;
+  SMBCFILE *dh;
+  int err = 0;
+
+  free(item);
+
+  if ((dh = smbc_getFunctionOpendir(ctx)(ctx, state->url)) == NULL) {
+    err = errno;
+  }
+  else {
+    if (smbc_getFunctionNotify(ctx)(ctx, dh, state->recursive, state->filter,
+				    state->latency_ms, watch_callback, state) < 0) {
+      err = errno;
+    }
+    smbc_getFunctionClosedir(ctx)(ctx, dh);
+  }
+
+  if (!pool_stopping(pool)) {
+    watch_flush(state);
+    e = event_new(WATCH_ERROR, "", NULL);
+    e->err = (err != 0 ? err : ECONNRESET);
+    pool_emit(pool, &e->item);
+  }
+}
+
+static VALUE event_url(struct watch_state *state, const char *name)
+{
+  char *url = ctx_url_join(state->url, name);
+  VALUE v = rb_str_new2(url);
+
+  free(url);
+
+  return v;
+}
+
+static VALUE watch_run(VALUE arg)
+{
+  struct watch_state *state = (struct watch_state*)arg;
+  struct watch_event *e;
+  struct pool_item *task;
+  VALUE kind;
+  VALUE url;
+  VALUE from;
+
+  state->pool = pool_new(1, watch_run_task, state);
+  task = malloc(sizeof(struct pool_item));
+  pool_push(state->pool, task);
+
+  while ((e = (struct watch_event*)pool_next(state->pool)) != NULL) {
+    state->current = e;
+    if (e->kind == WATCH_ERROR) {
+      errno = e->err;
+      rb_sys_fail(state->url);
+    }
+    url = event_url(state, e->name);
+    from = (e->from != NULL ? event_url(state, e->from) : Qnil);
+    switch (e->kind) {
+    case WATCH_CREATED:
+      kind = ID2SYM(rb_intern("created"));
+      break;
+    case WATCH_MODIFIED:
+      kind = ID2SYM(rb_intern("modified"));
+      break;
+    case WATCH_DELETED:
+      kind = ID2SYM(rb_intern("deleted"));
+      break;
+    default:
+      kind = ID2SYM(rb_intern("renamed"));
+      break;
+    }
+    state->current = NULL;
+    free(e);
+
+    /* the server just told us these changed, so don't trust cached copies */
+    if (NIL_P(from)) {
+      smb_invalidate(StringValuePtr(url));
+    }
+    else {
+      smb_invalidate_tree(StringValuePtr(from));
+      smb_invalidate_tree(StringValuePtr(url));
+    }
+    rb_yield_values(3, kind, url, from);
+  }
+
+  return Qnil;
+}
+
+static VALUE watch_cleanup(VALUE arg)
+{
+  struct watch_state *state = (struct watch_state*)arg;
+  long i;
+
+  free(state->current);
+  state->current = NULL;
+  pool_free(state->pool);
+  state->pool = NULL;
+  for (i = 0; i < state->npending; i++) {
+    free(state->pending[i]);
+  }
+  free(state->pending);
+  free(state->rename_from);
+
+  return Qnil;
+}
+
+static uint32_t watch_filter(VALUE v)
+{
+  static const struct {
+    const char *name;
+    uint32_t flag;
+  } flags[] = {
+    { "file_name", SMBC_NOTIFY_CHANGE_FILE_NAME },
+    { "dir_name", SMBC_NOTIFY_CHANGE_DIR_NAME },
+    { "attributes", SMBC_NOTIFY_CHANGE_ATTRIBUTES },
+    { "size", SMBC_NOTIFY_CHANGE_SIZE },
+    { "last_write", SMBC_NOTIFY_CHANGE_LAST_WRITE },
+    { "last_access", SMBC_NOTIFY_CHANGE_LAST_ACCESS },
+    { "creation", SMBC_NOTIFY_CHANGE_CREATION },
+    { "security", SMBC_NOTIFY_CHANGE_SECURITY },
+    { NULL, 0 }
+  };
+  uint32_t filter = 0;
+  VALUE sym;
+  long i;
+  int j;
+
+  if (NIL_P(v)) {
+    return SMBC_NOTIFY_CHANGE_FILE_NAME | SMBC_NOTIFY_CHANGE_DIR_NAME |
+      SMBC_NOTIFY_CHANGE_SIZE | SMBC_NOTIFY_CHANGE_LAST_WRITE;
+  }
+  if (FIXNUM_P(v)) {
+    return NUM2UINT(v);
+  }
+  v = rb_Array(v);
+  for (i = 0; i < RARRAY_LEN(v); i++) {
+    sym = RARRAY_PTR(v)[i];
+    for (j = 0; flags[j].name != NULL; j++) {
+      if (sym == ID2SYM(rb_intern(flags[j].name))) {
+	filter |= flags[j].flag;
+	break;
+      }
+    }
+    if (flags[j].name == NULL) {
+      rb_raise(rb_eArgError, "unknown filter %s", RSTRING_PTR(rb_inspect(sym)));
+    }
+  }
+
+  return filter;
+}
+
+#endif
+
+/*
+  dir.watch(opts = {}) { |event, url, old_url| ... }
+
+  Yields :created, :modified, :deleted and :renamed (with the old url)
+  as the server reports them, until the block breaks. Options:
+  :recursive (default false), :filter (an array of :file_name,
+  :dir_name, :attributes, :size, :last_write, :last_access, :creation and
+  :security, default file and dir names, size and last write) and
+  :latency (seconds to gather changes for before yielding, default 0.1).
+*/
+
+static VALUE smbdir_watch(int argc, VALUE *argv, VALUE self)
+{
+#ifdef HAVE_SMBC_NOTIFY
+  struct watch_state state;
+  VALUE opts;
+  VALUE url;
+  VALUE v;
+  double latency;
+
+  RETURN_ENUMERATOR(self, argc, argv);
+
+  rb_scan_args(argc, argv, "01", &opts);
+
+  url = rb_funcall(self, rb_intern("url"), 0);
+
+  memset(&state, 0, sizeof(state));
+  state.url = StringValuePtr(url);
+  state.recursive = RTEST(util_opt(opts, "recursive"));
+  state.filter = watch_filter(util_opt(opts, "filter"));
+  latency = NIL_P(v = util_opt(opts, "latency")) ? 0.1 : NUM2DBL(v);
+  if (latency < 0.01 || latency > 60) {
+    rb_raise(rb_eArgError, "latency must be between 0.01 and 60 seconds");
+  }
+  state.latency_ms = (unsigned)(latency * 1000);
+
+  rb_ensure(watch_run, (VALUE)&state, watch_cleanup, (VALUE)&state);
+  RB_GC_GUARD(url);
+
+  return self;
+#else
+  rb_notimplement();
+  return Qnil;
+#endif
+}
+
+void init_smbwatch(void)
+{
+  rb_define_method(cSmbDir, "watch", smbdir_watch, -1);
+}
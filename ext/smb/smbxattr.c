@@ -0,0 +1,408 @@
+/*
+This file is part of Ruby/SMB.
+Copyright (c) 2002 Henrik Falck <hefa at users.sourceforge.net>
+
+Ruby/SMB is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Ruby/SMB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Ruby/SMB; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include <libsmbclient.h>
+#include <ruby.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include "rubysmb.h"
+#include "smbctx.h"
+#include "smbpool.h"
+#include "smbutil.h"
+#include "smbxattr.h"
+
+/*
+  DOS attributes and security descriptors through libsmbclient's
+  "system.*" extended attribute, which returns both in a single request
+  as "REVISION:1,OWNER:...,GROUP:...,ACL:...,MODE:0x20,SIZE:...". The
+  "+" variant gives account names instead of SIDs.
+*/
+
+#define XATTR_ALL "system.*"
+#define XATTR_ALL_NAMES "system.*+"
+#define XATTR_BUFSIZE 4096
+#define XATTR_MAXSIZE (1024 * 1024)
+
+enum {
+  XATTR_LIST,
+  XATTR_GET
+};
+
+struct xattr_task {
+  struct pool_item item;
+  int op;
+  bool dir;
+  char url[1];
+};
+
+/* value is empty when err is set; a LIST failure has dir set */
+struct xattr_result {
+  struct pool_item item;
+  int err;
+  bool dir;
+  size_t value_off;
+  char buf[1];
+};
+
+struct xattr_state {
+  struct smbpool *pool;
+  struct xattr_result *current;
+  const char *name;
+  long files;
+  long directories;
+  VALUE errors;
+};
+
+/*
+  Fetches attribute name of url into a malloc'd string, growing the
+  buffer while the library reports ERANGE. Returns NULL with errno set.
+*/
+
+static char *xattr_fetch(SMBCCTX *ctx, const char *url, const char *name)
+{
+  size_t size = XATTR_BUFSIZE;
+  char *buf = NULL;
+  int ret;
+
+  while (true) {
+    buf = realloc(buf, size);
+    memset(buf, 0, size);
+    if (ctx != NULL) {
+      ret = smbc_getFunctionGetxattr(ctx)(ctx, url, name, buf, size - 1);
+    }
+    else {
+      ret = smbc_getxattr(url, name, buf, size - 1);
+    }
+    if (ret >= 0) {
+      return buf;
+    }
+    if (errno != ERANGE || size >= XATTR_MAXSIZE) {
+      int err = errno;
+
+      free(buf);
+      errno = err;
+      return NULL;
+    }
+    size *= 2;
+  }
+}
+
+static VALUE xattr_number(const char *s, size_t len)
+{
+  char buf[32];
+  char *end;
+  unsigned long long n;
+
+  if (len == 0 || len >= sizeof(buf) || !isdigit((unsigned char)s[0])) {
+    return rb_str_new(s, len);
+  }
+  memcpy(buf, s, len);
+  buf[len] = '\0';
+  n = strtoull(buf, &end, 0);
+
+  return (*end == '\0' ? ULL2NUM(n) : rb_str_new(s, len));
+}
+
+/* "trustee:type/flags/mask" */
+static VALUE xattr_ace(const char *s, size_t len)
+{
+  VALUE ace = rb_hash_new();
+  const char *colon = s + len;
+  const char *p;
+  const char *q;
+  const char *keys[] = { "type", "flags", "mask" };
+  int i;
+
+  while (colon > s && colon[-1] != ':') {
+    colon--;
+  }
+  if (colon == s) {
+    rb_hash_aset(ace, ID2SYM(rb_intern("trustee")), rb_str_new(s, len));
+    return ace;
+  }
+  rb_hash_aset(ace, ID2SYM(rb_intern("trustee")), rb_str_new(s, colon - 1 - s));
+  for (p = colon, i = 0; i < 3 && p <= s + len; i++) {
+    for (q = p; q < s + len && *q != '/'; q++);
+    rb_hash_aset(ace, ID2SYM(rb_intern(keys[i])), xattr_number(p, q - p));
+    p = q + 1;
+  }
+
+  return ace;
+}
+
+/*
+  Turns the combined attribute string into a Hash with lowercased
+  symbol keys; numbers become Integers and every ACL entry becomes a
+  Hash in the :acl Array.
+*/
+
+static VALUE xattr_parse(const char *value)
+{
+  VALUE hash = rb_hash_new();
+  VALUE acl = rb_ary_new();
+  const char *p = value;
+  const char *end;
+  const char *colon;
+  char key[32];
+  size_t keylen;
+  size_t i;
+
+  while (*p != '\0') {
+    end = p + strcspn(p, ",");
+    for (colon = p; colon < end && *colon != ':'; colon++);
+    keylen = colon - p;
+    if (colon < end && keylen < sizeof(key)) {
+      for (i = 0; i < keylen; i++) {
+	key[i] = tolower((unsigned char)p[i]);
+      }
+      key[keylen] = '\0';
+      if (strcmp(key, "acl") == 0) {
+	rb_ary_push(acl, xattr_ace(colon + 1, end - colon - 1));
+      }
+      else if (strcmp(key, "owner") == 0 || strcmp(key, "group") == 0) {
+	rb_hash_aset(hash, ID2SYM(rb_intern(key)), rb_str_new(colon + 1, end - colon - 1));
+      }
+      else {
+	rb_hash_aset(hash, ID2SYM(rb_intern(key)), xattr_number(colon + 1, end - colon - 1));
+      }
+    }
+    p = (*end == ',' ? end + 1 : end);
+  }
+  rb_hash_aset(hash, ID2SYM(rb_intern("acl")), acl);
+
+  return hash;
+}
+
+static VALUE xattrs(VALUE url, VALUE opts)
+{
+  const char *name = (RTEST(util_opt(opts, "names")) ? XATTR_ALL_NAMES : XATTR_ALL);
+  char *urlp;
+  char *value;
+  VALUE hash;
+
+  StringValue(url);
+  urlp = StringValuePtr(url);
+
+  if ((value = xattr_fetch(NULL, urlp, name)) == NULL) {
+    rb_sys_fail(urlp);
+  }
+  hash = xattr_parse(value);
+  free(value);
+
+  return hash;
+}
+
+/*
+  SMB.xattrs(url, :names => false) -> { :mode, :size, ..., :owner, :group, :acl => [...] }
+*/
+
+static VALUE smb_s_xattrs(int argc, VALUE *argv, VALUE self)
+{
+  VALUE url;
+  VALUE opts;
+
+  rb_scan_args(argc, argv, "11", &url, &opts);
+
+  return xattrs(url, opts);
+}
+
+/* SMB::File#xattrs(:names => false), see SMB.xattrs */
+static VALUE smbfile_xattrs(int argc, VALUE *argv, VALUE self)
+{
+  VALUE opts;
+
+  rb_scan_args(argc, argv, "01", &opts);
+
+  return xattrs(rb_funcall(self, rb_intern("url"), 0), opts);
+}
+
+static void xattr_push(struct smbpool *pool, int op, const char *url, bool dir)
+{
+  struct xattr_task *task = malloc(sizeof(struct xattr_task) + strlen(url));
+
+  task->op = op;
+  task->dir = dir;
+  strcpy(task->url, url);
+  pool_push(pool, &task->item);
+}
+
+static bool xattr_emit(struct smbpool *pool, const char *url, bool dir, int err, const char *value)
+{
+  size_t urllen = strlen(url);
+  size_t len = (value != NULL ? strlen(value) : 0);
+  struct xattr_result *r = malloc(sizeof(struct xattr_result) + urllen + len + 1);
+
+  r->err = err;
+  r->dir = dir;
+  r->value_off = urllen + 1;
+  memcpy(r->buf, url, urllen + 1);
+  memcpy(r->buf + r->value_off, value != NULL ? value : "", len + 1);
+
+  return pool_emit(pool, &r->item);
+}
+
+/*
+  A LIST task queues a GET for every entry and a LIST for every
+  subdirectory, so the attribute requests of one large directory are
+  spread over all workers.
+*/
+
+static void xattr_task(struct smbpool *pool, SMBCCTX *ctx, struct pool_item *item)
+{
+  struct xattr_task *task = (struct xattr_task*)item;
+  struct xattr_state *state = pool->data;
+  struct smbc_dirent *ent;
+  SMBCFILE *dh;
+  char *url;
+  char *value;
+
+  if (task->op == XATTR_GET) {
+    value = xattr_fetch(ctx, task->url, state->name);
+    xattr_emit(pool, task->url, task->dir, value == NULL ? errno : 0, value);
+    free(value);
+    free(task);
+    return;
+  }
+
+  if ((dh = smbc_getFunctionOpendir(ctx)(ctx, task->url)) == NULL) {
+    xattr_emit(pool, task->url, true, errno, NULL);
+    free(task);
+    return;
+  }
+  while ((ent = smbc_getFunctionReaddir(ctx)(ctx, dh)) != NULL && !pool_stopping(pool)) {
+    if (strcmp(ent->name, ".") == 0 || strcmp(ent->name, "..") == 0) {
+      continue;
+    }
+    if (ent->smbc_type != SMBC_DIR && ent->smbc_type != SMBC_FILE) {
+      continue;
+    }
+    url = ctx_url_join(task->url, ent->name);
+    xattr_push(pool, XATTR_GET, url, ent->smbc_type == SMBC_DIR);
+    if (ent->smbc_type == SMBC_DIR) {
+      xattr_push(pool, XATTR_LIST, url, true);
+    }
+    free(url);
+  }
+  smbc_getFunctionClosedir(ctx)(ctx, dh);
+  free(task);
+}
+
+static VALUE scan_run(VALUE arg)
+{
+  struct xattr_state *state = (struct xattr_state*)arg;
+  struct xattr_result *r;
+  VALUE url;
+  VALUE attrs;
+
+  while ((r = (struct xattr_result*)pool_next(state->pool)) != NULL) {
+    state->current = r;
+    url = rb_str_new2(r->buf);
+    if (r->err != 0) {
+      rb_ary_push(state->errors, rb_ary_new3(2, url, rb_syserr_new(r->err, r->buf)));
+      state->current = NULL;
+      free(r);
+      continue;
+    }
+    if (r->dir) {
+      state->directories++;
+    }
+    else {
+      state->files++;
+    }
+    attrs = xattr_parse(r->buf + r->value_off);
+    state->current = NULL;
+    free(r);
+    rb_yield_values(2, url, attrs);
+  }
+
+  return Qnil;
+}
+
+static VALUE scan_cleanup(VALUE arg)
+{
+  struct xattr_state *state = (struct xattr_state*)arg;
+
+  free(state->current);
+  state->current = NULL;
+  pool_free(state->pool);
+  state->pool = NULL;
+
+  return Qnil;
+}
+
+/*
+  SMB::Dir.scan_acls(url, opts = {}) { |url, attrs| ... }
+    -> { :files => n, :directories => n, :errors => [[url, exception], ...] }
+
+  Yields the attributes of url and of everything below it, as
+  SMB.xattrs returns them, in the order they arrive. Directories are
+  listed and attributes fetched on the worker pool. Options: :threads,
+  :names (account names instead of SIDs).
+*/
+
+static VALUE smbdir_s_scan_acls(int argc, VALUE *argv, VALUE self)
+{
+  VALUE url;
+  VALUE opts;
+  VALUE result;
+  struct xattr_state state;
+  char *urlp;
+  int dh;
+
+  RETURN_ENUMERATOR(self, argc, argv);
+
+  rb_scan_args(argc, argv, "11", &url, &opts);
+
+  StringValue(url);
+  urlp = StringValuePtr(url);
+
+  memset(&state, 0, sizeof(state));
+  state.name = (RTEST(util_opt(opts, "names")) ? XATTR_ALL_NAMES : XATTR_ALL);
+  state.errors = rb_ary_new();
+
+  /* the root goes through the global context first, see SMB::Dir.walk */
+  if ((dh = smbc_opendir(urlp)) < 0) {
+    rb_sys_fail(urlp);
+  }
+  smbc_closedir(dh);
+
+  state.pool = pool_new(pool_threads_opt(opts), xattr_task, &state);
+  xattr_push(state.pool, XATTR_GET, urlp, true);
+  xattr_push(state.pool, XATTR_LIST, urlp, true);
+
+  rb_ensure(scan_run, (VALUE)&state, scan_cleanup, (VALUE)&state);
+
+  result = rb_hash_new();
+  rb_hash_aset(result, ID2SYM(rb_intern("files")), LONG2NUM(state.files));
+  rb_hash_aset(result, ID2SYM(rb_intern("directories")), LONG2NUM(state.directories));
+  rb_hash_aset(result, ID2SYM(rb_intern("errors")), state.errors);
+
+  return result;
+}
+
+void init_smbxattr(void)
+{
+  rb_define_module_function(mSMB, "xattrs", smb_s_xattrs, -1);
+  rb_define_method(cSmbFile, "xattrs", smbfile_xattrs, -1);
+  rb_define_singleton_method(cSmbDir, "scan_acls", smbdir_s_scan_acls, -1);
+}
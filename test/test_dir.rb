@@ -86,6 +86,170 @@ class RubySMBDirTest < Test::Unit::TestCase
     assert !entries.include?("testfoo"), "testfoo dir didn't disappear"
   end
   
+  def test_06_walk
+    SMB::Dir.mkdir @base + "walkdir"
+    SMB::Dir.mkdir @base + "walkdir/sub"
+    SMB::Dir.mkdir @base + "walkdir/sub/deeper"
+    SMB::File.open @base + "walkdir/top", "w" do |f| f.write "abc" end
+    SMB::File.open @base + "walkdir/sub/deeper/bottom", "w" do |f| end
+
+    names = []
+    SMB::Dir.walk @base + "walkdir", :threads => 3 do |ent, st|
+      names.push ent.name
+      assert_equal 3, st.size if ent.name == "top"
+    end
+    assert_equal ["bottom", "deeper", "sub", "top"], names.sort
+
+    shallow = SMB::Dir.walk(@base + "walkdir", :depth => 1).map { |ent, st| ent.name }
+    assert_equal ["sub", "top"], shallow.sort
+
+    pruned = SMB::Dir.walk(@base + "walkdir", :prune => proc { |ent, st| ent.name == "sub" }).map { |ent, st| ent.name }
+    assert_equal ["sub", "top"], pruned.sort
+  ensure
+    SMB::File.delete @base + "walkdir/sub/deeper/bottom", @base + "walkdir/top" rescue nil
+    SMB::Dir.rmdir @base + "walkdir/sub/deeper" rescue nil
+    SMB::Dir.rmdir @base + "walkdir/sub" rescue nil
+    SMB::Dir.rmdir @base + "walkdir" rescue nil
+  end
+
+  def test_07_glob
+    SMB::Dir.mkdir @base + "globdir"
+    SMB::Dir.mkdir @base + "globdir/2026-01"
+    SMB::Dir.mkdir @base + "globdir/2026-01/nested"
+    SMB::Dir.mkdir @base + "globdir/2025-12"
+    ["2026-01/report_a.csv", "2026-01/nested/report_b.csv", "2025-12/report_c.csv",
+     "2026-01/other.csv"].each do |name|
+      SMB::File.open @base + "globdir/" + name, "w" do |f| end
+    end
+
+    assert_equal [@base + "globdir/2026-01/report_a.csv"],
+      SMB::Dir.glob(@base + "globdir/2026-*/report_*.csv")
+    assert_equal [@base + "globdir/2026-01/nested/report_b.csv", @base + "globdir/2026-01/report_a.csv"],
+      SMB::Dir.glob(@base + "globdir/2026-*/**/report_?.csv")
+    assert_equal 3, SMB::Dir.glob(@base + "globdir/**/report_*.csv").size
+    assert_equal [@base + "globdir/2025-12/", @base + "globdir/2026-01/"], SMB::Dir.glob(@base + "globdir/*/")
+    assert_equal [], SMB::Dir.glob(@base + "globdir/nothing/*")
+  ensure
+    ["2026-01/report_a.csv", "2026-01/nested/report_b.csv", "2025-12/report_c.csv",
+     "2026-01/other.csv"].each do |name|
+      SMB::File.delete @base + "globdir/" + name rescue nil
+    end
+    ["2026-01/nested", "2026-01", "2025-12", ""].each do |name|
+      SMB::Dir.rmdir @base + "globdir/" + name rescue nil
+    end
+  end
+
+  def test_08_cache
+    SMB::Dir.mkdir @base + "cachedir"
+    SMB::Dir.enable_cache 60, 2
+    assert_equal [".", ".."], SMB::Dir.entries(@base + "cachedir").sort
+    assert_equal 1, SMB::Dir.cache_size
+    SMB::File.open @base + "cachedir/new", "w" do |f| end
+    assert_equal [".", "..", "new"], SMB::Dir.entries(@base + "cachedir").sort
+    SMB.rename @base + "cachedir/new", @base + "cachedir/renamed"
+    assert_equal [".", "..", "renamed"], SMB::Dir.entries(@base + "cachedir/").sort
+    SMB::Dir.mkdir @base + "cachedir/sub"
+    assert SMB::Dir.entries(@base + "cachedir").include?("sub"), "mkdir didn't invalidate"
+    SMB::Dir.rmdir @base + "cachedir/sub"
+    SMB::File.delete @base + "cachedir/renamed"
+    assert_equal [".", ".."], SMB::Dir.entries(@base + "cachedir").sort
+
+    SMB::Dir.entries @base
+    SMB::Dir.entries @base + "cachedir"
+    SMB::Dir.foreach(@base + "cachedir") { }
+    assert_equal 2, SMB::Dir.cache_size
+
+    SMB::Dir.cache_ttl @base + "cachedir", 0
+    SMB::Dir.entries @base + "cachedir"
+    assert_equal 1, SMB::Dir.cache_size
+
+    # an override doesn't keep caching on after disable_cache
+    SMB::Dir.cache_ttl @base + "cachedir", 60
+    SMB::Dir.disable_cache
+    SMB::Dir.entries @base + "cachedir"
+    assert_equal 0, SMB::Dir.cache_size
+  ensure
+    SMB::Dir.disable_cache
+    SMB::Dir.rmdir @base + "cachedir" rescue nil
+  end
+
+  def test_09_entries_outlive_dir
+    SMB::Dir.mkdir @base + "arenadir"
+    SMB::File.open @base + "arenadir/file", "w" do |f| end
+    d = SMB::Dir.open @base + "arenadir"
+    ents = d.to_a
+    d.close
+    d = nil
+    GC.start
+    file = ents.find { |ent| ent.name == "file" }
+    assert file.file?, "file? failed"
+    assert_equal @base + "arenadir/file", file.url
+    assert_equal SMB::URL.new(@base + "arenadir/file"), file.smb_url
+    assert_equal "/arenadir/file", file.smb_url.path
+    assert_nil file.comment
+  ensure
+    SMB::File.delete @base + "arenadir/file" rescue nil
+    SMB::Dir.rmdir @base + "arenadir" rescue nil
+  end
+
+  def test_10_du
+    SMB::Dir.mkdir_p @base + "dudir/a/deep"
+    SMB::Dir.mkdir @base + "dudir/b"
+    { "a/x" => 100, "a/deep/y" => 1000, "b/z" => 10, "w" => 1 }.each do |name, size|
+      SMB::File.open(@base + "dudir/" + name, "w") { |f| f.write "." * size }
+    end
+
+    du = SMB::Dir.du @base + "dudir", :top => 2, :threads => 3
+    assert_equal 1111, du[:bytes]
+    assert_equal 4, du[:files]
+    assert_equal 3, du[:directories]
+    assert_equal [@base + "dudir", @base + "dudir/a", @base + "dudir/b"], du[:dirs].keys
+    assert_equal 1100, du[:dirs][@base + "dudir/a"][:bytes]
+    assert_equal [[@base + "dudir/a/deep/y", 1000], [@base + "dudir/a/x", 100]], du[:top]
+    assert_equal 1, SMB::Dir.du(@base + "dudir", :depth => 0)[:dirs].size
+  ensure
+    SMB.rm_rf @base + "dudir" rescue nil
+  end
+
+  def test_11_watch
+    SMB::Dir.mkdir @base + "watchdir"
+    dir = SMB::Dir.open @base + "watchdir"
+    writer = Thread.new do
+      sleep 0.5
+      SMB::File.open(@base + "watchdir/new", "w") { |f| f.write "x" }
+    end
+    events = []
+    dir.watch(:latency => 0.2) do |event, url, old|
+      events << [event, url]
+      break
+    end
+    writer.join
+    assert_equal [[:created, @base + "watchdir/new"]], events
+  ensure
+    dir.close rescue nil
+    SMB.rm_rf @base + "watchdir" rescue nil
+  end
+
+  def test_12_scan_acls
+    SMB::Dir.mkdir_p @base + "acldir/sub"
+    SMB::File.open(@base + "acldir/sub/f", "w") { |f| f.write "acl" }
+    attrs = SMB::File.open(@base + "acldir/sub/f") { |f| f.xattrs }
+    assert_equal 3, attrs[:size]
+    assert_kind_of Integer, attrs[:mode]
+    assert_kind_of String, attrs[:owner]
+    assert !attrs[:acl].empty?
+    assert attrs[:acl].all? { |ace| ace.key?(:trustee) && ace.key?(:mask) }
+    seen = {}
+    sum = SMB::Dir.scan_acls(@base + "acldir", :threads => 4) { |url, a| seen[url] = a }
+    assert_equal [@base + "acldir", @base + "acldir/sub", @base + "acldir/sub/f"], seen.keys.sort
+    assert_equal 1, sum[:files]
+    assert_equal 2, sum[:directories]
+    assert_equal [], sum[:errors]
+    assert_raises(Errno::ENOENT) { SMB.xattrs @base + "acldir/nope" }
+  ensure
+    SMB.rm_rf @base + "acldir" rescue nil
+  end
+
   def assert_no_dir(url)
     assert_exception Errno::ENOENT, "#{url} still exists" do
       SMB::Dir.open url do |dir|
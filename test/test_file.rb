@@ -122,6 +122,52 @@ class RubySMBFileTest < Test::Unit::TestCase
       SMB::File.delete @base + "testfile#{i}"
     end
   end
+
+  def test_06_each_chunk
+    url = @base + "chunks.test"
+    data = (0...10000).map { |i| (i % 256).chr }.join
+    SMB::File.open(url, "w") { |f| f.write data }
+    SMB::File.open url do |f|
+      chunks = []
+      ids = []
+      f.each_chunk(3000, :reuse => true) do |chunk|
+        ids << chunk.object_id
+        chunks << chunk.dup
+      end
+      assert_equal [3000, 3000, 3000, 1000], chunks.map { |c| c.size }
+      assert_equal data, chunks.join
+      assert_equal 1, ids.uniq.size
+      f.rewind
+      kept = []
+      # tail slices share the chunk's buffer
+      f.each_chunk(3000, :reuse => true) { |chunk| kept << chunk[-500, 500] }
+      assert_equal chunks.map { |c| c[-500, 500] }, kept
+      f.rewind
+      assert_equal 4, f.each_chunk(3000).map { |c| c.object_id }.uniq.size
+      f.rewind
+      bytes = []
+      f.each_byte { |b| bytes << b }
+      assert_equal data.unpack("C*"), bytes
+    end
+  ensure
+    SMB::File.delete url rescue nil
+  end
+
+  def test_07_lazy_buffer
+    url = @base + "buffer.test"
+    f = SMB::File.open url, "w"
+    f.write "buffered"
+    assert_equal "", f.buf
+    f.close
+    f = SMB::File.open url
+    assert_equal "", f.buf
+    assert_equal "buf", f.read(3)
+    assert_equal "buffered", f.buf
+    f.close
+    assert_equal "", f.buf
+  ensure
+    SMB::File.delete url rescue nil
+  end
 end
 
 RUNIT::CUI::TestRunner.new.run RubySMBFileTest.suite